@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for <avr/eeprom.h>
+ *
+ * 1KB of EEPROM owned by sim.c, erased to 0xFF at start. A byte that
+ * really changes takes the 3.3ms write time of the 328P.
+ */
+#ifndef HOST_AVR_EEPROM_H_
+#define HOST_AVR_EEPROM_H_
+
+#include <stdint.h>
+
+#define E2END	0x3FF
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t data);
+void eeprom_update_byte(uint8_t *addr, uint8_t data);	// Only writes if it differs
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for <avr/interrupt.h>
+ */
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#define sei()		(SREG |= (1 << SREG_I))
+#define cli()		(SREG &= ~(1 << SREG_I))
+
+// Vectors become plain functions that sim.c calls when it raises them
+#define ISR(vector)	void vector(void)
+
+void TIMER0_OVF_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER1_CAPT_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_COMPB_vect(void);
+void TIMER2_COMPA_vect(void);
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+
+#endif
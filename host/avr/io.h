@@ -0,0 +1,220 @@
+/*
+ * Host stand-in for <avr/io.h>
+ *
+ * Every ATmega328P register used by main.c is a plain variable owned by
+ * sim.c, bit positions match the datasheet.
+ *
+ * UDR0 is 16 bits wide here so sim.c can park an impossible value in it
+ * and tell whether the UDRE interrupt actually wrote a byte. SPDR works
+ * the same way behind an accessor, see below.
+ */
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#define HOST_BUILD	1
+
+// main.c hooks, see the top of main.c
+void sim_idle(void);
+void sim_op(uint8_t op);
+#define SIM_IDLE()	sim_idle()
+#define SIM_OP(op)	sim_op(op)
+
+// SRAM map for main.c's MEM, a stand in stack area in sim.c. Nothing runs
+// on it, MEM just reports it as SIM_STACK_USED deep and never deeper
+#define SIM_RAM_LEN		512
+#define SIM_STACK_USED	64
+extern uint8_t sim_ram[SIM_RAM_LEN];
+#define RAM_START		(&sim_ram[0])
+#define RAM_LOW			(&sim_ram[0])
+#define RAM_TOP			(&sim_ram[SIM_RAM_LEN])
+#define RAM_SP()		(&sim_ram[SIM_RAM_LEN - SIM_STACK_USED])
+
+#define _BV(bit)	(1 << (bit))
+
+#define SIM_REG8(name)		extern volatile uint8_t name;
+#define SIM_REG16(name)		extern volatile uint16_t name;
+
+// Ports
+SIM_REG8(PINB)	SIM_REG8(DDRB)	SIM_REG8(PORTB)
+SIM_REG8(PINC)	SIM_REG8(DDRC)	SIM_REG8(PORTC)
+SIM_REG8(PIND)	SIM_REG8(DDRD)	SIM_REG8(PORTD)
+
+// Timer 0
+SIM_REG8(TCCR0A)	SIM_REG8(TCCR0B)	SIM_REG8(TCNT0)
+SIM_REG8(OCR0A)		SIM_REG8(OCR0B)		SIM_REG8(TIMSK0)	SIM_REG8(TIFR0)
+
+// Timer 1
+SIM_REG8(TCCR1A)	SIM_REG8(TCCR1B)	SIM_REG8(TCCR1C)
+SIM_REG16(TCNT1)	SIM_REG16(OCR1A)	SIM_REG16(OCR1B)	SIM_REG16(ICR1)
+SIM_REG8(TIMSK1)
+
+// Timer 2
+SIM_REG8(TCCR2A)	SIM_REG8(TCCR2B)	SIM_REG8(TCNT2)
+SIM_REG8(OCR2A)		SIM_REG8(OCR2B)		SIM_REG8(TIMSK2)
+
+// TIFR1, TIFR2. Write 1 to clear: every access hands out a copy of the flags
+// and sim.c clears the flags set in the copy, so a |= clears them all like
+// the chip does. The firmware never reads these two, TIFR0 is a plain variable
+volatile uint8_t *sim_tifr(uint8_t timer);
+#define TIFR1	(*sim_tifr(1))
+#define TIFR2	(*sim_tifr(2))
+
+SIM_REG8(GTCCR)
+SIM_REG8(SREG)
+
+// USART 0
+SIM_REG16(UDR0)		SIM_REG8(UCSR0A)	SIM_REG8(UCSR0B)	SIM_REG8(UCSR0C)
+SIM_REG8(UBRR0L)	SIM_REG8(UBRR0H)
+
+// SPI. Any SPDR access clears SPIF like the chip does after the SPSR read,
+// the value below 0x100 is a byte written to send, sim.c puts the byte it
+// shifted in back as 0x100 | byte
+SIM_REG8(SPCR)	SIM_REG8(SPSR)
+volatile uint16_t *sim_spdr(void);
+#define SPDR	(*sim_spdr())
+
+#undef SIM_REG8
+#undef SIM_REG16
+
+// Port pins
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PINB6 6
+#define PINB7 7
+#define PINC0 0
+#define PINC1 1
+#define PINC2 2
+#define PINC3 3
+#define PINC4 4
+#define PINC5 5
+#define PIND0 0
+#define PIND1 1
+#define PIND2 2
+#define PIND3 3
+#define PIND4 4
+#define PIND5 5
+#define PIND6 6
+#define PIND7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+// Timer 0 bits
+#define WGM00	0
+#define WGM01	1
+#define COM0B0	4
+#define COM0B1	5
+#define COM0A0	6
+#define COM0A1	7
+#define CS00	0
+#define CS01	1
+#define CS02	2
+#define WGM02	3
+#define TOIE0	0
+#define OCIE0A	1
+#define OCIE0B	2
+#define TOV0	0
+#define OCF0A	1
+#define OCF0B	2
+
+// Timer 1 bits
+#define WGM10	0
+#define WGM11	1
+#define COM1B0	4
+#define COM1B1	5
+#define COM1A0	6
+#define COM1A1	7
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define WGM12	3
+#define WGM13	4
+#define ICES1	6
+#define ICNC1	7
+#define TOIE1	0
+#define OCIE1A	1
+#define OCIE1B	2
+#define ICIE1	5
+#define TOV1	0
+#define OCF1A	1
+#define OCF1B	2
+#define ICF1	5
+
+// Timer 2 bits
+#define WGM20	0
+#define WGM21	1
+#define COM2B0	4
+#define COM2B1	5
+#define COM2A0	6
+#define COM2A1	7
+#define CS20	0
+#define CS21	1
+#define CS22	2
+#define WGM22	3
+#define TOIE2	0
+#define OCIE2A	1
+#define OCIE2B	2
+#define TOV2	0
+#define OCF2A	1
+#define OCF2B	2
+
+#define SREG_I	7
+
+#define PSRSYNC	0
+#define TSM		7
+
+// USART 0 bits
+#define MPCM0	0
+#define U2X0	1
+#define UPE0	2
+#define DOR0	3
+#define FE0		4
+#define UDRE0	5
+#define TXC0	6
+#define RXC0	7
+#define TXB80	0
+#define RXB80	1
+#define UCSZ02	2
+#define TXEN0	3
+#define RXEN0	4
+#define UDRIE0	5
+#define TXCIE0	6
+#define RXCIE0	7
+#define UCPOL0	0
+#define UCSZ00	1
+#define UCSZ01	2
+#define USBS0	3
+
+// SPI bits
+#define SPR0	0
+#define SPR1	1
+#define CPHA	2
+#define CPOL	3
+#define MSTR	4
+#define DORD	5
+#define SPE		6
+#define SPIE	7
+#define SPI2X	0
+#define WCOL	6
+#define SPIF	7
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for <avr/pgmspace.h>, flash and RAM are one address space
+ * here so PROGMEM data is read like anything else
+ */
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(str)				(str)
+#define pgm_read_byte(addr)		(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)		(*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)	(*(const uint32_t *)(addr))
+#define memcpy_P				memcpy
+
+#endif
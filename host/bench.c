@@ -0,0 +1,421 @@
+/*
+ * bench.c
+ *
+ * Boots main.c on the simulated 328P and replays a script into the UART,
+ * one report line per step: simulated time, bytes in and out, escape
+ * sequences, cursor bytes saved, interpret() calls and the Timer1 state.
+ *
+ * Script lines:
+ *	# text			comment
+ *	text			typed into the shell followed by ENTER
+ *	@ keys			raw keys, \r \n \e \t \\ \xNN and ^X style control chars
+ *	~ ms			let ms of simulated time pass
+ *	= REG value		fail the run if REG != value (see bench_regs[])
+ *	= REG value tol	fail it if REG is more than tol away from value, for
+ *					anything the sim only gets to within a few quanta
+ *	= HI_Pxn us		same for the last high pulse on a driven PORTB / PORTD pin,
+ *					ie. HI_PD6, sampled every SIM_QUANTUM
+ *	^ period hi		pulse train into ICP1 (PB0) from now on, us, hi 0 stops it
+ *
+ * CAP_* checks read main.c cap_acc[] in 0.5us ticks, AVG and JIT are << 4.
+ *
+ * A step ends once the firmware has eaten all its input, the UART is quiet,
+ * no Timer2 wait is running and that held for BENCH_SETTLE_MS.
+ *
+ * Usage: bench [-q] [-o raw_output] [-e eeprom_image] [-s sd_image] script
+ *
+ * -e keeps the EEPROM in a file across runs, scripts/boot/ runs in order
+ * against one image so each script there is the next power cycle.
+ * -s puts an SD card with that image on the SPI bus, see mkfat.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "sim.h"
+
+#define BENCH_SETTLE_MS		30			// Longer than the 20ms escape timeout
+#define BENCH_TIMEOUT_MS	10000		// Give up on a step, i.e. a Zepto loop nobody stops
+#define BENCH_LINE_LEN		256
+
+int fw_main(void);						// main.c, renamed by the Makefile
+
+extern volatile uint8_t tx_head, tx_tail;
+extern volatile uint8_t rx_head, rx_tail;
+extern uint32_t term_bytes_saved;
+extern void (*sim_op_hook)(uint8_t op);
+extern uint32_t cap_acc[];				// main.c CAP_ACC[], 6 words each: ct last avg jit min max
+extern volatile uint8_t log_ct;
+extern volatile uint16_t log_lost;
+extern uint8_t fs_free;
+extern uint16_t sd_lines;
+extern volatile uint16_t sd_late;
+
+typedef struct{
+	char kind;							// 't' typed, '@' keys, '~' wait, '=' expect, '^' ICP1 input
+	char text[BENCH_LINE_LEN];
+	char reg[16];						// '=' register name
+	uint8_t keys[BENCH_LINE_LEN];
+	uint16_t key_ct;
+	uint32_t val;
+	uint32_t val_2;						// '^' hi time, '=' tolerance
+} BENCH_STEP;
+
+typedef struct{
+	const char *name;
+	volatile void *reg;
+	uint8_t wide;
+	uint8_t shift;
+	uint8_t mask;
+} BENCH_REG;
+
+static const BENCH_REG bench_regs[] = {
+	{"OCR1A",	&OCR1A,		1, 0, 0},
+	{"OCR1B",	&OCR1B,		1, 0, 0},
+	{"ICR1",	&ICR1,		1, 0, 0},
+	{"TCCR1A",	&TCCR1A,	0, 0, 0xFF},
+	{"TCCR1B",	&TCCR1B,	0, 0, 0xFF},
+	{"TIMSK1",	&TIMSK1,	0, 0, 0xFF},
+	{"CS",		&TCCR1B,	0, 0, 0x07},
+	{"ICNC",	&TCCR1B,	0, ICNC1, 0x01},	// ICES1 next to it flips on every edge
+	{"OUT",		&DDRB,		0, PINB2, 0x01},
+	{"DDRB",	&DDRB,		0, 0, 0xFF},
+	{"PORTB",	&PORTB,		0, 0, 0xFF},
+	{"DDRD",	&DDRD,		0, 0, 0xFF},
+	{"PORTD",	&PORTD,		0, 0, 0xFF},
+	{"CAP_N",	&cap_acc[0],	2, 0, 0},
+	{"CAP_PER",	&cap_acc[1],	2, 0, 0},
+	{"CAP_AVG",	&cap_acc[2],	2, 0, 0},
+	{"CAP_JIT",	&cap_acc[3],	2, 0, 0},
+	{"CAP_MIN",	&cap_acc[4],	2, 0, 0},
+	{"CAP_MAX",	&cap_acc[5],	2, 0, 0},
+	{"CAP_HI",	&cap_acc[7],	2, 0, 0},
+	{"CAP_HAVG",&cap_acc[8],	2, 0, 0},
+	{"LOG_N",	&log_ct,	0, 0, 0xFF},
+	{"LOG_LOST",&log_lost,	1, 0, 0},
+	{"EE_WR",	&sim_ee_writes,	2, 0, 0},
+	{"FS_FREE",	&fs_free,	0, 0, 0xFF},
+	{"SD_LINES",&sd_lines,	1, 0, 0},
+	{"SD_LATE",	&sd_late,	1, 0, 0},
+};
+#define BENCH_REG_CT	(sizeof(bench_regs) / sizeof(bench_regs[0]))
+
+static BENCH_STEP *steps = 0;
+static uint32_t step_ct = 0;
+static uint32_t step_at = 0;
+static uint8_t step_live = 0;			// Current step has started
+static uint8_t booted = 0;
+
+static uint64_t quiet_since = 0;
+static uint64_t step_start = 0;
+static uint64_t wait_until = 0;
+
+static uint32_t out_bytes = 0, out_esc = 0, ops_ = 0;
+static uint32_t saved_start = 0;
+static uint32_t tot_out = 0, tot_esc = 0, tot_ops = 0, tot_in = 0;
+static uint32_t failures = 0, timeouts = 0;
+
+static uint32_t pin_hi_us[16];			// PB0 - PB7, PD0 - PD7
+static uint64_t pin_rise[16];
+static uint16_t pin_last = 0;
+
+static FILE *raw_out = 0;
+static uint8_t quiet_ = 0;
+
+static void bench_sink(uint8_t data){
+	out_bytes += 1;
+	if(data == 27) out_esc += 1;
+	if(raw_out) fputc(data, raw_out);
+}
+
+static void bench_op(uint8_t op){
+	(void)op;
+	ops_ += 1;
+}
+
+static uint32_t bench_reg_read(const BENCH_REG *r){
+	if(r->wide == 2) return *(uint32_t *)r->reg;
+	if(r->wide) return *(volatile uint16_t *)r->reg;
+	return (*(volatile uint8_t *)r->reg >> r->shift) & r->mask;
+}
+
+static const BENCH_REG *bench_reg_find(const char *name){
+	static BENCH_REG pin_ = {"HI_P", 0, 2, 0, 0};
+	if(!strncmp(name, "HI_P", 4) && (name[4] == 'B' || name[4] == 'D') && name[5] >= '0' && name[5] <= '7' && !name[6]){
+		pin_.reg = &pin_hi_us[(name[4] == 'D') * 8 + name[5] - '0'];
+		return &pin_;
+	}
+	for(uint32_t n = 0; n < BENCH_REG_CT; n++){
+		if(!strcmp(bench_regs[n].name, name)) return &bench_regs[n];
+	}
+	return 0;
+}
+
+static void bench_pins(){
+	uint16_t now_ = ((uint16_t)(PORTD & DDRD) << 8) | (PORTB & DDRB);
+	uint16_t chg_ = now_ ^ pin_last;
+	for(uint8_t n = 0; n < 16; n++){
+		if(!(chg_ & (1 << n))) continue;
+		if(now_ & (1 << n)){
+			pin_rise[n] = sim_cycles;
+		} else {
+			pin_hi_us[n] = (uint32_t)((sim_cycles - pin_rise[n]) / (SIM_F_CPU / 1000000UL));
+		}
+	}
+	pin_last = now_;
+}
+
+static uint8_t bench_is_quiet(){
+	return !sim_rx_pending() && rx_head == rx_tail
+		&& tx_head == tx_tail && sim_tx_idle()
+		&& !(TIMSK2 & (1 << OCIE2A));
+}
+
+static uint16_t bench_keys(const char *src, uint8_t *dst){
+	uint16_t n = 0;
+	while(*src && n < BENCH_LINE_LEN){
+		if(*src == '^' && src[1]){
+			dst[n++] = src[1] & 0x1F;
+			src += 2;
+		} else
+		if(*src == '\\' && src[1]){
+			src += 1;
+			switch(*src){
+				case 'r':	dst[n++] = '\r';	src += 1;	break;
+				case 'n':	dst[n++] = '\n';	src += 1;	break;
+				case 'e':	dst[n++] = 27;		src += 1;	break;
+				case 't':	dst[n++] = '\t';	src += 1;	break;
+				case 'x':{							// Exactly 2 hex digits
+					char hex_[3] = {src[1], src[1] ? src[2] : 0, 0};
+					dst[n++] = (uint8_t)strtoul(hex_, 0, 16);
+					src += 1 + strlen(hex_);
+				}
+				break;
+				default:	dst[n++] = *src;	src += 1;	break;
+			}
+		} else {
+			dst[n++] = *src++;
+		}
+	}
+	return n;
+}
+
+static void bench_load(const char *path){
+	char line_[BENCH_LINE_LEN];
+	FILE *f = fopen(path, "r");
+	if(!f){
+		perror(path);
+		exit(2);
+	}
+
+	while(fgets(line_, sizeof(line_), f)){
+		line_[strcspn(line_, "\r\n")] = 0;
+		if(!line_[0] || line_[0] == '#') continue;
+
+		steps = realloc(steps, (step_ct + 1) * sizeof(BENCH_STEP));
+		BENCH_STEP *s = &steps[step_ct++];
+		memset(s, 0, sizeof(*s));
+		snprintf(s->text, sizeof(s->text), "%s", line_);
+
+		switch(line_[0]){
+			case '@':
+				s->kind = '@';
+				s->key_ct = bench_keys(line_ + 1 + (line_[1] == ' '), s->keys);
+			break;
+			case '~':
+				s->kind = '~';
+				s->val = strtoul(line_ + 1, 0, 10);
+			break;
+			case '^':
+				s->kind = '^';
+				if(sscanf(line_ + 1, "%u %u", &s->val, &s->val_2) != 2){
+					fprintf(stderr, "%s: bad input '%s'\n", path, line_);
+					exit(2);
+				}
+			break;
+			case '=':{
+				s->kind = '=';
+				if(sscanf(line_ + 1, "%15s %i %u", s->reg, (int *)&s->val, &s->val_2) < 2 || !bench_reg_find(s->reg)){
+					fprintf(stderr, "%s: bad expect '%s'\n", path, line_);
+					exit(2);
+				}
+			}
+			break;
+			default:
+				s->kind = 't';
+				s->key_ct = bench_keys(line_, s->keys);
+				if(s->key_ct < BENCH_LINE_LEN) s->keys[s->key_ct++] = '\r';
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static void bench_report(BENCH_STEP *s, const char *note){
+	uint32_t saved_ = term_bytes_saved - saved_start;
+	tot_out += out_bytes;
+	tot_esc += out_esc;
+	tot_ops += ops_;
+	tot_in += s->key_ct;
+
+	if(!quiet_ || note){
+		printf("%4u %8.2f %4u %6u %5u %6u %4u  %u %5u %5u %u  %-24.24s%s\n",
+			step_at + 1, (double)(sim_cycles - step_start) / SIM_CYC_PER_MS,
+			s->key_ct, out_bytes, out_esc, saved_, ops_,
+			TCCR1B & 0x07, OCR1A, OCR1B, (DDRB >> PINB2) & 1,
+			s->text, note ? note : "");
+	}
+}
+
+static void bench_done(){
+	printf("total: %u steps, %u bytes in, %u bytes out, %u escapes, %u ops, %u timeouts, %u failed\n",
+		step_ct, tot_in, tot_out, tot_esc, tot_ops, timeouts, failures);
+	if(raw_out) fclose(raw_out);
+	exit((failures || timeouts) ? 1 : 0);
+}
+
+static void bench_start(BENCH_STEP *s){
+	step_live = 1;
+	step_start = sim_cycles;
+	quiet_since = sim_cycles;
+	out_bytes = 0;
+	out_esc = 0;
+	ops_ = 0;
+	saved_start = term_bytes_saved;
+
+	switch(s->kind){
+		case '~':
+			wait_until = sim_cycles + (uint64_t)s->val * SIM_CYC_PER_MS;
+		break;
+		case '^':
+			sim_icp_set(s->val * (SIM_CYC_PER_MS / 1000), s->val_2 * (SIM_CYC_PER_MS / 1000));
+		break;
+		case '@':
+		case 't':
+			for(uint16_t n = 0; n < s->key_ct; n++){
+				sim_rx_push(s->keys[n]);
+			}
+		break;
+	}
+}
+
+static void bench_next(){
+	step_live = 0;
+	step_at += 1;
+	if(step_at >= step_ct) bench_done();
+}
+
+// Runs after every simulated quantum
+static void bench_tick(){
+	bench_pins();
+	if(!bench_is_quiet()){
+		quiet_since = sim_cycles;
+	}
+	uint8_t settled_ = (sim_cycles - quiet_since) >= (uint64_t)BENCH_SETTLE_MS * SIM_CYC_PER_MS;
+
+	if(!booted){
+		if(!settled_) return;
+		booted = 1;
+		if(!quiet_){
+			printf("boot: %u bytes out, %u escapes\n", out_bytes, out_esc);
+			printf("step       ms   in    out   esc  saved  ops CS OCR1A OCR1B O  input\n");
+		}
+		if(!step_ct) bench_done();
+	}
+
+	BENCH_STEP *s = &steps[step_at];
+	if(!step_live){
+		bench_start(s);
+		if(s->kind != '=' && s->kind != '^'){
+			return;
+		}
+	}
+
+	switch(s->kind){
+		case '^':
+			if(!quiet_) bench_report(s, 0);
+			bench_next();
+		break;
+
+		case '=':{
+			const BENCH_REG *r = bench_reg_find(s->reg);
+			uint32_t got_ = bench_reg_read(r);
+			uint32_t off_ = (got_ > s->val) ? got_ - s->val : s->val - got_;
+			if(off_ > s->val_2){
+				char note_[64];
+				if(s->val_2){
+					snprintf(note_, sizeof(note_), "  FAIL %s = %u, want %u +-%u", s->reg, got_, s->val, s->val_2);
+				} else {
+					snprintf(note_, sizeof(note_), "  FAIL %s = %u, want %u", s->reg, got_, s->val);
+				}
+				failures += 1;
+				bench_report(s, note_);
+			} else if(!quiet_){
+				bench_report(s, 0);
+			}
+			bench_next();
+		}
+		break;
+
+		case '~':
+			if(sim_cycles < wait_until) return;
+			bench_report(s, 0);
+			bench_next();
+		break;
+
+		default:
+			if(settled_){
+				bench_report(s, 0);
+				bench_next();
+			} else
+			if(sim_cycles - step_start > (uint64_t)BENCH_TIMEOUT_MS * SIM_CYC_PER_MS){
+				timeouts += 1;
+				bench_report(s, "  TIMEOUT");
+				bench_next();
+			}
+		break;
+	}
+}
+
+int main(int argc, char **argv){
+	const char *script_ = 0;
+
+	for(int n = 1; n < argc; n++){
+		if(!strcmp(argv[n], "-q")){
+			quiet_ = 1;
+		} else
+		if(!strcmp(argv[n], "-o") && n + 1 < argc){
+			raw_out = fopen(argv[++n], "wb");
+			if(!raw_out){
+				perror(argv[n]);
+				return 2;
+			}
+		} else
+		if(!strcmp(argv[n], "-e") && n + 1 < argc){
+			if(!sim_ee_file(argv[++n])){
+				perror(argv[n]);
+				return 2;
+			}
+		} else
+		if(!strcmp(argv[n], "-s") && n + 1 < argc){
+			if(!sim_sd_file(argv[++n])){
+				perror(argv[n]);
+				return 2;
+			}
+		} else {
+			script_ = argv[n];
+		}
+	}
+	if(!script_){
+		fprintf(stderr, "usage: %s [-q] [-o raw_output] [-e eeprom_image] [-s sd_image] script\n", argv[0]);
+		return 2;
+	}
+
+	bench_load(script_);
+	sim_tx_sink = bench_sink;
+	sim_idle_hook = bench_tick;
+	sim_op_hook = bench_op;
+
+	fw_main();							// Never returns, bench_done() exits
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * mkfat.c
+ *
+ * Builds the SD card image bench -s reads: an MBR with one FAT16 partition
+ * holding the given files in its root directory, 8.3 upper case names.
+ * A file ending in .hex is stored as .BIN, its hex pairs turned into bytes
+ * and # comments dropped, so compiled profiles can be kept as text.
+ *
+ * Usage: mkfat image file...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define BLK			512
+#define PART_LBA	8				// Partition start, the reader has to go through the MBR
+#define CLUSTERS	4100			// 4085 or more makes it FAT16
+#define FAT_SECS	(((CLUSTERS + 2) * 2 + BLK - 1) / BLK)
+#define ROOT_ENTS	512
+#define ROOT_SECS	(ROOT_ENTS * 32 / BLK)
+#define DATA_LBA	(PART_LBA + 1 + 2 * FAT_SECS + ROOT_SECS)
+#define PART_SECS	(1 + 2 * FAT_SECS + ROOT_SECS + CLUSTERS)
+
+static uint8_t img[(PART_LBA + PART_SECS) * BLK];
+
+static void put16(uint8_t *p, uint16_t v){
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static int load(const char *path, uint8_t **data, long *len){
+	FILE *f = fopen(path, "rb");
+	if(!f) return 0;
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	*data = malloc(*len + 1);
+	*len = fread(*data, 1, *len, f);
+	fclose(f);
+
+	const char *dot_ = strrchr(path, '.');
+	if(dot_ && !strcmp(dot_, ".hex")){			// Hex pairs to bytes, # to the end of the line and anything else is skipped
+		long n_ = 0;
+		for(long q = 0; q + 1 < *len; q++){
+			if((*data)[q] == '#'){
+				while(q + 1 < *len && (*data)[q + 1] != '\n') q++;
+				continue;
+			}
+			if(isxdigit((*data)[q]) && isxdigit((*data)[q + 1])){
+				char pair_[3] = {(*data)[q], (*data)[q + 1], 0};
+				(*data)[n_++] = (uint8_t)strtol(pair_, 0, 16);
+				q += 1;
+			}
+		}
+		*len = n_;
+	}
+	return 1;
+}
+
+static void name83(const char *path, uint8_t *out){
+	const char *base_ = strrchr(path, '/');
+	base_ = base_ ? base_ + 1 : path;
+	const char *dot_ = strrchr(base_, '.');
+	const char *ext_ = (dot_ && !strcmp(dot_, ".hex")) ? "bin" : (dot_ ? dot_ + 1 : "");
+
+	memset(out, ' ', 11);
+	for(int q = 0; q < 8 && base_ + q != dot_ && base_[q]; q++) out[q] = toupper(base_[q]);
+	for(int q = 0; q < 3 && ext_[q]; q++) out[8 + q] = toupper(ext_[q]);
+}
+
+int main(int argc, char **argv){
+	if(argc < 2){
+		fprintf(stderr, "usage: %s image file...\n", argv[0]);
+		return 2;
+	}
+
+	uint8_t *mbr_ = img;
+	mbr_[0x1BE + 4] = 0x06;						// FAT16
+	put32(&mbr_[0x1C6], PART_LBA);
+	put32(&mbr_[0x1CA], PART_SECS);
+	put16(&mbr_[0x1FE], 0xAA55);
+
+	uint8_t *bs_ = &img[PART_LBA * BLK];
+	bs_[0] = 0xEB;
+	bs_[1] = 0x3C;
+	bs_[2] = 0x90;
+	memcpy(&bs_[3], "MKFAT   ", 8);
+	put16(&bs_[0x0B], BLK);
+	bs_[0x0D] = 1;								// Sectors per cluster
+	put16(&bs_[0x0E], 1);						// Reserved
+	bs_[0x10] = 2;								// FATs
+	put16(&bs_[0x11], ROOT_ENTS);
+	put16(&bs_[0x13], PART_SECS);
+	bs_[0x15] = 0xF8;
+	put16(&bs_[0x16], FAT_SECS);
+	put32(&bs_[0x1C], PART_LBA);
+	bs_[0x26] = 0x29;
+	memcpy(&bs_[0x2B], "PWM        FAT16   ", 19);
+	put16(&bs_[0x1FE], 0xAA55);
+
+	uint8_t *fat_ = &img[(PART_LBA + 1) * BLK];
+	uint8_t *root_ = &img[(PART_LBA + 1 + 2 * FAT_SECS) * BLK];
+	put16(&fat_[0], 0xFFF8);
+	put16(&fat_[2], 0xFFFF);
+
+	memcpy(root_, "PWM        ", 11);			// Volume label, the reader skips it
+	root_[11] = 0x08;
+	root_ += 32;
+
+	uint32_t cl_ = 2;
+	for(int a = 2; a < argc; a++, root_ += 32){
+		uint8_t *data_;
+		long len_;
+		if(!load(argv[a], &data_, &len_)){
+			perror(argv[a]);
+			return 1;
+		}
+		uint32_t need_ = (len_ + BLK - 1) / BLK;
+		if(cl_ + need_ > CLUSTERS + 2){
+			fprintf(stderr, "%s: image full\n", argv[a]);
+			return 1;
+		}
+
+		name83(argv[a], root_);
+		root_[11] = 0x20;						// Archive
+		put16(&root_[26], need_ ? cl_ : 0);
+		put32(&root_[28], len_);
+		for(uint32_t q = 0; q < need_; q++, cl_++){
+			put16(&fat_[cl_ * 2], (q + 1 < need_) ? cl_ + 1 : 0xFFFF);
+		}
+		memcpy(&img[(DATA_LBA + (root_[26] | root_[27] << 8) - 2) * BLK], data_, len_);
+		free(data_);
+	}
+	memcpy(&fat_[FAT_SECS * BLK], fat_, FAT_SECS * BLK);	// Second copy
+
+	FILE *f = fopen(argv[1], "wb");
+	if(!f || fwrite(img, 1, sizeof(img), f) != sizeof(img)){
+		perror(argv[1]);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,500 @@
+/*
+ * sim.c
+ *
+ * Register file and peripheral models for the host build:
+ *	Timer0	normal mode, TOV
+ *	Timer1	up counting to the WGM TOP, TOV / OCF1A / OCF1B, no output pins,
+ *			input capture from a pulse train on ICP1 (PB0), see sim_icp_set()
+ *	Timer2	normal and CTC, OCF2A / TOV2
+ *	USART0	UDR0 <-> byte streams at the UBRR0 line rate
+ *	EEPROM	1KB, byte writes take SIM_EE_WRITE_US of simulated time
+ *	SPI		master, one byte per sim_idle(), to an SD card on CS PC0 that
+ *			reads from an image file, see sim_sd_file(). PB2 (SS) as an input
+ *			without pull up reads low and drops master mode like the chip
+ * Interrupts are taken in 328P vector priority whenever SREG I is set.
+ * An ISR may call sim_idle() itself to wait on a counter, the timers are
+ * stepped so that nested calls see every tick exactly once.
+ * TIFR1 and TIFR2 are write 1 to clear, see sim_tifr(): a read-modify-write
+ * clears every pending flag, as on the chip. TIFR0 is a plain variable.
+ * A stale flag fires its ISR as soon as the enable bit is set. ICF1 is the
+ * exception, captures are only flagged while ICIE1 is set and the capture
+ * ISR runs once per capture, whatever the firmware writes to TIFR1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+
+#define SIM_REG8(name)		volatile uint8_t name;
+#define SIM_REG16(name)		volatile uint16_t name;
+
+SIM_REG8(PINB)	SIM_REG8(DDRB)	SIM_REG8(PORTB)
+SIM_REG8(PINC)	SIM_REG8(DDRC)	SIM_REG8(PORTC)
+SIM_REG8(PIND)	SIM_REG8(DDRD)	SIM_REG8(PORTD)
+
+SIM_REG8(TCCR0A)	SIM_REG8(TCCR0B)	SIM_REG8(TCNT0)
+SIM_REG8(OCR0A)		SIM_REG8(OCR0B)		SIM_REG8(TIMSK0)	SIM_REG8(TIFR0)
+
+SIM_REG8(TCCR1A)	SIM_REG8(TCCR1B)	SIM_REG8(TCCR1C)
+SIM_REG16(TCNT1)	SIM_REG16(OCR1A)	SIM_REG16(OCR1B)	SIM_REG16(ICR1)
+SIM_REG8(TIMSK1)
+
+SIM_REG8(TCCR2A)	SIM_REG8(TCCR2B)	SIM_REG8(TCNT2)
+SIM_REG8(OCR2A)		SIM_REG8(OCR2B)		SIM_REG8(TIMSK2)
+
+SIM_REG8(GTCCR)
+SIM_REG8(SREG)
+
+SIM_REG16(UDR0)		SIM_REG8(UCSR0A)	SIM_REG8(UCSR0B)	SIM_REG8(UCSR0C)
+SIM_REG8(UBRR0L)	SIM_REG8(UBRR0H)
+
+SIM_REG8(SPCR)	SIM_REG8(SPSR)
+
+#undef SIM_REG8
+#undef SIM_REG16
+
+// Vectors main.c doesn't define yet
+__attribute__((weak)) void TIMER0_OVF_vect(void){}
+__attribute__((weak)) void TIMER1_OVF_vect(void){}
+__attribute__((weak)) void TIMER1_CAPT_vect(void){}
+__attribute__((weak)) void TIMER1_COMPA_vect(void){}
+__attribute__((weak)) void TIMER1_COMPB_vect(void){}
+__attribute__((weak)) void TIMER2_COMPA_vect(void){}
+__attribute__((weak)) void USART_RX_vect(void){}
+__attribute__((weak)) void USART_UDRE_vect(void){}
+
+uint64_t sim_cycles = 0;
+uint32_t sim_ee_writes = 0;
+void (*sim_tx_sink)(uint8_t data) = 0;
+void (*sim_idle_hook)(void) = 0;
+void (*sim_op_hook)(uint8_t op) = 0;
+
+void sim_op(uint8_t op){
+	if(sim_op_hook) sim_op_hook(op);
+}
+
+static const uint16_t t01_pre[8] = {0, 1, 8, 64, 256, 1024, 0, 0};	// 6, 7 are external clock, never ticks here
+static const uint16_t t2_pre[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+
+static uint32_t t0_acc = 0, t1_acc = 0, t2_acc = 0;
+
+static uint64_t icp_per = 0, icp_hi = 0;		// Cycles, 0 period holds the pin
+static uint64_t icp_next = 0;					// Next edge
+static uint8_t icp_pending = 0;					// ICF1 raised by a capture
+
+static uint8_t sim_ee[E2END + 1];
+static uint8_t sim_ee_init = 0;
+static FILE *sim_ee_img = 0;					// Every write goes through to it
+
+uint8_t sim_ram[SIM_RAM_LEN];				// RAM_LOW .. RAM_TOP, see avr/io.h
+static volatile uint16_t spi_dr = 0x100;		// SPDR, see avr/io.h
+
+static uint8_t tifr1 = 0, tifr2 = 0;			// The flags, TIFR1 / TIFR2 are copies
+static volatile uint8_t tifr_wr = 0;			// Last copy handed out
+static uint8_t *tifr_at = 0;					// Flags it clears, 0 once settled
+
+// SD card, SDHC in SPI mode: CMD0 8 55 ACMD41 58 16 17, a command's answer
+// starts one byte after its CRC. Anything else gets R1 illegal command
+#define SD_R1_IDLE		0x01
+#define SD_R1_ILLEGAL	0x04
+#define SD_BLK			512
+static FILE *sd_img = 0;
+static uint8_t sd_cmd[6];
+static uint8_t sd_cmd_n = 0;
+static uint8_t sd_out[SD_BLK + 8];				// Answer still to be clocked out
+static uint16_t sd_out_n = 0, sd_out_rd = 0;
+static uint8_t sd_idle = 1, sd_app = 0, sd_acmd41 = 0;
+
+static uint8_t *rx_q = 0;
+static uint32_t rx_q_len = 0, rx_q_cap = 0, rx_q_rd = 0;
+static uint64_t rx_next_at = 0;
+static uint64_t tx_free_at = 0;
+static uint8_t tx_busy = 0;
+
+void sim_rx_push(uint8_t data){
+	if(rx_q_len == rx_q_cap){
+		rx_q_cap = rx_q_cap ? rx_q_cap * 2 : 256;
+		rx_q = realloc(rx_q, rx_q_cap);
+		if(!rx_q){
+			perror("sim_rx_push");
+			exit(2);
+		}
+	}
+	rx_q[rx_q_len++] = data;
+}
+
+uint32_t sim_rx_pending(){
+	return rx_q_len - rx_q_rd;
+}
+
+uint8_t sim_tx_idle(){
+	return !tx_busy;
+}
+
+// The copy is written back before the next access or the next sim step,
+// firmware code between two sim_idle() calls takes no time
+static void sim_tifr_settle(){
+	if(!tifr_at) return;
+	*tifr_at &= ~tifr_wr;
+	tifr_at = 0;
+}
+
+volatile uint8_t *sim_tifr(uint8_t timer){
+	sim_tifr_settle();
+	tifr_at = (timer == 1) ? &tifr1 : &tifr2;
+	tifr_wr = *tifr_at;
+	return &tifr_wr;
+}
+
+static void sim_vector(void (*vect)(void)){		// Hardware clears I for the ISR, RETI sets it again
+	SREG &= ~(1 << SREG_I);
+	vect();
+	sim_tifr_settle();
+	SREG |= (1 << SREG_I);
+}
+
+static void sim_dispatch(){
+	if(!(SREG & (1 << SREG_I))) return;
+
+	if((tifr2 & (1 << OCF2A)) && (TIMSK2 & (1 << OCIE2A))){
+		tifr2 &= ~(1 << OCF2A);
+		sim_vector(TIMER2_COMPA_vect);
+	}
+	if(icp_pending && (TIMSK1 & (1 << ICIE1))){
+		icp_pending = 0;
+		tifr1 &= ~(1 << ICF1);
+		sim_vector(TIMER1_CAPT_vect);
+	}
+	if((tifr1 & (1 << OCF1A)) && (TIMSK1 & (1 << OCIE1A))){
+		tifr1 &= ~(1 << OCF1A);
+		sim_vector(TIMER1_COMPA_vect);
+	}
+	if((tifr1 & (1 << OCF1B)) && (TIMSK1 & (1 << OCIE1B))){
+		tifr1 &= ~(1 << OCF1B);
+		sim_vector(TIMER1_COMPB_vect);
+	}
+	if((tifr1 & (1 << TOV1)) && (TIMSK1 & (1 << TOIE1))){
+		tifr1 &= ~(1 << TOV1);
+		sim_vector(TIMER1_OVF_vect);
+	}
+	if((TIFR0 & (1 << TOV0)) && (TIMSK0 & (1 << TOIE0))){
+		TIFR0 &= ~(1 << TOV0);
+		sim_vector(TIMER0_OVF_vect);
+	}
+}
+
+static void sim_timer0(){
+	uint16_t pre_ = t01_pre[TCCR0B & 0x07];
+	if(!pre_) return;
+
+	for(t0_acc += SIM_QUANTUM; t0_acc >= pre_;){
+		t0_acc -= pre_;
+		TCNT0 += 1;
+		if(!TCNT0) TIFR0 |= (1 << TOV0);
+		sim_dispatch();
+	}
+}
+
+static uint16_t sim_t1_top(uint8_t mode){
+	switch(mode){
+		case 1: case 5:				return 0x00FF;
+		case 2: case 6:				return 0x01FF;
+		case 3: case 7:				return 0x03FF;
+		case 4: case 9: case 11:
+		case 15:					return OCR1A;
+		case 8: case 10: case 12:
+		case 14:					return ICR1;
+		default:					return 0xFFFF;
+	}
+}
+
+// Dual slope modes are counted single slope, flags and ISRs still fire once per period
+static void sim_timer1(){
+	uint16_t pre_ = t01_pre[TCCR1B & 0x07];
+	if(!pre_) return;
+
+	uint8_t mode_ = ((TCCR1B >> 1) & 0x0C) | (TCCR1A & 0x03);
+	for(t1_acc += SIM_QUANTUM; t1_acc >= pre_;){
+		t1_acc -= pre_;
+		uint16_t top_ = sim_t1_top(mode_);
+		if(TCNT1 >= top_){
+			TCNT1 = 0;
+			if(mode_ == 4){
+				tifr1 |= (1 << OCF1A);		// CTC, TOV only at MAX
+			} else
+			if(mode_ == 12){
+				tifr1 |= (1 << ICF1);
+				icp_pending = 1;
+			} else {
+				tifr1 |= (1 << TOV1);
+			}
+		} else {
+			TCNT1 += 1;
+		}
+		if(TCNT1 == OCR1A && mode_ != 4) tifr1 |= (1 << OCF1A);
+		if(TCNT1 == OCR1B) tifr1 |= (1 << OCF1B);
+		sim_dispatch();
+	}
+}
+
+void sim_icp_set(uint32_t period, uint32_t hi){
+	if(!hi || hi >= period){
+		icp_per = 0;
+		PINB = (PINB & ~(1 << PINB0)) | ((hi != 0) << PINB0);
+		return;
+	}
+	icp_per = period;
+	icp_hi = hi;
+	icp_next = sim_cycles;
+	PINB &= ~(1 << PINB0);
+}
+
+// Edges of the last quantum, ICR1 is set back to the count Timer1 had at the
+// exact edge cycle, a stopped timer holds TCNT1
+static void sim_icp(){
+	while(icp_per && icp_next <= sim_cycles){
+		uint8_t rise_ = !(PINB & (1 << PINB0));
+		uint64_t at_ = icp_next;
+		PINB ^= (1 << PINB0);
+		icp_next += rise_ ? icp_hi : icp_per - icp_hi;
+		if(!(TIMSK1 & (1 << ICIE1)) || ((TCCR1B >> ICES1) & 1) != rise_) continue;
+		
+		uint16_t pre_ = t01_pre[TCCR1B & 0x07];
+		uint32_t back_ = pre_ ? (uint32_t)((sim_cycles - at_) / pre_) : 0;
+		uint32_t top_ = (uint32_t)sim_t1_top(((TCCR1B >> 1) & 0x0C) | (TCCR1A & 0x03)) + 1;
+		ICR1 = (uint16_t)((TCNT1 + top_ - back_ % top_) % top_);
+		tifr1 |= (1 << ICF1);
+		icp_pending = 1;
+		sim_dispatch();
+	}
+}
+
+static void sim_timer2(){
+	uint16_t pre_ = t2_pre[TCCR2B & 0x07];
+	if(!pre_) return;
+
+	uint8_t ctc_ = (TCCR2A & ((1 << WGM21) | (1 << WGM20))) == (1 << WGM21);
+	for(t2_acc += SIM_QUANTUM; t2_acc >= pre_;){
+		t2_acc -= pre_;
+		if(ctc_ && TCNT2 == OCR2A){
+			TCNT2 = 0;
+			tifr2 |= (1 << OCF2A);
+		} else {
+			TCNT2 += 1;
+			if(!TCNT2) tifr2 |= (1 << TOV2);
+			if(!ctc_ && TCNT2 == OCR2A) tifr2 |= (1 << OCF2A);
+		}
+		sim_dispatch();
+	}
+}
+
+static uint32_t sim_byte_cycles(){				// Start + 8 data + stop
+	uint32_t div_ = (UCSR0A & (1 << U2X0)) ? 8 : 16;
+	return 10UL * div_ * (((uint32_t)UBRR0H << 8 | UBRR0L) + 1);
+}
+
+static void sim_usart(){
+	if(tx_busy && sim_cycles >= tx_free_at) tx_busy = 0;
+	if(tx_busy){
+		UCSR0A &= ~(1 << UDRE0);
+	} else {
+		UCSR0A |= (1 << UDRE0);
+	}
+
+	if(!tx_busy && (UCSR0B & (1 << UDRIE0)) && (SREG & (1 << SREG_I))){
+		UDR0 = 0x100;							// Not a byte, tells us if the ISR wrote one
+		sim_vector(USART_UDRE_vect);
+		if(UDR0 < 0x100){
+			if(sim_tx_sink) sim_tx_sink((uint8_t)UDR0);
+			tx_busy = 1;
+			tx_free_at = sim_cycles + sim_byte_cycles();
+			UCSR0A &= ~(1 << UDRE0);
+		}
+	}
+
+	if(rx_q_rd < rx_q_len && sim_cycles >= rx_next_at && (UCSR0B & (1 << RXEN0))){
+		UDR0 = rx_q[rx_q_rd++];
+		rx_next_at = sim_cycles + sim_byte_cycles();
+		UCSR0A |= (1 << RXC0);
+		if((UCSR0B & (1 << RXCIE0)) && (SREG & (1 << SREG_I))){
+			sim_vector(USART_RX_vect);
+			UCSR0A &= ~(1 << RXC0);
+		}
+		if(rx_q_rd == rx_q_len){
+			rx_q_rd = 0;
+			rx_q_len = 0;
+		}
+	}
+}
+
+int sim_sd_file(const char *path){
+	sd_img = fopen(path, "rb");
+	return sd_img != 0;
+}
+
+static void sd_put(uint8_t data){
+	sd_out[sd_out_n++] = data;
+}
+
+static void sim_sd_cmd(){
+	uint8_t cmd_ = sd_cmd[0] & 0x3F;
+	uint32_t arg_ = (uint32_t)sd_cmd[1] << 24 | (uint32_t)sd_cmd[2] << 16 | (uint32_t)sd_cmd[3] << 8 | sd_cmd[4];
+	uint8_t app_ = sd_app;
+	
+	sd_out_n = 0;
+	sd_out_rd = 0;
+	sd_app = 0;
+	sd_put(0xFF);								// Ncr
+	switch(cmd_){
+		case 0:
+			sd_idle = 1;
+			sd_acmd41 = 0;
+			sd_put(SD_R1_IDLE);
+		break;
+		case 8:									// Voltage check, echoes the pattern
+			sd_put(sd_idle);
+			sd_put(0x00);
+			sd_put(0x00);
+			sd_put(0x01);
+			sd_put(sd_cmd[4]);
+		break;
+		case 55:
+			sd_app = 1;
+			sd_put(sd_idle);
+		break;
+		case 41:
+			if(!app_){
+				sd_put(sd_idle | SD_R1_ILLEGAL);
+				break;
+			}
+			if(++sd_acmd41 > 2) sd_idle = 0;	// Busy for a couple of polls
+			sd_put(sd_idle);
+		break;
+		case 58:								// OCR, power up done and CCS
+			sd_put(sd_idle);
+			sd_put(0xC0);
+			sd_put(0xFF);
+			sd_put(0x80);
+			sd_put(0x00);
+		break;
+		case 16:
+			sd_put(sd_idle);
+		break;
+		case 17:								// Block address, SDHC
+			if(sd_idle){
+				sd_put(SD_R1_ILLEGAL | sd_idle);
+				break;
+			}
+			sd_put(0x00);
+			sd_put(0xFF);						// Access time
+			sd_put(0xFF);
+			sd_put(0xFE);
+			memset(&sd_out[sd_out_n], 0x00, SD_BLK);
+			if(sd_img && !fseek(sd_img, (long)arg_ * SD_BLK, SEEK_SET)){
+				fread(&sd_out[sd_out_n], 1, SD_BLK, sd_img);	// Past the end reads 0
+			}
+			sd_out_n += SD_BLK;
+			sd_put(0xFF);						// CRC, not checked in SPI mode
+			sd_put(0xFF);
+		break;
+		default:
+			sd_put(sd_idle | SD_R1_ILLEGAL);
+		break;
+	}
+}
+
+static uint8_t sim_sd_xfer(uint8_t mosi){
+	if(!sd_img || !(DDRC & (1 << PINC0)) || (PORTC & (1 << PINC0))){	// Not selected
+		sd_cmd_n = 0;
+		sd_out_n = 0;
+		sd_out_rd = 0;
+		return 0xFF;
+	}
+	
+	if(sd_out_rd < sd_out_n){
+		return sd_out[sd_out_rd++];				// Busy answering, MOSI is ignored
+	}
+	if(sd_cmd_n || (mosi & 0xC0) == 0x40){
+		sd_cmd[sd_cmd_n++] = mosi;
+		if(sd_cmd_n == sizeof(sd_cmd)){
+			sd_cmd_n = 0;
+			sim_sd_cmd();
+		}
+	}
+	return 0xFF;
+}
+
+volatile uint16_t *sim_spdr(void){
+	SPSR &= ~(1 << SPIF);
+	return &spi_dr;
+}
+
+static void sim_spi(){
+	if((SPCR & (1 << SPE)) && (SPCR & (1 << MSTR)) && !(DDRB & (1 << PINB2)) && !(PORTB & (1 << PINB2))){
+		SPCR &= ~(1 << MSTR);					// Slave now, a byte in flight never finishes
+		SPSR |= (1 << SPIF);
+		return;
+	}
+	if(!(SPCR & (1 << SPE)) || !(SPCR & (1 << MSTR)) || spi_dr >= 0x100) return;
+	spi_dr = 0x100 | sim_sd_xfer((uint8_t)spi_dr);
+	SPSR |= (1 << SPIF);
+}
+
+static uint8_t *sim_ee_cell(const uint8_t *addr){
+	if(!sim_ee_init){
+		memset(sim_ee, 0xFF, sizeof(sim_ee));
+		sim_ee_init = 1;
+	}
+	return &sim_ee[(uintptr_t)addr & E2END];
+}
+
+int sim_ee_file(const char *path){
+	uint8_t *ee_ = sim_ee_cell(0);
+	sim_ee_img = fopen(path, "r+b");
+	if(sim_ee_img){
+		fread(ee_, 1, E2END + 1, sim_ee_img);		// A short image leaves the rest erased
+	} else {
+		sim_ee_img = fopen(path, "w+b");
+		if(!sim_ee_img) return 0;
+	}
+	fseek(sim_ee_img, 0, SEEK_SET);
+	fwrite(ee_, 1, E2END + 1, sim_ee_img);
+	fflush(sim_ee_img);
+	return 1;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr){
+	return *sim_ee_cell(addr);
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t data){	// Busy waits like avr-libc, ISRs keep running
+	*sim_ee_cell(addr) = data;
+	sim_ee_writes += 1;
+	if(sim_ee_img){
+		fseek(sim_ee_img, (uintptr_t)addr & E2END, SEEK_SET);
+		fputc(data, sim_ee_img);
+		fflush(sim_ee_img);
+	}
+	for(uint64_t end_ = sim_cycles + SIM_EE_WRITE_US * (SIM_CYC_PER_MS / 1000); sim_cycles < end_;){
+		sim_idle();
+	}
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t data){
+	if(*sim_ee_cell(addr) != data) eeprom_write_byte(addr, data);
+}
+
+void sim_idle(void){
+	sim_tifr_settle();
+	sim_cycles += SIM_QUANTUM;
+	sim_timer0();
+	sim_timer1();
+	sim_icp();
+	sim_timer2();
+	sim_usart();
+	sim_spi();
+	if(sim_idle_hook) sim_idle_hook();
+}
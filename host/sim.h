@@ -0,0 +1,42 @@
+/*
+ * sim.h
+ *
+ * Simulated ATmega328P peripherals for the host build. Time only moves
+ * when main.c calls SIM_IDLE(), i.e. whenever the firmware spins on the
+ * UART, a timer flag or the sequencer. Code in between takes no time.
+ */
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <stdint.h>
+
+#define SIM_F_CPU		16000000UL
+#define SIM_QUANTUM		64				// CPU cycles per sim_idle() call, 4us
+#define SIM_CYC_PER_MS	(SIM_F_CPU / 1000UL)
+#define SIM_EE_WRITE_US	3300			// EEPROM erase + write
+
+extern uint64_t sim_cycles;				// CPU cycles since reset
+extern uint32_t sim_ee_writes;			// EEPROM bytes actually written, wear
+
+// EEPROM contents from / to an image file, written through on every write.
+// A missing file starts erased. 0 if the file can't be opened
+int sim_ee_file(const char *path);
+
+// SD card image for the SPI card model, 512 byte blocks. 0 if the file
+// can't be opened, without one the card never answers
+int sim_sd_file(const char *path);
+
+// UART byte streams
+void sim_rx_push(uint8_t data);			// Queue a byte for the receiver, delivered at line rate
+uint32_t sim_rx_pending();				// Bytes queued but not received yet
+uint8_t sim_tx_idle();					// Nothing in UDR0 or the shift register
+extern void (*sim_tx_sink)(uint8_t data);
+
+// ICP1 / PB0 input, pulse train from now on in CPU cycles starting with a
+// rising edge. hi 0 holds the pin low, hi >= period holds it high
+void sim_icp_set(uint32_t period, uint32_t hi);
+
+// Called at the end of every sim_idle(), after the peripherals ran
+extern void (*sim_idle_hook)(void);
+
+#endif
@@ -7,6 +7,25 @@
 #include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+// Host build hooks (host/), empty on the 328P
+#ifndef SIM_IDLE
+#define SIM_IDLE()		// Firmware is spinning on something, let the simulator run
+#endif
+#ifndef SIM_OP
+#define SIM_OP(op)		// interpret() ran op
+#endif
+
+// SRAM map for MEM, the host brings its own
+#ifndef RAM_LOW
+extern uint8_t __heap_start;
+#define RAM_START		((uint8_t *)RAMSTART)
+#define RAM_LOW			(&__heap_start)			// Past .data and .bss, the stack may grow down to here
+#define RAM_TOP			((uint8_t *)RAMEND + 1)
+#define RAM_SP()		((uint8_t *)(uintptr_t)SP)
+#endif
 
 // HEADER
 #define F_CPU	16000000UL
@@ -27,6 +46,13 @@
 #define CLEAR_T1_PRE	TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));	// Clear prescalar
 #define SET_T1_PRE_1	TCCR1B |= (1 << CS10);									// Set prescale 1
 #define SET_T1_PRE_8	TCCR1B |= (1 << CS11);									// Set prescale 8
+
+// Timer1 clock select codes, CS 1 - 5 == prescale 1, 8, 64, 256, 1024
+#define T1_CS_MASK		((1 << CS12) | (1 << CS11) | (1 << CS10))
+#define T1_CS_MAX		5
+#define T1_CS			(TCCR1B & T1_CS_MASK)									// Active clock select
+#define SET_T1_CS(cs)	TCCR1B = (TCCR1B & ~T1_CS_MASK) | (cs);					// Swap prescale in one write
+#define T1_ICP_MASK		((1 << ICNC1) | (1 << ICES1))							// Input capture setup, kept by every TCCR1B rewrite
 							
 #define T2_STOP_TIMER		TCCR2B = 0x00;
 #define T2_EN_COMPA_ISR		TIMSK2 |= (1 << OCIE2A);
@@ -37,31 +63,32 @@
 							TCCR2B = 0x00;			\
 							TCNT2  = 0x00;			\
 							OCR2A = 125;			\
-							TIFR2 |= (1 << TOV2);	\
+							TIFR2 = (1 << OCF2A);	\
 							T2_EN_COMPA_ISR			\
 							WAIT_FLAG_T2 = 1;		\
 							TCCR2B = ((1 << CS22) | (1 << CS21) | (1 << CS20));
 
+// 1ms setups: Timer2 prescale 64 (CS22 alone, CS21|CS20 is 32 on Timer2), 250 counts
 #define T2_1MS_SETUP		TCCR2A = (1 << WGM21);	\
 							TCCR2B = 0x00;			\
 							TCNT2  = 0x00;			\
 							OCR2A  = 249;			\
-							TIFR2 |= (1 << TOV2);	\
+							TIFR2 = (1 << OCF2A);	\
 							T2_EN_COMPA_ISR			\
 
 #define T2_BEGIN_1MS		TCCR2B = 0x00;			\
 							TCNT2 = 0x00;			\
 							WAIT_FLAG_T2 = 1;		\
-							TCCR2B = (1 << CS21) | (1 << CS20);
+							TCCR2B = (1 << CS22);
 
 #define T2_1MS_SETUP_ENC	TCCR2A = (1 << WGM21);	\
 							TCCR2B = 0x00;			\
 							TCNT2  = 0x00;			\
 							OCR2A = 249;			\
-							TIFR2 |= (1 << TOV2);	\
+							TIFR2 = (1 << OCF2A);	\
 							T2_EN_COMPA_ISR			\
 							WAIT_FLAG_T2 = 1;		\
-							TCCR2B = ((1 << CS21) | (1 << CS20));
+							TCCR2B = (1 << CS22);
 
 // Strobe toggle for scope triggering
 #define TOGGLE_INDIC_STROBE PORTD ^= (1 << PIND7);
@@ -69,6 +96,7 @@
 // Standard 80 x 24 terminal
 #define TERM_W		80
 #define TERM_H		24
+#define TERM_DEC_MAX	11			// term_fmt_dec(), 10 digits and a '.'
 
 #define CENTER_W	TERM_W / 2
 #define CENTER_H	TERM_H / 2
@@ -112,6 +140,9 @@
 #define CTRL_R		18
 #define CTRL_A		1
 #define CTRL_N		14
+#define CTRL_E		5
+#define CTRL_O		15
+#define CTRL_L		12
 
 #ifndef	EXASCII
 #define GFX_CHAR	'#'
@@ -120,8 +151,16 @@
 
 void init_serial(unsigned int someVal);
 void serialWrite(unsigned char data);
+uint8_t serialTryWrite(unsigned char data);	// Non blocking, 0 if TX ring is full
+uint8_t serialTxUsed();						// Bytes waiting in TX ring
+uint8_t serialTxFree();						// Space left in TX ring
+void serialFlush();							// Block until the TX ring has drained
 uint8_t serialGet();
+uint8_t serialAvailable();					// Bytes waiting in RX ring
+uint8_t serialTryGet(uint8_t *data);		// Non blocking, 0 if RX ring is empty
+uint8_t serial_rx_abort();					// Non blocking, 1 if CTRL+X is waiting in RX ring
 void serialWriteStr(const char *inpu);
+void serialWriteStr_P(const char *str);		// str in flash, PSTR() or PROGMEM
 void serialWriteNl(unsigned char data);
 void printStr(uint8_t data);
 void printBin8(uint8_t data);
@@ -129,12 +168,16 @@ void printBin8(uint8_t data);
 void fastBorder(uint8_t clr_scrn);
 void printBarFrame(uint8_t top, uint8_t right, uint8_t internalWidth);
 void updateBarValue(uint8_t top, uint8_t right, uint8_t internalWidth, uint8_t oldPos, uint8_t newPos);
-uint8_t ret_WGM_ptr(uint8_t timer_no);
-uint8_t ret_CSX_ptr(uint8_t timer_no);
 
 uint16_t serial_rx_ESC_seq();             // AVR 244.
+uint16_t serial_rx_ESC_poll();            // Non blocking serial_rx_ESC_seq(), 0 if no key is complete yet
 void term_Send_Val_as_Digits(uint8_t val);
 void term_Send_16_as_Digits(uint16_t val);	// Not avr 244
+void term_Send_Val_Unpadded(uint8_t val);
+void term_Send_32_as_Digits(uint32_t val, uint8_t frac);	// No padding, '.' before the last frac digits
+uint8_t term_fmt_dec(char *out, uint32_t val, uint8_t min_digits, uint8_t frac);
+void term_Send_dec(uint32_t val, uint8_t min_digits, uint8_t frac);
+void term_Send_ppm(int32_t ppm);
 
 void term_Clear_ALL();                    // Clear whole screen
 void term_Clear_Top();                    // Clear top of screen
@@ -145,8 +188,10 @@ void term_Clear_Line();                   // Clear entire line
 
 void term_Set_Display_Attribute_Mode(uint8_t mode);
 void term_Set_Display_Color(uint8_t FG_O_BG, uint8_t color);
-void term_Set_Cursor_Pos(uint8_t row, uint8_t col);
+void term_Set_Cursor_Pos(uint8_t row, uint8_t col);	// Shortest of relative / absolute, needs term_track()
 void term_Move_Cursor(uint8_t distance, uint8_t direction);
+void term_track(uint8_t data);			// Follow the cursor through every byte sent
+extern uint8_t term_col;				// Tracked cursor column, 0 if unknown
 
 void termCurPosB(uint8_t row, uint8_t col);
 
@@ -161,25 +206,256 @@ void term_Print_Screen();
 
 void init_gp_timers();
 void init_timer_1();
+void pwm_commit();
+uint8_t pwm_wait();
+void pwm_batch_open();
+void pwm_batch_close();
+void pwm_set_out(uint8_t on);
+void pwm_pb2_hold(uint8_t on);
+void pwm_set_timing(uint8_t cs, uint16_t top, uint16_t cmp);
+void pwm_set_duty(uint16_t frac);
+void pwm_set_hi(uint16_t counts, uint8_t cs);
+void pwm_add_us(uint16_t us, uint8_t sub);
+uint16_t pwm_frac_cmp(uint16_t frac, uint16_t top);
+uint16_t pwm_ramp_shape(uint8_t shape, uint16_t p);
+uint8_t pwm_ramp_step();
+uint8_t pwm_ramp_start(uint8_t arg, uint16_t target, uint16_t ms);
+void pwm_ramp_stop();
+
+#define MC_CH_CT		8			// Multi channel outputs
+extern volatile uint8_t mc_active;
+extern volatile uint8_t mc_swap;
+void mc_edge();
+void mc_build();
+uint16_t mc_frame_top();
+void mc_hi_set(uint8_t ch, uint16_t counts);
+uint8_t mc_set_hi(uint8_t ch, uint16_t counts, uint8_t cs);
+uint8_t mc_add_us(uint8_t ch, uint16_t us, uint8_t sub);
+uint8_t mc_start(uint8_t on);
+void mc_masks();
+extern volatile uint8_t cap_on;
+uint8_t cap_start(uint8_t pulses);
+void cap_add(uint8_t which, uint32_t ticks);
+void cap_fold();
+void cap_print();
+uint8_t cap_refresh();
+void live_print(uint8_t full);
+uint8_t live_refresh();
+void log_live(uint16_t top, uint16_t cmp, uint8_t mode, uint8_t op);
+uint8_t log_pop();
+uint8_t log_print();
+void ram_paint();
+uint8_t mem_print();
+uint32_t timebase_now();
+uint32_t rx_stamp_get();
+void stat_add(uint8_t stage, uint32_t ticks);
+void stat_reset();
+void stat_print();
 
 uint8_t main_menu();
 void goto_shell();
+void shell_scroll_history(const char *str);
+void shell_redraw_input(const char *buf, uint8_t from, uint8_t old_len, uint8_t wr_ptr);
+uint8_t shell_run_line(char *line);
+uint8_t shell_run_batch(char **cmd, uint8_t ct);
 void goto_help();
 void goto_credits();
 
 typedef struct{
 	uint8_t OPCODE;
+	uint8_t ARG;		// Timing ops: Timer1 CS code DATA counts are in
 	uint16_t DATA;
+	uint16_t TIME;		// RAMP: duration in ms
 } INSTRUCT_STRUCT;
 
+// HI_TIME, mAdd and mSub ARG: channel + 1 in the upper nibble (0 == all), CS code in the lower
+#define ARG_CH(arg)		((arg) >> 4)
+#define ARG_CS(arg)		((arg) & 0x0F)
+
 
 typedef struct{
 	uint8_t *addr;
 	uint16_t data;
 } COMPILED_INSTR;
 
+// Compiled Zepto programs are a list of writes to the PWM stage (pwm_stage):
+//	16 bit fields (top, cmp)	*addr = data
+//	8 bit fields				*addr = (*addr & ~(data >> 8)) | (data & 0xFF), upper byte is the mask
+// addr below Z_OP_LIMIT can't be RAM (RAMSTART, the registers and I/O
+// space are never written by a program), those are pseudo ops instead
+#define Z_OP_LIMIT		0x100
+#define Z_OP(op)		((uint8_t *)(uintptr_t)(op))
+
+#define ZOP_END			0		// End of program
+#define ZOP_STALL		1		// data = ms
+#define ZOP_DUTY		2		// data = 16 bit fraction of period
+#define ZOP_SUB			3		// data = us
+#define ZOP_ADD			4		// data = us
+#define ZOP_GOTO		5		// data = target index
+#define ZOP_COMMIT		6		// Stage writes above are complete, pwm_commit()
+#define ZOP_RAMP_ARG	7		// data = RAMP ARG, held for ZOP_RAMP
+#define ZOP_HI_TIME		8		// + CS code, data = counts - 1 at that prescale
+#define ZOP_RAMP_MS		14		// data = ms, held for ZOP_RAMP
+#define ZOP_RAMP		15		// data = target, pwm_ramp_start()
+#define ZOP_MC_HI		16		// + channel, data = counts - 1 at MC_CS
+#define ZOP_MC_ADD		24		// + channel, data = signed us
+#define ZOP_LOOP		32		// data = passes, pushes the body start
+#define ZOP_NEXT		33		// Back to the body start until the passes ran out, then pops
+#define ZOP_CALL		34		// data = target index, pushes the return index
+#define ZOP_RET			35		// Pops up to and including the newest CALL
+#define ZOP_JMP			40		// + counter, data = target index | (jump count << 8)
+
+#define Z_PROG_LEN		48
+#define Z_STACK_DEPTH	6		// Open loops and calls
+#define Z_JMP_CT		4		// j lines per program, each has its own counter
+
+typedef struct{
+	uint8_t pc;			// LOOP: body start, CALL: return index
+	uint16_t ct;		// LOOP: passes left, CALL: 0
+} Z_FRAME;
+
+typedef struct{
+	COMPILED_INSTR *prog;
+	uint8_t pc;
+	uint8_t sp;					// Frames in stack[]
+	Z_FRAME stack[Z_STACK_DEPTH];
+	uint8_t jmp_armed;			// Bit per j counter, jmp_ct[] was loaded on its first hit
+	uint8_t jmp_ct[Z_JMP_CT];	// Jumps left
+	uint8_t ramp_arg;
+	uint16_t ramp_ms;
+} ZEPTO_VM;
+
+typedef struct{
+	uint8_t cs;
+	uint16_t top;
+	uint16_t cmp;
+} T1_PRESET;
+
+typedef struct{
+	uint8_t cs;			// Timer1 CS code
+	uint16_t top;		// OCR1A
+	uint16_t cmp;		// OCR1B
+	uint8_t out;		// PB2 driven
+} PWM_STAGE;
+
+typedef struct{
+	uint16_t at;		// TCNT1 of the falling edge
+	uint8_t clr_b;		// PORTB / PORTD bits that fall there
+	uint8_t clr_d;
+} MC_EDGE;
+
+typedef struct{
+	uint16_t top;		// OCR1A, frame length
+	uint8_t out;		// Pins driven
+	uint8_t ct;			// Edges used, ascending
+	uint8_t src;		// pwm_src that built it, for the event log
+	MC_EDGE edge[MC_CH_CT];
+} MC_FRAME;
+
+typedef struct{
+	uint32_t at;		// timebase_now() ticks of the edge
+	uint8_t rise;
+} CAP_EDGE;
+
+typedef struct{			// All uint32_t, the host bench reads them as words
+	uint32_t ct;
+	uint32_t last;		// Ticks
+	uint32_t avg;		// Running average, ticks << CAP_EWMA
+	uint32_t jit;		// Running average of |last - avg|, ticks << CAP_EWMA
+	uint32_t min;
+	uint32_t max;
+} CAP_ACC;
+
+#define LOG_MODE(cs, out, multi)	((cs) | ((out) << 3) | ((multi) << 4))
+
+typedef struct{
+	uint32_t at;		// timebase_now() ticks
+	uint16_t top;		// OCR1A
+	uint16_t cmp;		// OCR1B
+	uint8_t mode;		// LOG_MODE()
+	uint8_t op;			// Source of the change
+} LOG_STATE;
+
+typedef struct{
+	uint8_t kind;		// RAMP_OFF, RAMP_HI, RAMP_FREQ
+	uint8_t shape;
+	uint8_t shift;		// span >> shift fits 16 bits
+	uint16_t from;		// Counts at pwm_stage.cs
+	uint16_t to;
+	uint32_t start;		// timebase_now() ticks
+	uint32_t last;		// Last step
+	uint32_t span;		// Duration in ticks
+} PWM_RAMP;
+
+// Parse errors. The first one of a line is kept in parse_err with its 1 based
+// column counted from parse_base, which whoever owns the line sets
+#define PE_NONE			0
+#define PE_WORD			1		// Unknown command, keyword or label
+#define PE_NUM			2		// Number missing or malformed
+#define PE_UNIT			3		// Unit the command doesn't take
+#define PE_RANGE		4		// Out of range for the timer or the field
+#define PE_ARG			5		// Argument missing, wrong or one too many
+#define PE_CHAN			6		// :n on a command without channels
+#define PE_ALONE		7		// Full screen command in a batch or a program
+#define PE_NEST			8		// Zepto loop / next don't pair up
+#define PE_FULL			9		// Batch or program buffer full
+
+// Unit suffixes, z_units[] order
+#define LX_U_NONE		0
+#define LX_U_US			1
+#define LX_U_MS			2
+#define LX_U_S			3
+#define LX_U_HZ			4
+#define LX_U_KHZ		5
+#define LX_U_PCT		6
+#define LX_U_CT			7
+
+extern uint8_t parse_err;
+extern uint8_t parse_err_col;
+extern const char *parse_base;
+uint8_t parse_fail(const char *at, uint8_t why);
+void parse_err_send();
+void parse_err_echo();
+char *lx_word(char **at, uint8_t *len);
+char *lx_next(char **at, uint8_t *len);
+char *lx_skip(char **at);
+uint8_t lx_abbrev(const char *word, uint8_t len, const char *name, uint8_t min);
+uint8_t lx_pick(const char *word, uint8_t len, const uint8_t *list, uint8_t ct);
+uint8_t lx_num(char **at, uint32_t *val, uint8_t unit);
+
 uint8_t parse_entry(char *user_entry, uint8_t run_instantly, INSTRUCT_STRUCT *INS_OUT);
+uint8_t parse_args(char *at, INSTRUCT_STRUCT *INSTR, uint32_t *want, uint32_t *got, char **arg);
+uint8_t parse_ramp(char **at, INSTRUCT_STRUCT *INS_OUT);
+uint8_t parse_file(char **at, INSTRUCT_STRUCT *INS_OUT);
+uint8_t parse_sd(char **at, INSTRUCT_STRUCT *INS_OUT);
 uint8_t interpret(INSTRUCT_STRUCT *operation);
+uint8_t crc8_update(uint8_t crc, uint8_t data);
+uint8_t bin_check(INSTRUCT_STRUCT *operation);
+uint8_t bin_mode();
+
+// Fixed point, every user value is held as an integer with FX_FRAC decimals
+//	Frequency	0.01 Hz
+//	Time		0.01 us
+//	Duty		0.01 %
+#define FX_FRAC		2
+#define FX_ONE		100UL
+#define FX_CLK		(F_CPU * FX_ONE)		// Timer clock in 0.01 Hz at prescale 1
+
+uint8_t fx_parse(const char *str, uint32_t *out);
+uint32_t fx_div_round(uint32_t num, uint32_t den);
+uint32_t fx_freq_to_counts(uint32_t freq, uint8_t pre_shift);
+uint32_t fx_counts_to_freq(uint32_t counts, uint8_t pre_shift);
+uint32_t fx_time_to_counts(uint32_t time, uint8_t pre_shift);
+uint32_t fx_counts_to_time(uint32_t counts, uint8_t pre_shift);
+int32_t fx_err_ppm(uint32_t want, uint32_t got);
+
+extern const uint8_t t1_pre_shift[] PROGMEM;
+extern const char z_keywords[][8] PROGMEM;
+extern const char z_units[][4] PROGMEM;
+extern uint8_t ui_quiet;
+uint8_t t1_pick_cs(uint32_t want, uint8_t is_time, uint32_t *counts);
+uint16_t t1_rescale(uint16_t data, uint8_t from_cs, uint8_t to_cs);
+uint16_t t1_us_to_counts(uint16_t us, uint8_t cs);
 
 volatile uint8_t WAIT_FLAG_T2 = 0;
 
@@ -188,18 +464,74 @@ volatile uint8_t WAIT_FLAG_T2 = 0;
 #define Z_LINE_CT	20
 
 void zepto_editor(COMPILED_INSTR* work_space, uint8_t len);
+uint8_t zepto_get_line(uint8_t row_, char *line_);
+uint8_t zepto_compile(COMPILED_INSTR *prog, uint8_t len, uint8_t *prog_len);
+const char *z_word(const char *str, uint8_t *len);
+uint8_t z_ctl_word(const char *word, uint8_t len);
+void zepto_vm_reset(ZEPTO_VM *vm, COMPILED_INSTR *prog);
+uint8_t zepto_run_slice(ZEPTO_VM *vm, uint16_t *stall_ms, uint8_t budget);
+
+#define Z_SLICE_END		0		// Program finished
+#define Z_SLICE_STALL	1		// Hit a STALL, *stall_ms is set
+#define Z_SLICE_YIELD	2		// Used up its entry budget
+
+void seq_start(COMPILED_INSTR *prog);
+void seq_stop();
+uint8_t seq_run(COMPILED_INSTR *prog);
 uint8_t last_char(const char str[Z_LINE_LEN][Z_LINE_CT], uint8_t row_);
 void zepto_frame_print();
 void zepto_frame_cleanup();
+void zepto_invalidate();
+void zepto_redraw(uint8_t cur_row);
 void zepto_help_menu();
-
-ISR(TIMER2_COMPA_vect){
-	WAIT_FLAG_T2 = 0;
-	T2_STOP_TIMER
-	T2_NE_COMPA_ISR
-}
+uint8_t z_compile_ins(COMPILED_INSTR *prog, uint8_t *n, uint8_t len, INSTRUCT_STRUCT *ins);
+uint8_t z_tok_word(const char *word, uint8_t len, uint8_t *out);
+uint8_t zepto_tokenize(uint8_t *tok, uint8_t max);
+uint8_t zepto_detok(const uint8_t *tok, uint8_t len);
+uint8_t zepto_save(uint8_t slot);
+uint8_t zepto_load(uint8_t slot);
+
+#define Z_SLOT_CT		4			// EEPROM program slots
+
+// zepto_save() / zepto_load() and fs_ results, shown on the status line
+#define Z_EE_OK			0
+#define Z_EE_FULL		1			// Doesn't fit a slot / the free blocks
+#define Z_EE_EMPTY		2			// Nothing saved there, no such file
+#define Z_EE_BAD		3			// CRC or token error
+
+// FILE, INSTRUCT DATA
+#define FS_A_LS			0
+#define FS_A_SAVE		1			// Zepto text as a script
+#define FS_A_PRESET		2			// Timer1 state as a preset
+#define FS_A_LOAD		3
+#define FS_A_RM			4
+#define FS_NAME_LEN		8
+
+extern char fs_arg[FS_NAME_LEN + 1];
+void fs_mount();
+uint8_t fs_find(const char *name);
+uint8_t fs_write(const char *name, uint8_t tag, const uint8_t *data, uint8_t len);
+uint8_t fs_read(uint8_t blk, uint8_t *data);
+void fs_remove(uint8_t blk);
+uint8_t file_cmd(uint8_t action);
+
+// SD, INSTRUCT DATA, TIME = RUN repeat count
+#define SD_A_LS			0
+#define SD_A_RUN		1			// Stream a profile through the sequencer
+#define SD_A_LOAD		2			// Text file into the Zepto buffer
+#define SD_NAME_LEN		11			// 8.3, space padded, no dot
+
+extern char sd_arg[SD_NAME_LEN];
+extern volatile uint8_t seq_stream;
+uint8_t sd_feed(ZEPTO_VM *vm);
+
+#define SD_FEED_END		0			// sd_feed(), file done
+#define SD_FEED_NEXT	1			// Switched to the other half, keep running
+#define SD_FEED_WAIT	2			// Other half not ready yet, try next tick
+uint8_t sd_shell(uint8_t action, uint16_t repeat);
 
 int main(void){
+	ram_paint();			// Before anything has used the stack
     init_serial(0);			// 115.2k BAUD 8N1
 	
 	sei();
@@ -209,6 +541,8 @@ int main(void){
 	
 	init_gp_timers();		// Initiate General Delay Timers
 	init_timer_1();			// Initiate PWM generation Timer, keep output low
+	zepto_load(0);			// Zepto editor opens with the program in slot 0, if any
+	fs_mount();				// FILE index from EEPROM
 	
 	DDRD |= (1 << PIND7);	// Scope trigger indicator strobe, toggle state on output set
 	
@@ -238,975 +572,4478 @@ int main(void){
 	}
 }
 
+// Timer0 free running timebase, 0.5us per tick, TOV every 128us
+#define TB_TICKS_PER_MS		2000UL
+
+volatile uint32_t t0_ovf_ct = 0;
+
+ISR(TIMER0_OVF_vect){
+	t0_ovf_ct += 1;
+}
+
 void init_gp_timers(){
+	TCCR0A = 0x00;				// Normal mode, OC0A/B disconnected
+	TCNT0  = 0x00;
+	TIFR0 |= (1 << TOV0);
+	TIMSK0 = (1 << TOIE0);
+	TCCR0B = (1 << CS01);		// Prescale 8
+}
+
+uint32_t timebase_now(){		// Wraps after ~35 minutes, only use for differences
+	uint8_t sreg_ = SREG;
+	cli();
+	uint32_t ovf_ = t0_ovf_ct;
+	uint8_t cnt_ = TCNT0;
+	if((TIFR0 & (1 << TOV0)) && cnt_ < 128){
+		ovf_ += 1;				// Overflow happened but ISR has not run yet
+	}
+	SREG = sreg_;
+	return (ovf_ << 8) | cnt_;
+}
+
+// Per stage latency, all in timebase ticks (0.5us)
+#define STAT_RX			0		// Last byte of a key received -> key decoded
+#define STAT_PARSE		1		// parse_entry() up to interpret()
+#define STAT_EXEC		2		// interpret() until the registers are written
+#define STAT_RENDER		3		// Registers written -> debug echo queued
+#define STAT_E2E		4		// ENTER received -> registers written
+#define STAT_ZDRAW		5		// zepto_redraw()
+#define STAT_CT			6
+
+// STATS table, right half of the shell screen
+#define STAT_ROW		10
+#define STAT_COL		42
+
+typedef struct{
+	uint32_t min;
+	uint32_t max;
+	uint32_t sum;
+	uint16_t ct;
+} STAT_ACC;
+
+STAT_ACC stats[STAT_CT];
+volatile uint32_t rx_stamp = 0;			// timebase_now() of the newest received byte
+uint32_t stat_apply_at = 0;				// interpret() finished writing registers
+uint8_t stat_applied = 0;				// interpret() ran a non blocking op since cleared
+
+uint32_t rx_stamp_get(){				// RX ISR writes it, 4 bytes need interrupts off
+	uint8_t sreg_ = SREG;
+	cli();
+	uint32_t at_ = rx_stamp;
+	SREG = sreg_;
+	return at_;
+}
+
+void stat_add(uint8_t stage, uint32_t ticks){
+	STAT_ACC *acc_ = &stats[stage];
+	if(!acc_->ct || ticks < acc_->min) acc_->min = ticks;
+	if(ticks > acc_->max) acc_->max = ticks;
+	if(acc_->ct == 0xFFFF || acc_->sum > 0xFFFFFFFFUL - ticks){
+		acc_->sum >>= 1;				// Halve the weight, average stays
+		acc_->ct >>= 1;
+	}
+	acc_->sum += ticks;
+	acc_->ct += 1;
+}
+
+void stat_reset(){
+	for(uint8_t n = 0; n < STAT_CT; n++){
+		stats[n].min = 0;
+		stats[n].max = 0;
+		stats[n].sum = 0;
+		stats[n].ct = 0;
+	}
+}
+
+void stat_send_us(uint32_t ticks, uint8_t next_col){	// 0.1us resolution, pads up to next_col
+	term_Send_32_as_Digits(ticks * 5, 1);
+	while(term_col && term_col < next_col){
+		serialWrite(' ');
+	}
+}
+
+void stat_print(){
+	static const char names_[STAT_CT][7] PROGMEM = {"RX", "PARSE", "EXEC", "RENDER", "E2E", "ZDRAW"};
 	
+	term_Set_Cursor_Pos(STAT_ROW, STAT_COL);
+	serialWriteStr_P(PSTR("us     min     max     avg     n"));
+	for(uint8_t n = 0; n < STAT_CT; n++){
+		term_Set_Cursor_Pos(STAT_ROW + 1 + n, STAT_COL);
+		serialWriteStr_P(names_[n]);
+		while(term_col && term_col < STAT_COL + 7) serialWrite(' ');
+		stat_send_us(stats[n].min, STAT_COL + 15);
+		stat_send_us(stats[n].max, STAT_COL + 23);
+		stat_send_us(stats[n].ct ? stats[n].sum / stats[n].ct : 0, STAT_COL + 31);
+		term_Send_32_as_Digits(stats[n].ct, 0);
+		serialWriteStr_P(PSTR("    "));
+	}
 }
 
 void init_timer_1(){
 	// Set Mode: 15, TOP OCR1A, TOV @ TOP, Update OCR1X @ BOTTOM, BOTTOM = 0x0000
-	TCCR1B = ((1 << WGM13) | (1 << WGM12));
+	TCCR1B = (TCCR1B & T1_ICP_MASK) | ((1 << WGM13) | (1 << WGM12));
 	TCCR1A = ((1 << COM1B1) | (1 <<WGM11) | (1 << WGM10));
 }
 
-// Case 0
-uint8_t main_menu(){
-	char menu_message[] = "Welcome to ESC and Servo Driver v2!\0";
-	char shell_loading_msg[] = "Loading into Shell\0";
-	char menu_loading_msg[] = "Press Any Key to Stop\0";
-	fastBorder(1);
-	
-	term_Set_Cursor_Pos(TERM_H / 2 - 1, TERM_W / 2 - sizeof(menu_message) / 2);
-	serialWriteStr(menu_message);
-	term_Set_Cursor_Pos(TERM_H / 2 + 1, TERM_W / 2 - sizeof(shell_loading_msg) / 2);
-	serialWriteStr(shell_loading_msg);
-	term_Set_Cursor_Pos(TERM_H / 2 + 3, TERM_W / 2 - sizeof(menu_loading_msg) / 2);
-	serialWriteStr(menu_loading_msg);
+// Double buffered Timer1. Everything that changes the output edits
+// pwm_stage and commits, the Timer1 ISRs move it to the registers on a
+// period boundary:
+//	TOV (TOP)	OCR1A / OCR1B written, hardware latches both at the next BOTTOM
+//	next TOV	prescale swapped, only if it changed, new TOP / compare are live by now.
+//				A commit in between waits for this swap and is written right after it
+//	COMPB		DDRB PB2 changed, only if it changed, the pin is low after the match
+// pwm_commit_ct counts finished commits, pwm_wait() blocks until the stage is live
+// Between pwm_batch_open() and pwm_batch_close() commits are held back and
+// everything staged in between goes live as one
+#define PWM_IDLE		0
+#define PWM_STAGED		1		// Waiting for TOV to write OCR1A / OCR1B
+#define PWM_LATCHED		2		// OCR1x written, prescale swaps at the next TOV
+#define PWM_OUT			3		// Waiting for the compare match to switch the pin
+#define PWM_RELATCH		4		// Committed again while LATCHED, prescale swaps first
+
+#define PWM_BATCH_OFF	0
+#define PWM_BATCH_OPEN	1
+#define PWM_BATCH_DIRTY	2		// A commit was held back
+
+// Ramps move cmp (hi time) or top (period) from the Timer1 overflow, at
+// most one step per ms so fast PWM doesn't spend every period in the ISR.
+// RAMP ARG: CS code of the target counts | RAMP_ARG_FREQ | shape << 4, CS 0 stops
+#define RAMP_OFF		0
+#define RAMP_HI			1
+#define RAMP_FREQ		2
+
+#define RAMP_LIN		0
+#define RAMP_EXP		1
+#define RAMP_S			2
+
+#define RAMP_ARG_CS		0x07
+#define RAMP_ARG_FREQ	0x08
+#define RAMP_ARG_SHAPE	4		// Shift
+
+volatile PWM_STAGE pwm_stage;
+volatile PWM_RAMP pwm_ramp;
+volatile uint8_t pwm_pending = PWM_IDLE;
+volatile uint8_t pwm_latch_cs = 0;		// Prescale that goes with the OCR1x written at the last TOV
+volatile uint8_t pwm_commit_ct = 0;
+volatile uint8_t pwm_batch = PWM_BATCH_OFF;
+volatile uint8_t pwm_src = 0;			// interpret() opcode that staged the change, for the event log
+volatile uint8_t pwm_live_src = 0;		// pwm_src of the commit in flight, logged once it's live
+
+// PB2 is also SPI SS. While the SD card is in use it stays an output, as an
+// input pulled low it would throw the SPI out of master mode. Off is then
+// OC1B letting go of the pin and PORTB2 holding it low
+volatile uint8_t pwm_pb2_held = 0;
+volatile uint8_t pwm_pb2_out = 0;		// What DDRB PB2 would say while held
+
+void pwm_out_apply(){
+	if(pwm_pb2_held){
+		pwm_pb2_out = pwm_stage.out;
+		if(pwm_stage.out) TCCR1A |= (1 << COM1B1);
+		else TCCR1A &= ~(1 << COM1B1);
+		return;
+	}
+	if(pwm_stage.out) DDRB |= (1 << PINB2);
+	else DDRB &= ~(1 << PINB2);
+}
 
-#define BAR_W			71
-#define WAIT_SECONDS	5
+uint8_t pwm_out_live(){
+	if(pwm_pb2_held) return pwm_pb2_out;
+	return (DDRB >> PINB2) & 0x01;
+}
 
-	printBarFrame(20, 3, BAR_W);
-	updateBarValue(20, 3, BAR_W, 2, 0);
-	
-	// We have a canned 10ms timer
-	// for 5 second loading time:	5 / 0.010 = 500
-	// for 1 seconds: 1 / 0.010 = 100
-	
-	uint8_t to_go__ = 1;						// Where to go after the menu
-	
-	for(uint8_t s = 0; s < WAIT_SECONDS; s++){
-		for(uint8_t n = 0; n < 98; n++){
-			T2_10MS_SETUP
-			while(WAIT_FLAG_T2);				// Wait for timer to clear
-		}
-		for(uint8_t m = s; m < ((s + 1) * ((BAR_W - 1) / WAIT_SECONDS)); m++){
-			updateBarValue(20, 3, BAR_W, 0, m);
-			T2_10MS_SETUP
-			while(WAIT_FLAG_T2);
-			T2_10MS_SETUP
-			while(WAIT_FLAG_T2);
-			
+void pwm_pb2_hold(uint8_t on){			// SD card in use from on to off
+	uint8_t sreg_ = SREG;
+	cli();
+	if(on && !pwm_pb2_held){
+		pwm_pb2_out = pwm_out_live();
+		if(!mc_active){					// Multi channel drives PB2 from PORTB already
+			PORTB &= ~(1 << PINB2);
+			if(!pwm_pb2_out) TCCR1A &= ~(1 << COM1B1);
 		}
+		DDRB |= (1 << PINB2);
+		pwm_pb2_held = 1;
+	} else
+	if(!on && pwm_pb2_held){
+		pwm_pb2_held = 0;
+		if(!pwm_pb2_out) DDRB &= ~(1 << PINB2);
+		if(!mc_active) TCCR1A |= (1 << COM1B1);
 	}
-#undef BAR_W
-#undef WAIT_SECONDS
-
-	//while(1);				// Hold in menu for debug
-	return to_go__;
+	SREG = sreg_;
 }
 
-// Case 1
-#define MAX_ENTRY_LEN		20
-#define MAX_LINES			5
-char line_entry[MAX_ENTRY_LEN][MAX_LINES] = {0x00};
-uint8_t bottom_line = MAX_LINES - 1;
+void pwm_done(){
+	pwm_pending = PWM_IDLE;
+	pwm_commit_ct += 1;
+	TOGGLE_INDIC_STROBE
+	log_live(OCR1A, OCR1B, LOG_MODE(T1_CS, pwm_out_live(), 0), pwm_live_src);
+}
 
-// Shell Modes:
-//					0: EXIT
-//					1: Print terminal history
-//					2: Accept Inputs (resting state)
-//					3: RES
-//					4: Syntax Error on Entry
+// (e^4x - 1) / (e^4 - 1) at x = n / 16
+const uint16_t ramp_exp_tbl[17] PROGMEM = {0, 347, 793, 1366, 2101, 3045, 4257, 5814, 7812, 10378, 13673, 17904, 23336, 30311, 39268, 50768, 65535};
 
-void goto_shell(){
-	char tmp_buf[MAX_ENTRY_LEN + 1] = {0x00};
-	uint8_t wr_ptr = 0;
-	uint8_t shell_mode = 1;
-	uint8_t cur_pos_X = 3;
-	uint8_t cur_pos_Y = MAX_LINES + 1;
-	uint8_t line_to_print = 0;
-	
-	const char sh__nm[] = "SHELL\0";
-	
-	while(shell_mode){
-		if(shell_mode == 4) shell_mode = 1;			// MAKE A HANDLER FOR ERROR ON INPUT
-		if(shell_mode == 1){									// Indicates a BUFFER PRINT status event
-			cur_pos_Y = MAX_LINES + 1;
-			line_to_print = bottom_line;
-			for(uint8_t n = 0; n < MAX_LINES; n++){				// Print terminal output buffer
-				//cur_pos_Y -= n;
-				term_Set_Cursor_Pos(cur_pos_Y - n, cur_pos_X);
-				
-				for(uint8_t c = 0; c < MAX_ENTRY_LEN; c++){
-					serialWrite(' ');
-				}
-				
-				term_Set_Cursor_Pos(cur_pos_Y - n, cur_pos_X);
-				
-				for(uint8_t c = 0; c < MAX_ENTRY_LEN; c++){
-					serialWrite(line_entry[c][line_to_print]);
-				}
-				
-				line_to_print -= 1;
-				if(line_to_print > MAX_LINES - 1){
-					line_to_print = MAX_LINES - 1;
-				}
-				
-				
-			}
-			shell_mode = 2;	
-		}
-		
-		term_Set_Cursor_Pos(3, TERM_W - sizeof(sh__nm));
-		serialWriteStr(sh__nm);
-		
-		term_Set_Cursor_Pos(MAX_LINES + 3, 3);
-		for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
-			serialWrite(' ');
+uint16_t pwm_ramp_shape(uint8_t shape, uint16_t p){	// p and result are 0 - 0xFFFF of the way
+	switch(shape){
+		case RAMP_EXP:{
+			uint8_t n_ = p >> 12;
+			uint16_t lo_ = pgm_read_word(&ramp_exp_tbl[n_]);
+			return lo_ + (uint16_t)(((uint32_t)(pgm_read_word(&ramp_exp_tbl[n_ + 1]) - lo_) * (p & 0x0FFF)) >> 12);
 		}
-		term_Set_Cursor_Pos(MAX_LINES + 3, 3);
-		serialWriteStr(tmp_buf);
-		
-		
-		term_Set_Cursor_Pos(TERM_H / 2, TERM_W / 2);
-		term_Send_Val_as_Digits(bottom_line);
-		
-		term_Set_Cursor_Pos(TERM_H / 2 + 2, TERM_W / 2);
-		serialWrite('X');
-		serialWrite(' ');
-		term_Send_Val_as_Digits(cur_pos_X);
-		term_Set_Cursor_Pos(TERM_H / 2 + 4, TERM_W / 2);
-		serialWrite('Y');
-		serialWrite(' ');
-		term_Send_Val_as_Digits(cur_pos_Y);
-		
-		term_Set_Cursor_Pos(MAX_LINES + 3, 2);
-		serialWrite('>');
-		
-		term_Set_Cursor_Pos(MAX_LINES + 3, 3 + wr_ptr);
-		
-		// Current buffer now printed, now go into entry mode
-		uint16_t read_val = serial_rx_ESC_seq();
-		if(read_val == ENTER_KEY){							// Enter Key Press Event
-			if(tmp_buf[0]){
-				bottom_line += 1;
-				if(bottom_line > MAX_LINES - 1){
-					bottom_line = 0;
-				}
-				
-				shell_mode = parse_entry(tmp_buf, 1, NULL);
-				
-				for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
-					if(tmp_buf[n]){
-						line_entry[n][bottom_line] = tmp_buf[n];	
-					} else {
-						line_entry[n][bottom_line] = 0x00;		// Necessary to reset screen/history buffer contents
-					}
-					tmp_buf[n] = 0x00;
-				}
-				tmp_buf[MAX_ENTRY_LEN] = 0x00;
-				wr_ptr = 0;
-			}
-		} else
-		if(!(read_val & 0xFF)){								// Arrow Key Press Event
-			switch(read_val >> 8){
-				case MOVE_LEFT:
-					if(wr_ptr) wr_ptr -= 1;
-				break;
-				case MOVE_RIGHT:
-					if(tmp_buf[wr_ptr] && wr_ptr < MAX_ENTRY_LEN) wr_ptr += 1;
-				break;
-				case MOVE_UP:
-					wr_ptr = 0;
-					for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
-						tmp_buf[n] = line_entry[n][bottom_line];
-						if(tmp_buf[n]){
-							wr_ptr += 1;
-						}
-					}
-					for(uint8_t n = MAX_ENTRY_LEN - 1; n != 0; n--){
-						if(tmp_buf[n] != ' '){
-							break;
-						}
-						wr_ptr -= 1;
-					}
-					
-				break;
-			}
-		} else {											// Text Entry Event
-			switch(read_val){
-				case 8:										// Backspace
-					if(wr_ptr){
-						wr_ptr -= 1;
-						for(uint8_t n = wr_ptr; n < MAX_ENTRY_LEN; n++){
-							tmp_buf[n] = tmp_buf[n + 1];
-						}
-						tmp_buf[MAX_ENTRY_LEN] = '\0';	
-					}
-				break;
-				
-				default:									// Generic Text Entry
-					if(wr_ptr < MAX_ENTRY_LEN){	
-						tmp_buf[wr_ptr] = read_val;
-						wr_ptr += 1;
-					}
-				break;
-			}
+		case RAMP_S:{						// Smoothstep 3p^2 - 2p^3, in 15 bits so it fits 32 bit math
+			uint32_t q_ = p >> 1;
+			uint32_t s_ = (((q_ * q_) >> 15) * (3UL * 32768UL - 2 * q_)) >> 15;
+			return (s_ >= 32768UL) ? 0xFFFF : (uint16_t)(s_ << 1);
 		}
-		
-		
-		cur_pos_X = 3;
-		cur_pos_Y = MAX_LINES + 2;
+		default:
+			return p;
 	}
 }
 
-uint8_t parse_entry(char *user_entry, uint8_t run_instantly, INSTRUCT_STRUCT *INS_OUT){
-	//term_Set_Cursor_Pos(5, 38);
-	//serialWrite('S');
-	//serialWrite(' ');
+uint8_t pwm_ramp_step(){				// Timer1 ISR, stage the next point. 1 if the stage changed
+	uint32_t now_ = timebase_now();
+	if(now_ - pwm_ramp.last < TB_TICKS_PER_MS) return 0;
+	pwm_ramp.last = now_;
 	
-	
-	uint8_t rd_ptr = 0;
-	for(uint8_t n = rd_ptr; n < MAX_ENTRY_LEN; n++){
-		if(user_entry[n] != 0x00 && user_entry[n] != ' '){
-			rd_ptr = n;
-			break;
+	uint8_t kind_ = pwm_ramp.kind;
+	uint32_t el_ = now_ - pwm_ramp.start;
+	uint16_t v_ = pwm_ramp.to;
+	if(el_ < pwm_ramp.span){
+		uint16_t p_ = (uint16_t)(((el_ >> pwm_ramp.shift) << 16) / (pwm_ramp.span >> pwm_ramp.shift));
+		uint32_t s_ = pwm_ramp_shape(pwm_ramp.shape, p_);
+		if(pwm_ramp.to > pwm_ramp.from){
+			v_ = pwm_ramp.from + (uint16_t)(((uint32_t)(pwm_ramp.to - pwm_ramp.from) * s_) >> 16);
+		} else {
+			v_ = pwm_ramp.from - (uint16_t)(((uint32_t)(pwm_ramp.from - pwm_ramp.to) * s_) >> 16);
 		}
+	} else {
+		pwm_ramp.kind = RAMP_OFF;			// Last point is the exact target
 	}
 	
-	//term_Set_Cursor_Pos(5, 51);
-	//serialWrite('R');
-	//term_Send_Val_as_Digits(rd_ptr);
-	
-	char lead_letter = user_entry[rd_ptr];
-	char arg_0_tmp[8] = {0x00};
-	uint8_t arg_0_rd_ptr = 0;
-	uint8_t scalar_ = 0;		// 0 == us, 1 == ms, 2 == s
-	
-	uint8_t parse_stage = 0;
-	for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
-		if(!user_entry[n]) break;
-		switch(parse_stage){
-			case 0:		// Skip to space
-				if(user_entry[n] == ' '){
-					if(lead_letter == 't' || lead_letter == 'z'){
-						parse_stage = 2;		// Collect Text input
-					} else {
-						parse_stage = 1;		// Collect Numeric input
-					}
-				}
-			break;
-			case 1:
-				if(user_entry[n] == '.' || (user_entry[n] >= '0' && user_entry[n] <= '9')){
-					arg_0_tmp[arg_0_rd_ptr] = user_entry[n];
-					arg_0_rd_ptr += 1;
-				} else 
-				if(user_entry[n] == 's'){
-					scalar_ = 2;
-				} else
-				if(user_entry[n] == 'm'){
-					scalar_ = 1;
-				}
-			break;
-			case 2:
-				if(user_entry[n] >= 'A' && user_entry[n] <= 'Z') user_entry[n] -= ('A' - 'a');
-				if(user_entry[n] >= 'a' && user_entry[n] <= 'z'){
-					arg_0_tmp[arg_0_rd_ptr] = user_entry[n];
-					arg_0_rd_ptr += 1;
-				}
-			break;
+	if(kind_ == RAMP_FREQ){
+		if(v_ < 1) v_ = 1;
+		if(pwm_stage.top == v_) return 0;
+		pwm_stage.top = v_;
+		if(pwm_stage.cmp > v_) pwm_stage.cmp = v_;
+	} else {
+		if(v_ > pwm_stage.top) v_ = pwm_stage.top;
+		if(pwm_stage.cmp == v_) return 0;
+		pwm_stage.cmp = v_;
+	}
+	return 1;
+}
+
+ISR(TIMER1_OVF_vect){
+	if(pwm_pending == PWM_IDLE){			// Only a ramp keeps TOIE1 on without a commit
+		if(!pwm_ramp.kind || pwm_batch || !pwm_ramp_step()){
+			if(!pwm_ramp.kind) TIMSK1 &= ~(1 << TOIE1);
+			return;
 		}
+		pwm_pending = PWM_STAGED;
+		pwm_live_src = 10;
 	}
 	
-	INSTRUCT_STRUCT INSTR;
-	
-	switch(lead_letter){
-		// Output
-		case 'O':
-		case 'o':
-			INSTR.OPCODE = 0;
-		break;
-		
-		// Freq
-		case 'F':
-		case 'f':
-			INSTR.OPCODE = 1;
-		break;
-		
-		// Period
-		case 'P':
-		case 'p':
-			INSTR.OPCODE = 2;
-		break;
-		
-		// Duty
-		case 'D':
-		case 'd':
-			INSTR.OPCODE = 3;
-		break;
-		
-		// HI_TIME
-		case 'H':
-		case 'h':
-			INSTR.OPCODE = 4;
-		break;
-		
-		// STALL
-		case 'S':
-		case 's':
-			INSTR.OPCODE = 5;
-		break;
-		
-		// TYPE
-		case 'T':
-		case 't':
-			INSTR.OPCODE = 6;
-		break;
-		
-		// Zepto
-		case 'Z':
-		case 'z':
-			INSTR.OPCODE = 7;
-		break;
-		
-		// Math functions
-		case 'M':
-		case 'm':
-		//char lead_letter = user_entry[rd_ptr];
-			switch(user_entry[rd_ptr + 1]){
-				case 'S':
-				case 's':
-					// Subtract
-					INSTR.OPCODE = 36;
-				break;
-				
-				case 'A':
-				case 'a':
-					// Add
-					INSTR.OPCODE = 37;
-				break;
-			}
-		break;
-		
-		default:
-			// Syntax error
-			rd_ptr = 0xFF;
-		break;
+	if(pwm_pending == PWM_LATCHED || pwm_pending == PWM_RELATCH){
+		SET_T1_CS(pwm_latch_cs)
+		if(pwm_pending == PWM_RELATCH) pwm_pending = PWM_STAGED;	// Registers agree again, the new stage goes in now
+	}
+	if(pwm_pending == PWM_STAGED){
+		OCR1A = pwm_stage.top;
+		OCR1B = pwm_stage.cmp;
+		if(pwm_stage.cs != T1_CS){
+			pwm_latch_cs = pwm_stage.cs;
+			pwm_pending = PWM_LATCHED;
+			return;
+		}
 	}
 	
-	if(rd_ptr == 0xFF) return 4;
-	
+	if(!pwm_ramp.kind) TIMSK1 &= ~(1 << TOIE1);
+	if(pwm_stage.out != pwm_out_live()){
+		if(OCR1B > OCR1A){				// Never matches, the pin is high all period
+			pwm_out_apply();
+		} else {
+			pwm_pending = PWM_OUT;
+			TIFR1 = (1 << OCF1B);			// Stale match from earlier in this period
+			TIMSK1 |= (1 << OCIE1B);
+			return;
+		}
+	}
+	pwm_done();
+}
 
-	// Remember:
-	//	PB2 == COMPB
-	//	COMPA == TOP
-	//  f = 16MHz / ( pre * ( 1 + TOP ) )
-	//		Pre Values Range at 65535 TOP:
-	//			1		244 Hz
-	//			8		30.51
-	//			64		3.81
-	//			256		0.954
-	//			1024	0.238
-	//term_Set_Cursor_Pos(10, 50);
-	//serialWrite('R');
-	//serialWrite('D');
-	//serialWrite('\t');
-	//term_Send_Val_as_Digits(rd_ptr);
-	
-	term_Set_Cursor_Pos(15, 3);
-	serialWrite('A');
-	serialWrite(' ');
-	for(uint8_t q = 0; q < 8; q++){
-		serialWrite(' ');
+ISR(TIMER1_COMPB_vect){
+	if(mc_active){
+		mc_edge();
+		return;
+	}
+	TIMSK1 &= ~(1 << OCIE1B);
+	pwm_out_apply();
+	pwm_done();
+}
+
+void pwm_commit(){						// Interrupts must be off
+	if(pwm_batch){
+		pwm_batch = PWM_BATCH_DIRTY;
+		return;
+	}
+	pwm_live_src = pwm_src;
+	if(mc_active){						// Frame and output of all channels come from the stage
+		mc_build();
+		return;
+	}
+	if(!T1_CS){							// Timer stopped, nothing to glitch
+		OCR1A = pwm_stage.top;
+		OCR1B = pwm_stage.cmp;
+		pwm_out_apply();
+		SET_T1_CS(pwm_stage.cs)
+		TIMSK1 &= ~((1 << TOIE1) | (1 << OCIE1B));
+		pwm_done();
+		return;
+	}
+	if(pwm_pending == PWM_LATCHED || pwm_pending == PWM_RELATCH){	// OCR1x are already in for the latched prescale, TOIE1 is on
+		pwm_pending = PWM_RELATCH;
+		return;
+	}
+	pwm_pending = PWM_STAGED;
+	TIMSK1 &= ~(1 << OCIE1B);
+	TIFR1 = (1 << TOV1);				// Only a TOP after now counts
+	TIMSK1 |= (1 << TOIE1);
+}
+
+uint8_t pwm_wait(){						// 0 if CTRL+X gave up waiting
+	while(pwm_pending || mc_swap){
+		SIM_IDLE();
+		if(!ui_quiet && serial_rx_abort()) return 0;
+	}
+	return 1;
+}
+
+void pwm_batch_open(){					// Previous commit must be done, the ISRs read the stage
+	pwm_batch = PWM_BATCH_OPEN;
+}
+
+void pwm_batch_close(){
+	uint8_t sreg_ = SREG;
+	cli();
+	uint8_t dirty_ = (pwm_batch == PWM_BATCH_DIRTY);
+	pwm_batch = PWM_BATCH_OFF;
+	if(dirty_) pwm_commit();
+	SREG = sreg_;
+}
+
+// Stage edits, safe from the foreground and from ISRs, all commit
+void pwm_set_out(uint8_t on){
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_stage.out = (on) ? 1 : 0;
+	pwm_commit();
+	SREG = sreg_;
+}
+
+void pwm_set_timing(uint8_t cs, uint16_t top, uint16_t cmp){
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_ramp.kind = RAMP_OFF;			// New set point wins over a running ramp
+	pwm_stage.cs = cs;
+	pwm_stage.top = top;
+	pwm_stage.cmp = cmp;
+	pwm_commit();
+	SREG = sreg_;
+}
+
+uint16_t pwm_frac_cmp(uint16_t frac, uint16_t top){	// Compare value for a 16 bit fraction of top + 1
+	if(frac == 0xFFFF) return top;
+	uint16_t tmp_ = (uint16_t)(((uint32_t)frac * ((uint32_t)top + 1) + 0x8000) >> 16);
+	return (tmp_) ? tmp_ - 1 : 0;		// High for cmp + 1 counts
+}
+
+// In multi channel mode hi time edits go to every channel, pwm_stage.cmp is
+// left for when single channel mode comes back
+void pwm_set_duty(uint16_t frac){		// 16 bit fraction of the period, 0xFFFF == 100%
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_ramp.kind = RAMP_OFF;
+	if(mc_active){
+		mc_hi_set(0, pwm_frac_cmp(frac, mc_frame_top()));
+	} else {
+		pwm_stage.cmp = pwm_frac_cmp(frac, pwm_stage.top);
+	}
+	pwm_commit();
+	SREG = sreg_;
+}
+
+void pwm_set_hi(uint16_t counts, uint8_t cs){	// counts were taken at prescale cs
+	if(mc_active){
+		mc_set_hi(0, counts, cs);
+		return;
+	}
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_ramp.kind = RAMP_OFF;
+	counts = t1_rescale(counts, cs, pwm_stage.cs);
+	pwm_stage.cmp = (counts > pwm_stage.top) ? pwm_stage.top : counts;
+	pwm_commit();
+	SREG = sreg_;
+}
+
+void pwm_add_us(uint16_t us, uint8_t sub){
+	if(mc_active){
+		mc_add_us(0, us, sub);
+		return;
+	}
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_ramp.kind = RAMP_OFF;
+	uint16_t tmp_ = t1_us_to_counts(us, pwm_stage.cs);
+	if(sub){
+		pwm_stage.cmp = (pwm_stage.cmp > tmp_) ? pwm_stage.cmp - tmp_ : 0;
+	} else {
+		pwm_stage.cmp = (pwm_stage.top - pwm_stage.cmp > tmp_) ? pwm_stage.cmp + tmp_ : pwm_stage.top;
+	}
+	pwm_commit();
+	SREG = sreg_;
+}
+
+// Ramp from the staged value to target (counts - 1 at ARG's CS code) over ms
+// A frequency ramp moves the period, on the slower of the two prescales
+uint8_t pwm_ramp_start(uint8_t arg, uint16_t target, uint16_t ms){	// 0 if there is nothing to ramp
+	uint8_t cs_ = arg & RAMP_ARG_CS;
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_ramp.kind = RAMP_OFF;
+	if(!cs_){							// STOP
+		SREG = sreg_;
+		return 1;
 	}
-	term_Set_Cursor_Pos(15, 5);
-	for(uint8_t q = 0; q < 8; q++){
-		serialWrite(arg_0_tmp[q]);
+	if(cs_ > T1_CS_MAX || !T1_CS || mc_active){		// Timer isn't running yet, or no TOV to step on
+		SREG = sreg_;
+		return 0;
 	}
 	
-	// Numbers and math modes
-	if((INSTR.OPCODE > 0 && INSTR.OPCODE < 6) || (INSTR.OPCODE > 30 && INSTR.OPCODE < 60)){
-		arg_0_tmp[7] = 0x00;
-		float tmp_ = (float)(strtod(arg_0_tmp, NULL));
-		//float tmp_ = (float)(atof(arg_0_tmp));
-		
-		term_Set_Cursor_Pos(17, 3);
-		serialWrite('F');
-		serialWrite(' ');
-		term_Send_16_as_Digits((uint16_t)tmp_);
-		
-		// Scale time measurements
-		
-		if(INSTR.OPCODE == 4){
-			if(scalar_ == 0x00){
-				// us
-				tmp_ = tmp_ / 1000000.0f;
-			} else
-			if(scalar_ == 0x01){
-				// ms
-				tmp_ = tmp_ / 1000.0f;
-			} else {}	
+	if(arg & RAMP_ARG_FREQ){
+		if(cs_ > pwm_stage.cs){			// Both ends have to fit, current timing moves over first
+			pwm_stage.top = t1_rescale(pwm_stage.top, pwm_stage.cs, cs_);
+			pwm_stage.cmp = t1_rescale(pwm_stage.cmp, pwm_stage.cs, cs_);
+			pwm_stage.cs = cs_;
+			pwm_commit();
 		}
+		pwm_ramp.kind = RAMP_FREQ;
+		pwm_ramp.from = pwm_stage.top;
+	} else {
+		pwm_ramp.kind = RAMP_HI;
+		pwm_ramp.from = pwm_stage.cmp;
+	}
+	pwm_ramp.to = t1_rescale(target, cs_, pwm_stage.cs);
+	pwm_ramp.shape = arg >> RAMP_ARG_SHAPE;
+	pwm_ramp.span = (uint32_t)ms * TB_TICKS_PER_MS;
+	pwm_ramp.shift = 0;
+	while((pwm_ramp.span >> pwm_ramp.shift) > 0xFFFF) pwm_ramp.shift += 1;
+	pwm_ramp.start = timebase_now();
+	pwm_ramp.last = pwm_ramp.start;
+	TIMSK1 |= (1 << TOIE1);
+	SREG = sreg_;
+	return 1;
+}
+
+void pwm_ramp_stop(){					// Stage keeps the last point, TOIE1 goes at the next overflow
+	pwm_ramp.kind = RAMP_OFF;
+}
+
+
+  //////////////////////////////////////////////////////////////////////////
+ //							MULTI CHANNEL								 //
+//////////////////////////////////////////////////////////////////////////
+
+// MC_CH_CT servo / ESC outputs on any PORTB / PORTD pins sharing one frame.
+// Timer1 runs CTC (mode 4) at MC_CS, OCR1A is the frame:
+//	COMPA	frame start, driven pins go high, a rebuilt MC_FRAME is swapped in
+//	COMPB	falling edges in time order, OCR1B moves on to the next one
+// Edges closer than MC_EDGE_GAP are waited out inside the ISR, OCR1B could
+// be set behind the counter otherwise. Set points only rebuild the idle
+// MC_FRAME, from pwm_commit() like everything else, never the live one.
+// Frame length and output still come from pwm_stage, hi times from mc_hi[]
+#define MC_CS			2			// Prescale 8, 0.5us per count
+#define MC_EDGE_GAP		20			// Counts, ISR return and entry with room to spare
+#define MC_TOP_MIN		(4 * MC_EDGE_GAP)
+#define MC_PB(bit)		(bit)
+#define MC_PD(bit)		(0x08 | (bit))
+
+// Channel 0 is the single channel output, PD0 / PD1 UART, PD7 strobe, PB3 - PB5 SPI stay free
+const uint8_t mc_pins[MC_CH_CT] PROGMEM = {MC_PB(2), MC_PB(1), MC_PB(0), MC_PD(6), MC_PD(5), MC_PD(4), MC_PD(3), MC_PD(2)};
+
+volatile uint8_t mc_active = 0;
+volatile MC_FRAME mc_frame[2];
+volatile uint8_t mc_live = 0;			// mc_frame[] the ISRs read
+volatile uint8_t mc_swap = 0;			// The other one is ready for the next frame start
+uint8_t mc_next = 0;					// Next edge of the live frame
+uint8_t mc_mask_b = 0;
+uint8_t mc_mask_d = 0;
+uint16_t mc_hi[MC_CH_CT];				// Counts - 1 at MC_CS
+
+void mc_masks(){						// Pins the channels drive, PB0 is ICP1 while capturing
+	mc_mask_b = 0;
+	mc_mask_d = 0;
+	for(uint8_t n = 0; n < MC_CH_CT; n++){
+		uint8_t pin_ = pgm_read_byte(&mc_pins[n]);
+		if(pin_ & 0x08) mc_mask_d |= (1 << (pin_ & 0x07));
+		else mc_mask_b |= (1 << pin_);
+	}
+	if(cap_on) mc_mask_b &= ~(1 << PB0);
+}
+
+void mc_drive(uint8_t on){
+	uint8_t mask_b_ = mc_mask_b;
+	if(pwm_pb2_held){					// SD card has SS, PB2 stays an output, low while off
+		pwm_pb2_out = on;
+		mask_b_ &= ~(1 << PINB2);
+	}
+	if(on){
+		DDRB |= mask_b_;
+		DDRD |= mc_mask_d;
+	} else {
+		DDRB &= ~mask_b_;
+		DDRD &= ~mc_mask_d;
+	}
+}
+
+ISR(TIMER1_COMPA_vect){
+	if(mc_swap){
+		mc_live ^= 1;
+		mc_swap = 0;
+		OCR1A = mc_frame[mc_live].top;	// Counter is just past BOTTOM, nothing to miss
+		mc_drive(mc_frame[mc_live].out);
+		pwm_commit_ct += 1;
+		TOGGLE_INDIC_STROBE
+		log_live(OCR1A, mc_frame[mc_live].edge[0].at, LOG_MODE(MC_CS, mc_frame[mc_live].out, 1), mc_frame[mc_live].src);
+	}
+	volatile MC_FRAME *f_ = &mc_frame[mc_live];
+	if(f_->out){
+		PORTB |= mc_mask_b;
+		PORTD |= mc_mask_d;
+	}
+	mc_next = 0;
+	OCR1B = f_->edge[0].at;
+}
+
+void mc_edge(){							// Timer1 COMPB
+	volatile MC_FRAME *f_ = &mc_frame[mc_live];
+	while(mc_next < f_->ct){
+		PORTB &= ~f_->edge[mc_next].clr_b;
+		PORTD &= ~f_->edge[mc_next].clr_d;
+		mc_next += 1;
+		if(mc_next == f_->ct) return;
 		
-		
-		switch(INSTR.OPCODE){
-			case 1:					// Freq, Fill lower 8 of DATA with TCCR1B contents to set prescale freq
-			case 2:					// Period, inverse of frequency
-			case 4:					// Hi Time, destination OCR1B
-				if(INSTR.OPCODE != 1){	// period -> freq, time hi -> 'freq' equiv
-					tmp_ = 1.0f / tmp_;
-					if(INSTR.OPCODE == 2) INSTR.OPCODE = 1;	// Convert back to FREQ from PERIOD
-				}
-				
-				if(tmp_ > 244.0f){		// Div 1
-					// No SHIFT bit
-					scalar_ = 1;
-					tmp_ += 0.3f;
-				} else
-				if(tmp_ > 30.6f){		// Div 8
-					// Add SHIFT bit
-					INSTR.OPCODE |= (1 << 7);
-					scalar_ = 8;
-					tmp_ += 0.03f;
-				} else {}
-				
-				
-				
-				tmp_ /= 16000000.0f;
-				tmp_ = 1.0f / tmp_;
-				tmp_ /= (float)scalar_;
-				INSTR.DATA = ((uint16_t)tmp_) - 1;		// TOP value, OCR1A
-				
-			break;		
-			
-			case 3:					// Duty
-				INSTR.DATA = (uint16_t)(65535.0f * (tmp_ / 100.0f));
-			break;
-			
-			case 5:					// Stall (Delay ms)
-			case 36:				// Math subtract
-			case 37:				// Math add
-				INSTR.DATA = (uint16_t) (tmp_);	
-			break;
+		uint16_t at_ = f_->edge[mc_next].at;
+		if(at_ > TCNT1 + MC_EDGE_GAP){
+			OCR1B = at_;
+			return;
+		}
+		while(TCNT1 < at_) SIM_IDLE();
+	}
+}
+
+uint16_t mc_frame_top(){				// pwm_stage period at MC_CS
+	uint16_t top_ = t1_rescale(pwm_stage.top, pwm_stage.cs, MC_CS);
+	return (top_ < MC_TOP_MIN) ? MC_TOP_MIN : top_;
+}
 
+void mc_build(){						// Interrupts off, live from the next frame start
+	uint8_t ord_[MC_CH_CT];
+	uint16_t top_ = mc_frame_top();
+	mc_swap = 0;						// mc_live holds still until mc_swap is set again
+	volatile MC_FRAME *f_ = &mc_frame[mc_live ^ 1];
+	
+	for(uint8_t n = 0; n < MC_CH_CT; n++){				// Insertion sort by hi time
+		uint8_t m = n;
+		for(; m && mc_hi[ord_[m - 1]] > mc_hi[n]; m--){
+			ord_[m] = ord_[m - 1];
 		}
-	} else
-	if(INSTR.OPCODE == 7){
-		// Open Zepto
-		INSTR.DATA = 1;
-	} else
-	if(INSTR.OPCODE == 0x00){
-		if(arg_0_tmp[0] == '1' || arg_0_tmp[1] == 'N' || arg_0_tmp[1] == 'n'){
-			INSTR.DATA = 1;		// Output on
-		} else {
-			INSTR.DATA = 0;		// Output Off
+		ord_[m] = n;
+	}
+	
+	f_->top = top_;
+	f_->out = pwm_stage.out;
+	f_->src = pwm_src;
+	f_->ct = 0;
+	for(uint8_t n = 0; n < MC_CH_CT; n++){				// Channels with the same edge share it
+		uint16_t at_ = mc_hi[ord_[n]];
+		if(at_ < MC_EDGE_GAP) at_ = MC_EDGE_GAP;
+		if(at_ > top_ - MC_EDGE_GAP) at_ = top_ - MC_EDGE_GAP;
+		if(!f_->ct || f_->edge[f_->ct - 1].at != at_){
+			f_->edge[f_->ct].at = at_;
+			f_->edge[f_->ct].clr_b = 0;
+			f_->edge[f_->ct].clr_d = 0;
+			f_->ct += 1;
 		}
-	} else
-	if(INSTR.OPCODE == 6){
-		scalar_ = 0;
-		for(uint8_t q = 0; q < MAX_ENTRY_LEN; q++){
-			if(arg_0_tmp[q] > 0 && arg_0_tmp[q] != ' '){
-				scalar_ = q;
-				break;
-			}
+		uint8_t pin_ = pgm_read_byte(&mc_pins[ord_[n]]);
+		if(pin_ & 0x08){
+			f_->edge[f_->ct - 1].clr_d |= (1 << (pin_ & 0x07));
+		} else {
+			f_->edge[f_->ct - 1].clr_b |= (1 << pin_);
 		}
-		
-		if(arg_0_tmp[scalar_] == 'e' || arg_0_tmp[scalar_] == 'E'){		// ESC Default: 1500us Center, 400Hz
-			INSTR.DATA = 0x01;
-		} else
-		if(arg_0_tmp[scalar_] == 's' || arg_0_tmp[scalar_] == 'S'){		// Servo Default: 1500us Center, 50Hz
-			INSTR.DATA = 0x02;
+	}
+	mc_swap = 1;
+}
+
+void mc_hi_set(uint8_t ch, uint16_t counts){	// ch 0 all, else channel ch - 1
+	for(uint8_t n = 0; n < MC_CH_CT; n++){
+		if(!ch || ch - 1 == n) mc_hi[n] = counts;
+	}
+}
+
+// Channel set points, ch 0 all, else channel ch - 1. 0 outside multi channel mode
+uint8_t mc_set_hi(uint8_t ch, uint16_t counts, uint8_t cs){	// counts were taken at prescale cs
+	if(!mc_active) return 0;
+	uint8_t sreg_ = SREG;
+	cli();
+	mc_hi_set(ch, t1_rescale(counts, cs, MC_CS));
+	pwm_commit();
+	SREG = sreg_;
+	return 1;
+}
+
+uint8_t mc_add_us(uint8_t ch, uint16_t us, uint8_t sub){
+	if(!mc_active) return 0;
+	uint8_t sreg_ = SREG;
+	cli();
+	uint16_t tmp_ = t1_us_to_counts(us, MC_CS);
+	uint16_t top_ = mc_frame_top();
+	for(uint8_t n = 0; n < MC_CH_CT; n++){
+		if(ch && ch - 1 != n) continue;
+		if(sub){
+			mc_hi[n] = (mc_hi[n] > tmp_) ? mc_hi[n] - tmp_ : 0;
 		} else {
-			// Error state
-			INSTR.DATA = 0x00;
+			mc_hi[n] = (mc_hi[n] < top_ && top_ - mc_hi[n] > tmp_) ? mc_hi[n] + tmp_ : top_;
 		}
-	} else {}
-	
+	}
+	pwm_commit();
+	SREG = sreg_;
+	return 1;
+}
+
+// MULTI 1 / 0. Switches over on a frame boundary of the mode being left:
+// the single output is switched off after its pulse, all channels skip a frame
+uint8_t mc_start(uint8_t on){			// 1 ok, 4 no frame to start from, 5 CTRL+X
+	uint8_t out_ = pwm_stage.out;
+	if((on != 0) == mc_active) return 1;
+	if(on && (!T1_CS || t1_rescale(pwm_stage.top, pwm_stage.cs, MC_CS) == 0xFFFF)) return 4;	// Nothing running or over 32ms
 	
-	term_Set_Cursor_Pos(18, 3);
-	serialWrite('I');
-	serialWrite(' ');
-	term_Send_Val_as_Digits(INSTR.OPCODE);
-	serialWrite(' ');
-	term_Send_16_as_Digits(INSTR.DATA);
+	pwm_ramp_stop();
+	pwm_set_out(0);
+	if(!pwm_wait()){
+		pwm_set_out(out_);
+		return 5;
+	}
 	
-	if(run_instantly){
-		return interpret(&INSTR);
+	uint8_t sreg_ = SREG;
+	cli();
+	pwm_stage.out = out_;
+	TIMSK1 &= ~((1 << TOIE1) | (1 << OCIE1A) | (1 << OCIE1B));
+	TCCR1B &= T1_ICP_MASK;				// Stopped while it's rewired
+	TCNT1 = 0;
+	if(on){
+		mc_masks();
+		PORTB &= ~mc_mask_b;
+		PORTD &= ~mc_mask_d;
+		mc_hi_set(0, t1_rescale(pwm_stage.cmp, pwm_stage.cs, MC_CS));
+		mc_active = 1;
+		mc_live = 0;
+		mc_frame[0].ct = 0;				// First frame is empty, the real one swaps in at its end
+		mc_frame[0].out = 0;
+		mc_build();
+		
+		TCCR1A = 0x00;					// OC1B off, PB2 is a plain pin now
+		OCR1A = mc_frame_top();
+		OCR1B = 0xFFFF;					// Past TOP, no edge in the first frame
+		TIFR1 = (1 << OCF1A) | (1 << OCF1B);
+		TIMSK1 |= (1 << OCIE1A) | (1 << OCIE1B);
+		TCCR1B = (TCCR1B & T1_ICP_MASK) | (1 << WGM12) | MC_CS;
 	} else {
-		INS_OUT->OPCODE = INSTR.OPCODE;
-		INS_OUT->DATA = INSTR.DATA;
-		return 1;
+		mc_active = 0;
+		mc_swap = 0;
+		PORTB &= ~mc_mask_b;
+		PORTD &= ~mc_mask_d;
+		mc_drive(0);
+		init_timer_1();
+		OCR1A = pwm_stage.top;
+		OCR1B = pwm_stage.cmp;
+		pwm_out_apply();
+		SET_T1_CS(pwm_stage.cs)
+		log_live(OCR1A, OCR1B, LOG_MODE(T1_CS, pwm_out_live(), 0), pwm_src);
 	}
+	SREG = sreg_;
+	return 1;
 }
 
+  //////////////////////////////////////////////////////////////////////////
+ //							INPUT CAPTURE								 //
+//////////////////////////////////////////////////////////////////////////
 
-uint8_t interpret(INSTRUCT_STRUCT *operation){
-	uint16_t ret_val = 1;
-	term_Set_Cursor_Pos(20, 3);
-	serialWrite('O');
-	serialWrite('P');
-	serialWrite(' ');
-	term_Send_Val_as_Digits(operation->OPCODE);
+// ICP1 (PB0) edges, ie. an ESC tach line or a PWM fed back in. Edges are
+// stamped on the Timer0 timebase so Timer1 keeps whatever mode, TOP and
+// prescale the PWM side needs: ICR1 only gives the age of the edge, Timer1
+// counts back to it, across one TOP wrap at most. ICES1 flips every capture,
+// both edges are seen. The ISR only fills cap_ring, cap_fold() folds it into
+// cap_acc[] from the shell, nothing is kept per edge. A full ring drops
+// edges until it was drained, the period chain restarts after (cap_lost).
+// An ISR held off for more than a Timer1 period reads the age a wrap short
+#define CAP_RING_LEN	16			// Power of 2
+#define CAP_EWMA		4			// Running averages weigh the new value 1/16
+#define CAP_TICK_MAX	0x0FFFFFFFUL	// Fits << CAP_EWMA, 134s
+#define CAP_PER			0			// Rising to rising
+#define CAP_HI			1			// Rising to falling
+#define CAP_CT			2
+#define CAP_DRAW_MS		250			// Panel refresh, only when something changed
+
+// Panel, right half under the STATS table
+#define CAP_ROW			18
+#define CAP_COL			42
+#define CAP_ROWS		5
+
+volatile uint8_t cap_on = 0;			// Pulses per revolution, 0 off
+volatile CAP_EDGE cap_ring[CAP_RING_LEN];
+volatile uint8_t cap_head = 0;			// ISR writes
+volatile uint8_t cap_tail = 0;			// cap_fold() reads
+volatile uint8_t cap_overrun = 0;		// Ring was full, nothing is pushed until it's seen
+CAP_ACC cap_acc[CAP_CT];
+uint16_t cap_lost = 0;
+uint32_t cap_rise = 0;					// Last rising edge
+uint8_t cap_chain = 0;					// cap_rise is valid
+uint32_t cap_drawn_ct = 0xFFFFFFFFUL;	// cap_acc[CAP_PER].ct on the panel
+uint32_t cap_drawn_at = 0;
+
+ISR(TIMER1_CAPT_vect){
+	uint16_t icr_ = ICR1;
+	uint16_t cnt_ = TCNT1;
+	uint32_t now_ = timebase_now();
+	uint8_t rise_ = (TCCR1B >> ICES1) & 1;
+	TCCR1B ^= (1 << ICES1);				// Other edge next, a changed edge select can flag by itself
+	TIFR1 = (1 << ICF1);
 	
-	switch(operation->OPCODE){
-		case 0:					// Output Set on PB2
-			if(operation->DATA)	DDRB |= (1 << PINB2);
-			else DDRB &= ~(1 << PINB2);
-			TOGGLE_INDIC_STROBE
-		break;
-		
-		case 1:					// Set Frequency, value passed as data == COMPA (x1 pre)
-		case 129:				// SHIFT value of set freq (x8 pre)
-			if(operation->OPCODE == 129){
-				// Pre of 8
-				//TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));	// Clear prescalar
-				CLEAR_T1_PRE
-				//TCCR1B |= (1 << CS11);									// Set prescale 8
-				SET_T1_PRE_8
-			} else {
-				// Pre of 1
-				//TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));	// Clear prescalar
-				//TCCR1B |= (1 << CS10);									// Set prescale 1
-				CLEAR_T1_PRE
-				SET_T1_PRE_1
-			}
-			OCR1A = operation->DATA;									// Set TOP
-			TOGGLE_INDIC_STROBE
-		break;
-		
-		case 3:					// Duty Set
-			ret_val = (uint16_t)(((float)operation->DATA / 65535.0f) * (float)OCR1A);
-			OCR1B = ret_val;
-			ret_val = 1;
-		break;
-		
-		case 4:	// Hi Time
-			if(TCCR1B & (1 << CS10)){			// If prescale 1
-				OCR1B = operation->DATA;	
-			} else {
-				OCR1B = operation->DATA >> 3;	
-			}
-			TOGGLE_INDIC_STROBE
-		break;
-		
-		case 5:	// Delay
-			for(uint16_t a = 0; a < operation->DATA; a++){
-				T2_1MS_SETUP_ENC
-				while(WAIT_FLAG_T2);
-			}
-		break;
-		case 6:	// Type Set
-			if(operation->DATA){		// > 0x00 is valid type, 0x00 is error on set
-				switch(operation->DATA){
-					case 1:				// ESC, 400Hz, 1500us Center
-						CLEAR_T1_PRE
-						SET_T1_PRE_1
-						// SHould be 39999, tuned value below
-						OCR1A = 39978;	// 400 Hz TOP
-						// Should be 23999, tuned value below
-						OCR1B = 23986;  // 1500us COMP value pulse
-					break;
-					case 2:				// Servo, 50Hz, 1500us Center
-						CLEAR_T1_PRE
-						SET_T1_PRE_8
-						OCR1A = 39999;	// 50 Hz TOP (x8 pre)
-						OCR1B = 2999;	// 1500us COMP value pulse
-					break;
-				}
-			}
-		break;
-		case 7:	// Zepto
-			zepto_editor(NULL, 0);
-		break;
-		
-		case 36:
-			// Math: Subtract
-			if(TCCR1B & (1 << CS10)){				// If prescale 1
-				OCR1B -= (operation->DATA << 4);	// * 16 for 16 cts / us @ 1x pre
-			} else {
-				OCR1B -= (operation->DATA << 1);	// *2 as 2 counts per ms
-			}
-		break;
-		
-		case 37:
-		// Math: Add
-		if(TCCR1B & (1 << CS10)){				// If prescale 1
-			OCR1B += (operation->DATA << 4);	// * 16 for 16 cts / us @ 1x pre
-		} else {
-			OCR1B += (operation->DATA << 1);	// *2 as 2 counts per ms
-		}
-		break;
-		
-		default:
-			ret_val = 4;		// Syntax error or unrecognized instruction
-		break;	
+	uint32_t age_ = (cnt_ >= icr_) ? (uint32_t)(cnt_ - icr_) : (uint32_t)cnt_ + OCR1A + 1 - icr_;	// OCR1A is TOP in mode 15 and 4
+	age_ = (age_ << pgm_read_byte(&t1_pre_shift[T1_CS])) >> 3;		// Counts -> 8 cycle ticks, a stopped timer reads 0
 	
+	uint8_t next_ = (cap_head + 1) & (CAP_RING_LEN - 1);
+	if(cap_overrun || next_ == cap_tail){
+		cap_overrun = 1;
+		return;
+	}
+	cap_ring[cap_head].at = now_ - age_;
+	cap_ring[cap_head].rise = rise_;
+	cap_head = next_;
+}
+
+// CAPTURE n starts with n pulses per revolution and fresh statistics, 0 stops
+uint8_t cap_start(uint8_t pulses){
+	uint8_t sreg_ = SREG;
+	cli();
+	TIMSK1 &= ~(1 << ICIE1);
+	cap_on = pulses;
+	if(mc_active){						// Channel 2 gives PB0 up or gets it back
+		DDRB &= ~(1 << PB0);
+		PORTB &= ~(1 << PB0);
+		mc_masks();
+		mc_drive(mc_frame[mc_live].out);
+	}
+	if(pulses){
+		DDRB &= ~(1 << PB0);			// No pull up, tach outputs drive both ways
+		PORTB &= ~(1 << PB0);
+		cap_head = 0;
+		cap_tail = 0;
+		cap_overrun = 0;
+		cap_lost = 0;
+		cap_chain = 0;
+		for(uint8_t n = 0; n < CAP_CT; n++){
+			cap_acc[n].ct = 0;
+			cap_acc[n].last = 0;
+			cap_acc[n].avg = 0;
+			cap_acc[n].jit = 0;
+			cap_acc[n].min = 0;
+			cap_acc[n].max = 0;
+		}
+		TCCR1B = (TCCR1B & ~T1_ICP_MASK) | (1 << ICNC1) | (1 << ICES1);	// Noise canceler, rising first
+		TIFR1 = (1 << ICF1);
+		TIMSK1 |= (1 << ICIE1);
+	} else {
+		TCCR1B &= ~T1_ICP_MASK;
 	}
+	SREG = sreg_;
 	
+	cap_drawn_ct = 0xFFFFFFFFUL;
+	if(!ui_quiet) cap_print();
+	return 1;
+}
+
+void cap_add(uint8_t which, uint32_t ticks){
+	CAP_ACC *acc_ = &cap_acc[which];
+	if(ticks > CAP_TICK_MAX) ticks = CAP_TICK_MAX;
+	uint32_t x_ = ticks << CAP_EWMA;
 	
-	return (uint8_t)ret_val;
+	acc_->last = ticks;
+	if(!acc_->ct){
+		acc_->avg = x_;
+		acc_->min = ticks;
+		acc_->max = ticks;
+	} else {
+		uint32_t dev_ = (x_ > acc_->avg) ? x_ - acc_->avg : acc_->avg - x_;
+		if(x_ > acc_->avg){
+			acc_->avg += (dev_ + (1 << (CAP_EWMA - 1))) >> CAP_EWMA;
+		} else {
+			acc_->avg -= (dev_ + (1 << (CAP_EWMA - 1))) >> CAP_EWMA;
+		}
+		acc_->jit = acc_->jit - (acc_->jit >> CAP_EWMA) + (dev_ >> CAP_EWMA);
+		if(ticks < acc_->min) acc_->min = ticks;
+		if(ticks > acc_->max) acc_->max = ticks;
+	}
+	if(acc_->ct != 0xFFFFFFFFUL) acc_->ct += 1;
 }
 
+void cap_fold(){
+	while(cap_tail != cap_head){
+		uint32_t at_ = cap_ring[cap_tail].at;
+		uint8_t rise_ = cap_ring[cap_tail].rise;
+		cap_tail = (cap_tail + 1) & (CAP_RING_LEN - 1);
+		
+		if(rise_){
+			if(cap_chain) cap_add(CAP_PER, at_ - cap_rise);
+			cap_rise = at_;
+			cap_chain = 1;
+		} else
+		if(cap_chain){
+			cap_add(CAP_HI, at_ - cap_rise);
+		}
+	}
+	if(cap_overrun){					// Ring is empty, nothing can overrun again before this clears
+		cap_chain = 0;
+		cap_lost += 1;
+		cap_overrun = 0;
+	}
+}
 
-// Case 200
-void goto_help(){
-	// lol no help yet
+void cap_print(){
+	static const char names_[CAP_ROWS][5] PROGMEM = {"CAP", "PER", "HI", "JIT", "MIN"};
+	CAP_ACC *per_ = &cap_acc[CAP_PER];
+	CAP_ACC *hi_ = &cap_acc[CAP_HI];
+	
+	for(uint8_t n = 0; n < CAP_ROWS; n++){
+		term_Set_Cursor_Pos(CAP_ROW + n, CAP_COL);
+		if(!cap_on){					// Blanked up to the border
+			while(term_col && term_col < TERM_W) serialWrite(' ');
+			continue;
+		}
+		serialWriteStr_P(names_[n]);
+		while(term_col && term_col < CAP_COL + 5) serialWrite(' ');
+		switch(n){
+			case 0:						// Periods counted, ring overruns
+				term_Send_32_as_Digits(per_->ct, 0);
+				serialWriteStr_P(PSTR(" lost "));
+				term_Send_32_as_Digits(cap_lost, 0);
+			break;
+			case 1:						// Average period, frequency in 0.01 Hz
+				stat_send_us(per_->avg >> CAP_EWMA, CAP_COL + 17);
+				if(per_->avg) term_Send_32_as_Digits(fx_div_round(3200000000UL, per_->avg), FX_FRAC);
+				serialWriteStr_P(PSTR("Hz"));
+			break;
+			case 2:{					// Average hi time, duty in 0.01 %
+				uint32_t h_ = hi_->avg;
+				uint32_t p_ = per_->avg;
+				stat_send_us(h_ >> CAP_EWMA, CAP_COL + 17);
+				while(h_ > 0xFFFFFFFFUL / 10000UL){
+					h_ >>= 1;
+					p_ >>= 1;
+				}
+				if(p_) term_Send_32_as_Digits(fx_div_round(h_ * 10000UL, p_), FX_FRAC);
+				serialWrite('%');
+			}
+			break;
+			case 3:						// Period jitter, revolutions per minute
+				term_Send_32_as_Digits((per_->jit >> CAP_EWMA) * 5 + (((per_->jit & ((1 << CAP_EWMA) - 1)) * 5) >> CAP_EWMA), 1);
+				while(term_col && term_col < CAP_COL + 17) serialWrite(' ');
+				if(per_->avg) term_Send_32_as_Digits(fx_div_round(1920000000UL / cap_on, per_->avg), 0);
+				serialWriteStr_P(PSTR("rpm"));
+			break;
+			case 4:						// Shortest and longest period
+				stat_send_us(per_->min, CAP_COL + 17);
+				serialWriteStr_P(PSTR("MAX "));
+				stat_send_us(per_->max, 0);
+			break;
+		}
+		while(term_col && term_col < TERM_W) serialWrite(' ');
+	}
 }
 
-// Case 255
-void goto_credits(){
-	// Me
+// Shell idle hook, 1 if the panel was redrawn and the cursor moved
+uint8_t cap_refresh(){
+	if(!cap_on) return 0;
+	cap_fold();
+	if(cap_acc[CAP_PER].ct == cap_drawn_ct || timebase_now() - cap_drawn_at < CAP_DRAW_MS * TB_TICKS_PER_MS) return 0;
+	cap_drawn_ct = cap_acc[CAP_PER].ct;
+	cap_drawn_at = timebase_now();
+	cap_print();
+	return 1;
 }
 
   //////////////////////////////////////////////////////////////////////////
- //							ZEPTO EDITOR								 //
+ //							LIVE STATUS									 //
 //////////////////////////////////////////////////////////////////////////
 
-#define ZEPTO_W		35
-#define ZEPTO_H		2
+// What Timer1 puts out right now, read back from OCR1A, OCR1B and the clock
+// select, left half of the shell screen above the debug echo. Fast PWM
+// (mode 15) and the multi channel frame (CTC, mode 4) both count TOP + 1
+// per period, OC1B is high for OCR1B + 1 of them, all in counts until the
+// fixed point (FX_) conversion so nothing is rounded twice
+#define LIVE_DRAW_MS	100			// Panel refresh, only when a register changed
+#define LIVE_ROW		10
+#define LIVE_COL		3
+#define LIVE_ROWS		4
+#define LIVE_VAL_COL	(LIVE_COL + 5)
+
+LOG_STATE live_drawn = {0, 0, 0, 0xFF, 0};	// Registers on the panel, at = when it was drawn, mode 0xFF nothing yet
+uint8_t live_end[LIVE_ROWS];				// Column after each row's text, the old tail is blanked up to it
+
+void live_snap(LOG_STATE *now){
+	uint8_t sreg_ = SREG;
+	cli();
+	now->top = OCR1A;
+	now->cmp = (mc_active) ? 0 : OCR1B;		// Multi channel moves OCR1B every edge, the frame is what counts
+	now->mode = LOG_MODE(T1_CS, pwm_out_live(), mc_active);
+	SREG = sreg_;
+}
 
+void live_print(uint8_t full){			// full: names too, the screen was blank
+	static const char names_[LIVE_ROWS][5] PROGMEM = {"OUT", "FREQ", "PER", "HI"};
+	LOG_STATE now_;
+	live_snap(&now_);
+	
+	uint8_t cs_ = now_.mode & T1_CS_MASK;
+	uint8_t multi_ = now_.mode >> 4;
+	uint8_t shift_ = pgm_read_byte(&t1_pre_shift[cs_]);
+	uint32_t top_ = (uint32_t)now_.top + 1;
+	uint32_t hi_ = (now_.cmp < now_.top) ? (uint32_t)now_.cmp + 1 : top_;	// At or past TOP it never clears
+	
+	for(uint8_t n = 0; n < LIVE_ROWS; n++){
+		if(full){
+			term_Set_Cursor_Pos(LIVE_ROW + n, LIVE_COL);
+			serialWriteStr_P(names_[n]);
+			live_end[n] = 0;
+		}
+		term_Set_Cursor_Pos(LIVE_ROW + n, LIVE_VAL_COL);
+		if(n && (!cs_ || (n == 3 && multi_))){		// Nothing counts, or every channel has its own
+			serialWrite('-');
+		} else {
+			switch(n){
+				case 0:						// Output, prescale
+					if(!cs_){
+						serialWriteStr_P(PSTR("stopped"));
+						break;
+					}
+					if(multi_){
+						serialWriteStr_P(PSTR("multi"));
+					} else if(now_.mode & 0x08){
+						serialWriteStr_P(PSTR("on"));
+					} else {
+						serialWriteStr_P(PSTR("off"));
+					}
+					serialWriteStr_P(PSTR(" /"));
+					term_Send_32_as_Digits(1UL << shift_, 0);
+				break;
+				case 1:						// 0.01 Hz
+					term_Send_32_as_Digits(fx_counts_to_freq(top_, shift_), FX_FRAC);
+					serialWriteStr_P(PSTR("Hz"));
+				break;
+				case 2:						// 0.01 us
+					term_Send_32_as_Digits(fx_counts_to_time(top_, shift_), FX_FRAC);
+					serialWriteStr_P(PSTR("us"));
+				break;
+				case 3:						// 0.01 us, duty in 0.01 %
+					term_Send_32_as_Digits(fx_counts_to_time(hi_, shift_), FX_FRAC);
+					serialWriteStr_P(PSTR("us "));
+					term_Send_32_as_Digits(fx_div_round(hi_ * 10000UL, top_), FX_FRAC);
+					serialWrite('%');
+				break;
+			}
+		}
+		uint8_t end_ = term_col;
+		while(term_col && term_col < live_end[n]) serialWrite(' ');
+		live_end[n] = end_;
+	}
+	now_.at = timebase_now();
+	live_drawn = now_;
+}
 
+uint8_t live_refresh(){
+	LOG_STATE now_;
+	live_snap(&now_);
+	if(now_.top == live_drawn.top && now_.cmp == live_drawn.cmp && now_.mode == live_drawn.mode) return 0;
+	if(timebase_now() - live_drawn.at < LIVE_DRAW_MS * TB_TICKS_PER_MS) return 0;
+	live_print(0);
+	return 1;
+}
 
-char zepto_array[Z_LINE_LEN][Z_LINE_CT] = {0x00};
+  //////////////////////////////////////////////////////////////////////////
+ //							EVENT LOG									 //
+//////////////////////////////////////////////////////////////////////////
 
-void zepto_editor(COMPILED_INSTR* work_space, uint8_t len){
-	zepto_frame_cleanup();
-	zepto_frame_print();
-	uint16_t read_val;
-	uint8_t sm_rval;
-	uint8_t ins_mode = 1;		// If 1 normal cursor, otherwise overwrite anything
-	// Modes:
-	//	0 - Exit
-	//	1 - Input Collection
-	//	2 - Save Data
-	//	3 - Help Menu
-	//	4 - EEPROM Read
-	//	5 - EEPROM Save
-	//	6 - RES
-	//	7 - RES
-	//	8 - EXT Read	(external storage 0) (SD, FLASH, EEPROM, etc..)
-	//	9 - EXT Save	(external storage 0) (SD, FLASH, EEPROM, etc..)
-	//	....
-	//	16  - Compile program to output buffer
-	//	17	- Interpret program in place
-	//	....
-	//	100 - Print Text Buffer to Screen
-	//  101 - Update Cursor
-	//	....
-	//	105 - Update Cursor Mode Text (INS vs. OVR)
-	//  ....
-	//	127	- Clear buffer
-	uint8_t zepto_mode = 100;
+// Every change that goes live (pwm_done(), a multi channel frame swap) is
+// appended to log_ring by whoever made it live, one entry:
+//	flags	LOG_F_ bits, which fields follow
+//	op		pwm_src when the change was committed, interpret() opcode, 10 a ramp step, 7 Zepto
+//	dt		ticks since the entry before, 7 bits a byte low first, bit 7 set if more follow
+//	top		OCR1A, 2 bytes low first, only if it changed
+//	cmp		OCR1B, multi channel the first falling edge, 2 bytes, only if it changed
+//	mode	LOG_MODE(), only if it changed
+// log_base is the state before the oldest entry. A full ring folds its
+// oldest entries into it (log_lost), LOG prints and folds every entry so
+// the next LOG carries on where this one stopped
+#define LOG_LEN			128			// Power of 2
+#define LOG_ENTRY_MAX	12			// flags, op, 5 byte dt, top, cmp, mode
+#define LOG_F_TOP		0x01
+#define LOG_F_CMP		0x02
+#define LOG_F_MODE		0x04
+
+volatile uint8_t log_ring[LOG_LEN];
+volatile uint8_t log_head = 0;
+volatile uint8_t log_tail = 0;
+volatile uint8_t log_ct = 0;			// Entries held
+volatile uint16_t log_lost = 0;			// Folded without being printed
+LOG_STATE log_base;
+LOG_STATE log_last;						// State after the newest entry
+
+void log_put(uint8_t data){
+	log_ring[log_head] = data;
+	log_head = (log_head + 1) & (LOG_LEN - 1);
+}
+
+uint8_t log_get(){
+	uint8_t data_ = log_ring[log_tail];
+	log_tail = (log_tail + 1) & (LOG_LEN - 1);
+	return data_;
+}
+
+void log_live(uint16_t top, uint16_t cmp, uint8_t mode, uint8_t op){	// ISR or interrupts off
+	uint32_t now_ = timebase_now();
+	uint32_t dt_ = now_ - log_last.at;
+	uint8_t f_ = 0;
 	
-	// Line length of 20
-	// Max lines 20
-	// zepto array
-	char zep_line_arr[Z_LINE_LEN] = {0x00};
+	while(((log_head - log_tail) & (LOG_LEN - 1)) + LOG_ENTRY_MAX >= LOG_LEN){
+		log_pop();
+		log_lost += 1;
+	}
 	
-	uint8_t cursor_x = 0;
-	uint8_t cursor_y = 0;
+	if(top != log_last.top) f_ |= LOG_F_TOP;
+	if(cmp != log_last.cmp) f_ |= LOG_F_CMP;
+	if(mode != log_last.mode) f_ |= LOG_F_MODE;
+	log_put(f_);
+	log_put(op);
+	for(; dt_ > 0x7F; dt_ >>= 7){
+		log_put((dt_ & 0x7F) | 0x80);
+	}
+	log_put(dt_);
+	if(f_ & LOG_F_TOP){
+		log_put(top);
+		log_put(top >> 8);
+	}
+	if(f_ & LOG_F_CMP){
+		log_put(cmp);
+		log_put(cmp >> 8);
+	}
+	if(f_ & LOG_F_MODE) log_put(mode);
 	
-	while(zepto_mode){
-		/*
-		term_Set_Cursor_Pos(3,3);
-		serialWrite('X');
+	log_last.at = now_;
+	log_last.top = top;
+	log_last.cmp = cmp;
+	log_last.mode = mode;
+	log_last.op = op;
+	log_ct += 1;
+}
+
+uint8_t log_pop(){						// Interrupts off, oldest entry into log_base. 0 if empty
+	if(!log_ct) return 0;
+	uint8_t f_ = log_get();
+	uint32_t dt_ = 0;
+	uint8_t b_;
+	
+	log_base.op = log_get();
+	for(uint8_t sh_ = 0;; sh_ += 7){
+		b_ = log_get();
+		dt_ |= (uint32_t)(b_ & 0x7F) << sh_;
+		if(!(b_ & 0x80)) break;
+	}
+	log_base.at += dt_;
+	if(f_ & LOG_F_TOP){
+		log_base.top = log_get();
+		log_base.top |= (uint16_t)log_get() << 8;
+	}
+	if(f_ & LOG_F_CMP){
+		log_base.cmp = log_get();
+		log_base.cmp |= (uint16_t)log_get() << 8;
+	}
+	if(f_ & LOG_F_MODE) log_base.mode = log_get();
+	log_ct -= 1;
+	return 1;
+}
+
+void log_send_state(char lead, LOG_STATE *st){
+	serialWrite(lead);
+	term_Send_32_as_Digits(st->at, 0);
+	serialWrite(' ');
+	term_Send_32_as_Digits(st->top, 0);
+	serialWrite(' ');
+	term_Send_32_as_Digits(st->cmp, 0);
+	serialWrite(' ');
+	term_Send_Val_Unpadded(st->mode);
+	serialWriteStr_P(PSTR("\r\n"));
+}
+
+// LOG, full screen dump of everything logged since the last one:
+//	= at top cmp mode		absolute state, at the start and again after lost entries
+//	+dt op [Ttop] [Ccmp] [Mmode]
+// dt and at are 0.5us ticks, at wraps with timebase_now()
+uint8_t log_print(){
+	LOG_STATE prev_, now_;
+	uint8_t ct_ = log_ct;				// Entries logged meanwhile wait for the next LOG
+	uint8_t got_;
+	uint16_t lost_;
+	uint8_t sreg_ = SREG;
+	
+	term_Set_Scroll_All();
+	term_Clear_ALL();
+	term_Set_Cursor_Pos(1, 1);
+	serialWriteStr_P(PSTR("LOG "));
+	term_Send_Val_Unpadded(ct_);
+	serialWriteStr_P(PSTR(" lost "));
+	term_Send_32_as_Digits(log_lost, 0);
+	serialWriteStr_P(PSTR("\r\n"));
+	
+	cli();
+	log_lost = 0;
+	prev_ = log_base;
+	SREG = sreg_;
+	log_send_state('=', &prev_);
+	
+	for(; ct_; ct_--){
+		cli();
+		lost_ = log_lost;
+		log_lost = 0;
+		if(lost_) prev_ = log_base;		// Folded under us, the chain starts over
+		got_ = log_pop();
+		now_ = log_base;
+		SREG = sreg_;
+		if(lost_) log_send_state('=', &prev_);
+		if(!got_) break;
+		
+		serialWrite('+');
+		term_Send_32_as_Digits(now_.at - prev_.at, 0);
 		serialWrite(' ');
-		term_Send_Val_as_Digits(cursor_x);
-		term_Set_Cursor_Pos(5,3);
-		serialWrite('Y');
+		term_Send_Val_Unpadded(now_.op);
+		if(now_.top != prev_.top){
+			serialWriteStr_P(PSTR(" T"));
+			term_Send_32_as_Digits(now_.top, 0);
+		}
+		if(now_.cmp != prev_.cmp){
+			serialWriteStr_P(PSTR(" C"));
+			term_Send_32_as_Digits(now_.cmp, 0);
+		}
+		if(now_.mode != prev_.mode){
+			serialWriteStr_P(PSTR(" M"));
+			term_Send_Val_Unpadded(now_.mode);
+		}
+		serialWriteStr_P(PSTR("\r\n"));
+		prev_ = now_;
+	}
+	
+	serialWriteStr_P(PSTR("END, any key\r\n"));
+	serialGet();
+	return 3;							// Shell needs a full redraw
+}
+
+// Case 0
+uint8_t main_menu(){
+	static const char menu_message[] PROGMEM = "Welcome to ESC and Servo Driver v2!\0";
+	static const char shell_loading_msg[] PROGMEM = "Loading into Shell\0";
+	static const char menu_loading_msg[] PROGMEM = "Press Any Key to Stop\0";
+	fastBorder(1);
+	
+	term_Set_Cursor_Pos(TERM_H / 2 - 1, TERM_W / 2 - sizeof(menu_message) / 2);
+	serialWriteStr_P(menu_message);
+	term_Set_Cursor_Pos(TERM_H / 2 + 1, TERM_W / 2 - sizeof(shell_loading_msg) / 2);
+	serialWriteStr_P(shell_loading_msg);
+	term_Set_Cursor_Pos(TERM_H / 2 + 3, TERM_W / 2 - sizeof(menu_loading_msg) / 2);
+	serialWriteStr_P(menu_loading_msg);
+
+#define BAR_W			71
+#define WAIT_SECONDS	5
+
+	printBarFrame(20, 3, BAR_W);
+	updateBarValue(20, 3, BAR_W, 2, 0);
+	
+	// We have a canned 10ms timer
+	// for 5 second loading time:	5 / 0.010 = 500
+	// for 1 seconds: 1 / 0.010 = 100
+	
+	uint8_t to_go__ = 1;						// Where to go after the menu
+	
+	for(uint8_t s = 0; s < WAIT_SECONDS; s++){
+		for(uint8_t n = 0; n < 98; n++){
+			T2_10MS_SETUP
+			while(WAIT_FLAG_T2) SIM_IDLE();				// Wait for timer to clear
+		}
+		for(uint8_t m = s; m < ((s + 1) * ((BAR_W - 1) / WAIT_SECONDS)); m++){
+			updateBarValue(20, 3, BAR_W, 0, m);
+			T2_10MS_SETUP
+			while(WAIT_FLAG_T2) SIM_IDLE();
+			T2_10MS_SETUP
+			while(WAIT_FLAG_T2) SIM_IDLE();
+			
+		}
+	}
+#undef BAR_W
+#undef WAIT_SECONDS
+
+	//while(1);				// Hold in menu for debug
+	return to_go__;
+}
+
+// Case 1
+#define MAX_ENTRY_LEN		32
+#define SH_BATCH_MAX		8			// Commands per line, "o 1;" is the shortest
+#define MAX_LINES			5
+char line_entry[MAX_ENTRY_LEN][MAX_LINES] = {0x00};
+uint8_t bottom_line = MAX_LINES - 1;
+
+// Shell Modes:
+//					0: EXIT
+//					1: Print terminal history
+//					2: Accept Inputs (resting state)
+//					3: Full redraw (back from a full screen app)
+//					4: Syntax Error on Entry
+//					5: Aborted by user (CTRL+X)
+
+// Screen layout, history scrolls inside its own scroll region
+#define SH_HIST_TOP		2
+#define SH_HIST_BOT		(MAX_LINES + 1)
+#define SH_PROMPT_ROW	(MAX_LINES + 3)
+#define SH_TEXT_COL		3
+
+// Scroll the history region up one line and print str on the freed bottom line
+void shell_scroll_history(const char *str){
+	term_Set_Cursor_Pos(SH_HIST_BOT, TERM_W);
+	serialWrite(NEWLINE);					// LF on the bottom margin scrolls the region
+	serialWrite(GFX_CHAR);					// New line is blank, border included
+	serialWrite(ENTER_KEY);
+	serialWrite(GFX_CHAR);
+	serialWrite(' ');
+	for(uint8_t c = 0; c < MAX_ENTRY_LEN && str[c]; c++){
+		serialWrite(str[c]);
+	}
+}
+
+// Reprint the input line from col, blanking up to old_len, cursor ends at wr_ptr
+void shell_redraw_input(const char *buf, uint8_t from, uint8_t old_len, uint8_t wr_ptr){
+	uint8_t c;
+	for(c = from; c < MAX_ENTRY_LEN && buf[c]; c++){
+		serialWrite(buf[c]);
+	}
+	for(; c < old_len; c++){
 		serialWrite(' ');
-		term_Send_Val_as_Digits(cursor_y);
-		*/
-		switch(zepto_mode){
-			////////////////////////////////////////////////////////////////////////////
-			case 1:		// General Purpose Input
-				read_val = serial_rx_ESC_seq();
-				term_Set_Cursor_Pos(21, 3);
-				term_Send_16_as_Digits(read_val);
+	}
+	term_Move_Cursor(c - wr_ptr, MOVE_LEFT);
+}
+
+void goto_shell(){
+	char tmp_buf[MAX_ENTRY_LEN + 1] = {0x00};
+	uint8_t wr_ptr = 0;
+	uint8_t len_ = 0;						// Chars in tmp_buf
+	uint8_t shell_mode = 1;
+	uint8_t line_to_print;
+	
+	static const char sh__nm[] PROGMEM = "SHELL\0";
+	
+	while(shell_mode){
+		if(shell_mode == 4 || shell_mode == 5) shell_mode = 2;	// The E debug field has the error
+		if(shell_mode == 3){
+			fastBorder(1);
+			shell_mode = 1;
+		}
+		if(shell_mode == 1){									// Full paint, screen is blank here
+			term_Set_Scroll_Mode_Limit(SH_HIST_TOP, SH_HIST_BOT);
+			
+			line_to_print = bottom_line;
+			for(uint8_t n = 0; n < MAX_LINES; n++){				// Print terminal output buffer
+				term_Set_Cursor_Pos(SH_HIST_BOT - n, SH_TEXT_COL);
+				for(uint8_t c = 0; c < MAX_ENTRY_LEN && line_entry[c][line_to_print]; c++){
+					serialWrite(line_entry[c][line_to_print]);
+				}
 				
-				if(read_val & 0xFF){				// Normal Entry
-					sm_rval = (uint8_t)read_val;
-					
-					if(sm_rval >= 'A' && sm_rval <= 'Z'){
-						sm_rval -= 'A' - 'a';
+				line_to_print -= 1;
+				if(line_to_print > MAX_LINES - 1){
+					line_to_print = MAX_LINES - 1;
+				}
+			}
+			
+			term_Set_Cursor_Pos(SH_PROMPT_ROW, TERM_W - sizeof(sh__nm));
+			serialWriteStr_P(sh__nm);
+			live_print(1);
+			term_Set_Cursor_Pos(SH_PROMPT_ROW, SH_TEXT_COL - 1);
+			serialWrite('>');
+			shell_redraw_input(tmp_buf, 0, 0, wr_ptr);
+			shell_mode = 2;	
+		}
+		
+		// Everything after this only echoes what changed, the cursor is
+		// always left at the write position on the prompt line
+		uint16_t read_val;
+		while(!(read_val = serial_rx_ESC_poll())){			// Live capture and status panels while nothing is typed
+			uint8_t moved_ = cap_refresh();
+			moved_ |= live_refresh();
+			if(moved_) term_Set_Cursor_Pos(SH_PROMPT_ROW, SH_TEXT_COL + wr_ptr);
+			SIM_IDLE();
+		}
+		if(read_val == ENTER_KEY){							// Enter Key Press Event
+			uint32_t enter_at = rx_stamp_get();
+			if(tmp_buf[0]){
+				bottom_line += 1;
+				if(bottom_line > MAX_LINES - 1){
+					bottom_line = 0;
+				}
+				for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
+					line_entry[n][bottom_line] = tmp_buf[n];	// Copies the 0x00 tail too, resets old contents
+				}
+				shell_scroll_history(tmp_buf);
+				
+				stat_applied = 0;
+				shell_mode = shell_run_line(tmp_buf);
+				if(stat_applied) stat_add(STAT_E2E, stat_apply_at - enter_at);
+				if(shell_mode != 3) parse_err_echo();	// A full screen app repaints anyway
+				if(shell_mode == 1) shell_mode = 2;		// History already scrolled, only the input line is stale
+				
+				for(uint8_t n = 0; n < MAX_ENTRY_LEN + 1; n++){
+					tmp_buf[n] = 0x00;
+				}
+				
+				term_Set_Cursor_Pos(SH_PROMPT_ROW, SH_TEXT_COL);
+				shell_redraw_input(tmp_buf, 0, len_, 0);
+				wr_ptr = 0;
+				len_ = 0;
+			}
+		} else
+		if(!(read_val & 0xFF)){								// Arrow Key Press Event
+			switch(read_val >> 8){
+				case MOVE_LEFT:
+					if(wr_ptr){
+						wr_ptr -= 1;
+						serialWrite(BACKSPACE);
 					}
-					if((sm_rval >= 'a' && sm_rval <= 'z')
-							|| (sm_rval == ' ')
-							|| (sm_rval == '.')
-							|| (sm_rval >= '0' && sm_rval <= '9')){	// Standard Text
-						if(cursor_x < Z_LINE_LEN - 1){
-							if(ins_mode){
-								for(uint8_t n = Z_LINE_LEN; n != cursor_x; n--){
-									zepto_array[n - 1][cursor_y] = zepto_array[n - 2][cursor_y];
-								}
-							}
-							
-							zepto_array[cursor_x][cursor_y] = sm_rval;	
-							
-							
-							cursor_x += 1;	
-							zepto_mode = 100;	// Print new array
-						}
-					} else
-					if(sm_rval == ENTER_KEY){				// Enter Key Pressed
-						if(cursor_y < Z_LINE_CT - 1){
-							cursor_y += 1;
-							cursor_x = 0;
-							zepto_mode = 100;	// Print new array
-						}
-					} else
-					if(sm_rval == BACKSPACE){
-						if(cursor_x > 0){
-							for(uint8_t n = cursor_x - 1; n < Z_LINE_LEN - 1; n++){
-								zepto_array[n][cursor_y] = zepto_array[n + 1][cursor_y];
-							}
-							cursor_x -= 1;
-							zepto_mode = 100;
-						} else {
-							zepto_mode = 101;			// Redraw cursor
-						}
-					} else
-					if(sm_rval == DELETE){
-						for(uint8_t n = cursor_x; n < Z_LINE_LEN - 1; n++){
-							zepto_array[n][cursor_y] = zepto_array[n + 1][cursor_y];
+				break;
+				case MOVE_RIGHT:
+					if(tmp_buf[wr_ptr] && wr_ptr < MAX_ENTRY_LEN){
+						serialWrite(tmp_buf[wr_ptr]);		// Re-echo moves the cursor right
+						wr_ptr += 1;
+					}
+				break;
+				case MOVE_UP:								// Recall last entry
+					line_to_print = 0;
+					for(uint8_t n = 0; n < MAX_ENTRY_LEN; n++){
+						tmp_buf[n] = line_entry[n][bottom_line];
+						if(tmp_buf[n]){
+							line_to_print += 1;
 						}
-						zepto_mode = 100;
-					} else
-					if(sm_rval == '~'){
-						ins_mode = (ins_mode) ? 0 : 1;
-						zepto_mode = 105;
-					} else
-					if(sm_rval == CTRL_R){
-						// Run in place
-						zepto_mode = 17;
-					} else
-					if(sm_rval == CTRL_N){
-						// Clear buffer
-						zepto_mode = 127;
-					} else
-					if(sm_rval == CTRL_A){
-						// Help Menu
-						zepto_mode = 3;
-					} else
-					if(sm_rval == CTRL_X){
-						// Quit
-						zepto_mode = 0;
 					}
-				} else {							// Arrow Key Entry
-					sm_rval = (uint8_t)(read_val >> 8);
-					switch(sm_rval){
-						case MOVE_UP:
-							if(cursor_y > 0){
-								cursor_y -= 1;
-								cursor_x = last_char(zepto_array, cursor_y);
-							}
-						break;
-						case MOVE_DOWN:
-							if(cursor_y < Z_LINE_CT - 1){
-								cursor_y += 1;
-								cursor_x = last_char(zepto_array, cursor_y);
-							}
-						break;
-						case MOVE_LEFT:
-							if(cursor_x > 0){
-								cursor_x -= 1;
-							}
-						break;
-						case MOVE_RIGHT:
-							if(cursor_x < Z_LINE_LEN - 1){
-								cursor_x += 1;
-							}
-						break;
-					}
-					zepto_mode = 100;	// Print new array
-				}
-				
-			break;
-			////////////////////////////////////////////////////////////////////////////
-			case 2:		// Save Data to work_space
-			
-				zepto_mode = 1;
-			break;
-			////////////////////////////////////////////////////////////////////////////
-			case 3:		// Help Menu (lol)
-				zepto_help_menu();
-				zepto_mode = 101;
-			break;
-			// Cases >3 not used with default config
-			
-			////////////////////////////////////////////////////////////////////////////
-			case 16:											// Compile
-			case 17:											// Interpret Program in Place
-				read_val = 0x00;
-				sm_rval = 0x01;
-				for(uint8_t n = 0; n < Z_LINE_CT; n++){
-					if(zepto_array[0][n]){
-						for(uint8_t q = 0; q < Z_LINE_LEN; q++){
-							if((zepto_array[q][n] >= 'a' && zepto_array[q][n] <= 'z')
-								|| (zepto_array[q][n] >= '0' && zepto_array[q][n] <= '9')
-								|| (zepto_array[q][n] == '.') || zepto_array[q][n] == ' ')
-								{
-									zep_line_arr[q] = zepto_array[q][n];		
-								} else {
-									break;
-								}
-							
-						}
-						
-						if(zepto_mode == 17){							// Interpret
-							if(zep_line_arr[0] == 'j' && zep_line_arr[1] == ' ' && sm_rval){					// Jump pseudo instruction
-								if(!read_val){						// If this is the first time hitting the jump, set the jump counter
-									sm_rval = (zep_line_arr[6] != ' ' && zep_line_arr[6]) ? (10 * (zep_line_arr[5] - '0') + (zep_line_arr[6] - '0')) : (zep_line_arr[5] - '0');	// # times to jump
-									
-									term_Set_Cursor_Pos(TERM_H / 2, TERM_W - 4);
-									term_Send_Val_as_Digits(sm_rval);
-									
-									
-									
-									read_val = 1;
-								}
-								if(sm_rval){
-									n = (zep_line_arr[3] != ' ' && zep_line_arr[3]) ? (10 * (zep_line_arr[2] - '0') + (zep_line_arr[3] - '0')) : (zep_line_arr[2] - '0');
-									n -= 2;		// -1 for index alignment, -1 for ++ in for loop	
-									sm_rval -= 1;
-									term_Set_Cursor_Pos(TERM_H / 2 - 1, TERM_W - 4);
-									term_Send_Val_as_Digits(n);
-								}
-								
-								//	sm_rval & read_val used as burner vars here
-							} else {
-								// Standard instruction
-								parse_entry(zep_line_arr, 1, NULL);
-							}
-						} else {										// Compile
-							
-						}
-						
-						for(uint8_t p = 0; p < Z_LINE_LEN; p++){
-							zep_line_arr[p] = 0x00;
-						}
+					wr_ptr = line_to_print;
+					for(uint8_t n = line_to_print; n != 0 && tmp_buf[n - 1] == ' '; n--){
+						wr_ptr -= 1;
 					}
-				}
-				
-				zepto_mode = 1;
-			break;
-			////////////////////////////////////////////////////////////////////////////
-			case 100:	// Print zepto_array to screen
-				for(uint8_t n = 0; n < Z_LINE_CT; n++){
-					term_Set_Cursor_Pos(n + ZEPTO_H + 1, ZEPTO_W + 5);
-					for(uint8_t m = 0; m < Z_LINE_LEN; m++){
-						if(zepto_array[m][n] > 0){
-							serialWrite(zepto_array[m][n]);	
-						} else {
-							serialWrite(' ');					// Fill 0x00 with spaces for visualization
+					
+					term_Set_Cursor_Pos(SH_PROMPT_ROW, SH_TEXT_COL);
+					shell_redraw_input(tmp_buf, 0, len_, wr_ptr);
+					len_ = line_to_print;
+				break;
+			}
+		} else {											// Text Entry Event
+			switch(read_val){
+				case BACKSPACE:
+				case DELETE:								// Most terminals send DEL for the backspace key
+					if(wr_ptr){
+						wr_ptr -= 1;
+						for(uint8_t n = wr_ptr; n < MAX_ENTRY_LEN; n++){
+							tmp_buf[n] = tmp_buf[n + 1];
 						}
+						tmp_buf[MAX_ENTRY_LEN] = '\0';
 						
+						serialWrite(BACKSPACE);
+						shell_redraw_input(tmp_buf, wr_ptr, len_, wr_ptr);
+						len_ -= 1;
 					}
-				}
+				break;
 				
-			//break;
-			
-			case 101:
-				term_Set_Cursor_Pos(cursor_y + ZEPTO_H + 1, cursor_x + ZEPTO_W + 5);
-				zepto_mode = 1;
-			break;
-			
-			case 105:	// Update cursor mode text
-				term_Set_Cursor_Pos(TERM_H - ZEPTO_H, TERM_W - 5);
-				if(ins_mode){
-					serialWrite('I');
-					serialWrite('N');
-					serialWrite('S');
-					} else {
-					serialWrite('O');
-					serialWrite('V');
-					serialWrite('R');
-				}
+				case CTRL_X:								// Nothing to abort at the prompt but a ramp
+					pwm_ramp_stop();
+				break;
 				
-				term_Set_Cursor_Pos(cursor_y + ZEPTO_H + 1, cursor_x + ZEPTO_W + 5);
-				zepto_mode = 1;
-			break;
-			////////////////////////////////////////////////////////////////////////////
-			case 127:
-				for(uint8_t n = 0; n < Z_LINE_CT; n++){
-					for(uint8_t m = 0; m < Z_LINE_LEN; m++){
-						zepto_array[m][n] = 0x00;
+				default:									// Generic Text Entry, overwrites
+					if(wr_ptr < MAX_ENTRY_LEN && read_val >= ' ' && read_val < DELETE){	
+						tmp_buf[wr_ptr] = read_val;
+						serialWrite(read_val);
+						wr_ptr += 1;
+						if(wr_ptr > len_) len_ = wr_ptr;
 					}
-				}
-				cursor_x = 0;
-				cursor_y = 0;
-				zepto_mode = 100;
-			break;
-			////////////////////////////////////////////////////////////////////////////
-			default:
-				// Error on mode set, exit program
-				zepto_mode = 0x00;
-			break;	
+				break;
+			}
+		}
+	}
+	
+	term_Set_Scroll_All();
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							LEXER										 //
+//////////////////////////////////////////////////////////////////////////
+
+// One pass over the line where it lies: words are lower cased in place,
+// numbers go through fx_parse() with their unit suffix right behind the
+// digits, command words and keywords are looked up in z_keywords[] in
+// flash. Nothing is copied, each char is visited once plus one table scan
+// per word, so the cost is bounded by the line length (MAX_ENTRY_LEN in the
+// shell, Zepto and SD RUN alike). The first error is kept with its column
+// for the E debug field, the Zepto status and the SD result
+
+// z_keywords[] entries the lexer looks for
+#define ZK_OUTPUT		0
+#define ZK_FREQ			1
+#define ZK_PERIOD		2
+#define ZK_DUTY			3
+#define ZK_STALL		4
+#define ZK_STATS		5
+#define ZK_TYPE			6
+#define ZK_ESC			7
+#define ZK_SERVO		9
+#define ZK_RAMP			10
+#define ZK_STOP			11
+#define ZK_LIN			12
+#define ZK_EXP			13
+#define ZK_MADD			14
+#define ZK_MSUB			15
+#define ZK_MULTI		19
+#define ZK_CAPTURE		20
+#define ZK_LOG			21
+#define ZK_ON			22
+#define ZK_OFF			23
+#define ZK_HI_TIME		31
+#define ZK_ZEPTO		32
+#define ZK_BIN			33
+#define ZK_FILE			34
+#define ZK_SD			35
+#define ZK_MEM			36
+#define ZK_LS			37
+#define ZK_SAVE			38
+#define ZK_PRESET		39
+#define ZK_LOAD			40
+#define ZK_RM			41
+#define ZK_RUN			42
+#define ZK_SCURVE		43
+
+// Unit dimension, kind in the upper bits and the power of 1000 in the lower two
+#define LX_DIM_KIND		0x0C
+const uint8_t lx_unit_dim[LX_U_CT] PROGMEM = {0x00, 0x04, 0x05, 0x06, 0x08, 0x09, 0x0C};
+
+// Commands, scanned in order and the first one the word abbreviates with at
+// least min chars wins, so FREQ keeps F ahead of FILE and STALL keeps S
+typedef struct{
+	uint8_t key;		// z_keywords[] index
+	uint8_t min;
+	uint8_t opcode;
+	uint8_t unit;		// LX_U_x a bare number is in
+} LX_CMD;
+
+const LX_CMD lx_cmds[] PROGMEM = {
+	{ZK_OUTPUT,		1,	0,	LX_U_NONE},
+	{ZK_FILE,		2,	14,	LX_U_NONE},
+	{ZK_FREQ,		1,	1,	LX_U_HZ},
+	{ZK_PERIOD,		1,	2,	LX_U_US},
+	{ZK_DUTY,		1,	3,	LX_U_PCT},
+	{ZK_HI_TIME,	1,	4,	LX_U_US},
+	{ZK_STATS,		4,	9,	LX_U_NONE},
+	{ZK_SD,			2,	15,	LX_U_NONE},
+	{ZK_STALL,		1,	5,	LX_U_MS},
+	{ZK_TYPE,		1,	6,	LX_U_NONE},
+	{ZK_ZEPTO,		1,	7,	LX_U_NONE},
+	{ZK_BIN,		1,	8,	LX_U_NONE},
+	{ZK_RAMP,		1,	10,	LX_U_NONE},
+	{ZK_MULTI,		2,	11,	LX_U_NONE},
+	{ZK_CAPTURE,	1,	12,	LX_U_NONE},
+	{ZK_LOG,		1,	13,	LX_U_NONE},
+	{ZK_MEM,		2,	16,	LX_U_NONE},
+	{ZK_MSUB,		2,	36,	LX_U_US},
+	{ZK_MADD,		2,	37,	LX_U_US}
+};
+#define LX_CMD_CT		(sizeof(lx_cmds) / sizeof(lx_cmds[0]))
+
+// Argument keywords, lx_pick() index is the value
+const uint8_t lx_onoff[] PROGMEM = {ZK_OFF, ZK_ON};
+const uint8_t lx_types[] PROGMEM = {ZK_ESC, ZK_SERVO};		// TYPE DATA - 1
+
+const char pe_names[][8] PROGMEM = {"", "word", "number", "unit", "range", "arg", "channel", "alone", "nesting", "full"};
+
+uint8_t parse_err = PE_NONE;
+uint8_t parse_err_col = 0;
+const char *parse_base;
+
+uint8_t parse_fail(const char *at, uint8_t why){	// Keeps the first error of a line, always 0
+	if(!parse_err){
+		parse_err = why;
+		parse_err_col = at - parse_base + 1;
+	}
+	return 0;
+}
+
+void parse_err_send(){					// "col n reason" of the last error
+	serialWriteStr_P(PSTR("col "));
+	term_Send_Val_Unpadded(parse_err_col);
+	serialWrite(' ');
+	serialWriteStr_P(pe_names[parse_err]);
+}
+
+// Word right at *at, lower cased in place. Ends at a space, ':' or the end
+// of the line, *at is left there
+char *lx_word(char **at, uint8_t *len){
+	char *w_ = *at;
+	for(; **at && **at != ' ' && **at != ':'; *at += 1){
+		if(**at >= 'A' && **at <= 'Z') **at += 'a' - 'A';
+	}
+	*len = *at - w_;
+	return w_;
+}
+
+char *lx_next(char **at, uint8_t *len){	// Next word, length 0 at the end of the line
+	lx_skip(at);
+	return lx_word(at, len);
+}
+
+char *lx_skip(char **at){				// Past the spaces, returns where that is
+	while(**at == ' ') *at += 1;
+	return *at;
+}
+
+// word is the start of the flash string name, at least min chars of it
+uint8_t lx_abbrev(const char *word, uint8_t len, const char *name, uint8_t min){
+	if(len < min) return 0;
+	for(uint8_t q = 0; q < len; q++){
+		if(pgm_read_byte(&name[q]) != word[q]) return 0;	// Its end never matches
+	}
+	return 1;
+}
+
+// Index of the list entry (z_keywords[] indices in flash) word abbreviates,
+// 0xFF if none. Scanned from the end, the later entries get the short forms
+uint8_t lx_pick(const char *word, uint8_t len, const uint8_t *list, uint8_t ct){
+	while(ct-- && !lx_abbrev(word, len, z_keywords[pgm_read_byte(&list[ct])], 1));
+	return ct;
+}
+
+// Number at *at in FX_FRAC fixed point of unit. A suffix must follow the
+// digits directly ("20ms"): us / ms / s scale into each other, Hz / kHz
+// the same, a bare number is already in unit
+uint8_t lx_num(char **at, uint32_t *val, uint8_t unit){
+	uint8_t len_;
+	uint8_t u_;
+	char *n_ = lx_skip(at);
+	uint8_t ct_ = fx_parse(n_, val);
+	
+	if(!ct_) return parse_fail(n_, (*n_ >= '0' && *n_ <= '9') ? PE_RANGE : PE_NUM);
+	*at += ct_;
+	char *w_ = lx_word(at, &len_);
+	if(!len_){
+		u_ = unit;
+	} else {
+		for(u_ = LX_U_US; u_ < LX_U_CT; u_++){
+			if(lx_abbrev(w_, len_, z_units[u_], len_) && !pgm_read_byte(&z_units[u_][len_])) break;
+		}
+		if(u_ == LX_U_CT) return parse_fail(w_, PE_UNIT);
+	}
+	
+	uint8_t have_ = pgm_read_byte(&lx_unit_dim[u_]);
+	uint8_t want_ = pgm_read_byte(&lx_unit_dim[unit]);
+	if((have_ ^ want_) & LX_DIM_KIND) return parse_fail(w_, PE_UNIT);
+	for(; (have_ & 0x03) > (want_ & 0x03); have_--){
+		if(*val > 0xFFFFFFFFUL / 1000UL) return parse_fail(n_, PE_RANGE);
+		*val *= 1000UL;
+	}
+	for(; (have_ & 0x03) < (want_ & 0x03); have_++){
+		*val = fx_div_round(*val, 1000UL);
+	}
+	return 1;
+}
+
+// One line, any number of ';' separated commands. All of them are parsed
+// before anything runs, a syntax error anywhere runs nothing
+uint8_t shell_run_line(char *line){
+	char *cmd_[SH_BATCH_MAX];
+	uint8_t ct_ = 0;
+	
+	parse_err = PE_NONE;
+	parse_base = line;
+	char *start_ = line;
+	for(uint8_t n = 0; n <= MAX_ENTRY_LEN; n++){
+		if(line[n] != ';' && line[n]) continue;
+		uint8_t end_ = line[n];
+		line[n] = 0x00;
+		while(*start_ == ' ') start_ += 1;
+		if(*start_){
+			if(ct_ == SH_BATCH_MAX){
+				parse_fail(start_, PE_FULL);
+				return 4;
+			}
+			cmd_[ct_++] = start_;
+		}
+		if(!end_) break;
+		start_ = &line[n + 1];
+	}
+	
+	if(ct_ == 0) return 1;
+	if(ct_ == 1) return parse_entry(cmd_[0], 1, NULL);	// Full screen modes only come this way, batch_ isn't under them
+	return shell_run_batch(cmd_, ct_);
+}
+
+// The register changes of a batch go live together, a STALL or MULTI inside
+// one commits what came before it first
+uint8_t shell_run_batch(char **cmd, uint8_t ct){
+	INSTRUCT_STRUCT batch_[SH_BATCH_MAX];
+	uint8_t ret_ = 1;
+	
+	for(uint8_t n = 0; n < ct; n++){
+		if(parse_entry(cmd[n], 0, &batch_[n]) != 1) return 4;
+		if(batch_[n].OPCODE == 7 || batch_[n].OPCODE == 8 || batch_[n].OPCODE >= 13){	// Full screen modes run alone
+			parse_fail(cmd[n], PE_ALONE);
+			return 4;
+		}
+	}
+	
+	if(!pwm_wait()) return 5;
+	pwm_batch_open();
+	for(uint8_t n = 0; n < ct && ret_ == 1; n++){
+		if(batch_[n].OPCODE == 5 || batch_[n].OPCODE == 11){	// STALL and MULTI only run on what came before already live
+			pwm_batch_close();
+			if(!pwm_wait()) ret_ = 5;
+			if(ret_ == 1) ret_ = interpret(&batch_[n]);
+			if(ret_ == 1 && !pwm_wait()) ret_ = 5;
+			if(ret_ == 1) pwm_batch_open();
+		} else {
+			ret_ = interpret(&batch_[n]);
+		}
+	}
+	pwm_batch_close();
+	return ret_;
+}
+
+uint8_t dbg_f_end = 0;					// Column after the last F debug field
+uint8_t dbg_e_end = 0;					// Column after the last E debug field
+
+// E debug field: where and why the last line didn't parse, blanked by the
+// next one that does
+void parse_err_echo(){
+	if(!parse_err && !dbg_e_end) return;
+	term_Set_Cursor_Pos(16, 3);
+	if(parse_err){
+		serialWrite('E');
+		serialWrite(' ');
+		parse_err_send();
+	}
+	uint8_t end_ = (parse_err) ? term_col : 0;
+	while(term_col && term_col < dbg_e_end){	// Blank the old tail, EOL clear would eat the border
+		serialWrite(' ');
+	}
+	dbg_e_end = end_;
+}
+
+uint8_t parse_entry(char *user_entry, uint8_t run_instantly, INSTRUCT_STRUCT *INS_OUT){
+	uint32_t t_start = timebase_now();
+	uint32_t want_ = 0;			// Requested value, fixed point
+	uint32_t got_ = 0;			// Value the timer will actually produce, same units
+	char *arg_;
+	INSTRUCT_STRUCT INSTR;
+	
+	parse_err = PE_NONE;
+	if(!parse_args(user_entry, &INSTR, &want_, &got_, &arg_)) return 4;
+	uint8_t is_numeric = (INSTR.OPCODE > 0 && INSTR.OPCODE < 6) || (INSTR.OPCODE > 30 && INSTR.OPCODE < 60);
+	
+	uint8_t ret_ = 1;
+	stat_add(STAT_PARSE, timebase_now() - t_start);
+	if(run_instantly){
+		ret_ = interpret(&INSTR);
+	} else {
+		*INS_OUT = INSTR;
+	}
+	
+	if(ui_quiet || !run_instantly) return ret_;	// SD streaming compiles lines while a program runs, batches are parsed ahead
+	
+	// Debug echo, queued after the instruction has been applied
+	term_Set_Cursor_Pos(15, 3);
+	serialWrite('A');
+	serialWrite(' ');
+	for(uint8_t q = 0; q < 8; q++){				// Arguments as lexed, lower case
+		serialWrite((*arg_) ? *arg_++ : ' ');
+	}
+	
+	if(is_numeric){								// Achieved value and its error
+		term_Set_Cursor_Pos(17, 3);
+		serialWrite('F');
+		serialWrite(' ');
+		term_Send_32_as_Digits(got_, FX_FRAC);
+		serialWrite(' ');
+		term_Send_ppm(fx_err_ppm(want_, got_));
+		uint8_t end_ = term_col;
+		while(term_col && term_col < dbg_f_end){	// Blank the old tail, EOL clear would eat the border
+			serialWrite(' ');
+		}
+		dbg_f_end = end_;
+	}
+	
+	term_Set_Cursor_Pos(18, 3);
+	serialWrite('I');
+	serialWrite(' ');
+	term_Send_Val_as_Digits(INSTR.OPCODE);
+	serialWrite(' ');
+	term_Send_16_as_Digits(INSTR.DATA);
+	
+	if(run_instantly && stat_applied){
+		stat_add(STAT_RENDER, timebase_now() - stat_apply_at);
+	}
+	return ret_;
+}
+
+// The command word through lx_cmds[], then its arguments straight from the
+// line. want / got are the requested and achieved value of the timing
+// commands, arg where the arguments start. 0 with parse_err set on error
+uint8_t parse_args(char *at, INSTRUCT_STRUCT *INSTR, uint32_t *want, uint32_t *got, char **arg){
+	uint8_t len_;
+	uint8_t c_;
+	uint8_t k_;
+	uint8_t chan_ = 0;			// ':n' on the command word, n + 1
+	uint32_t counts_;
+	
+	char *w_ = lx_next(&at, &len_);
+	for(c_ = 0; c_ < LX_CMD_CT; c_++){
+		if(lx_abbrev(w_, len_, z_keywords[pgm_read_byte(&lx_cmds[c_].key)], pgm_read_byte(&lx_cmds[c_].min))) break;
+	}
+	if(c_ == LX_CMD_CT) return parse_fail(w_, PE_WORD);
+	INSTR->OPCODE = pgm_read_byte(&lx_cmds[c_].opcode);
+	INSTR->ARG = 0;
+	INSTR->DATA = 0;
+	INSTR->TIME = 0;
+	
+	if(*at == ':'){								// Only per channel set points take one
+		if(INSTR->OPCODE != 4 && INSTR->OPCODE != 36 && INSTR->OPCODE != 37) return parse_fail(at, PE_CHAN);
+		at += 1;
+		if(*at < '0' || *at >= '0' + MC_CH_CT || (at[1] && at[1] != ' ')) return parse_fail(at, PE_CHAN);
+		chan_ = *at - '0' + 1;
+		at += 1;
+	}
+	*arg = lx_skip(&at);
+	
+	// Remember:
+	//	PB2 == COMPB
+	//	COMPA == TOP
+	//  f = 16MHz / ( pre * ( 1 + TOP ) )
+	//		Pre Values Range at 65535 TOP:
+	//			1		244 Hz
+	//			8		30.51
+	//			64		3.81
+	//			256		0.954
+	//			1024	0.238
+	switch(INSTR->OPCODE){
+		case 1:					// Freq, DATA = TOP, ARG = CS code
+		case 2:					// Period, inverse of frequency
+			if(!lx_num(&at, want, pgm_read_byte(&lx_cmds[c_].unit))) return 0;
+			INSTR->ARG = t1_pick_cs(*want, INSTR->OPCODE == 2, &counts_);
+			if(!INSTR->ARG || counts_ < 2) return parse_fail(*arg, PE_RANGE);		// Out of range for TOP
+			
+			if(INSTR->OPCODE == 1){
+				*got = fx_counts_to_freq(counts_, pgm_read_byte(&t1_pre_shift[INSTR->ARG]));
+			} else {
+				*got = fx_counts_to_time(counts_, pgm_read_byte(&t1_pre_shift[INSTR->ARG]));
+				INSTR->OPCODE = 1;		// Convert back to FREQ from PERIOD
+			}
+			INSTR->DATA = (uint16_t)(counts_ - 1);				// TOP value, OCR1A
+		break;
+		
+		case 4:					// Hi Time, destination OCR1B, DATA = counts - 1 at ARG's prescale
+			if(!lx_num(&at, want, LX_U_US)) return 0;
+			INSTR->ARG = t1_pick_cs(*want, 1, &counts_);
+			if(!INSTR->ARG || !counts_) return parse_fail(*arg, PE_RANGE);
+			*got = fx_counts_to_time(counts_, pgm_read_byte(&t1_pre_shift[INSTR->ARG]));
+			INSTR->DATA = (uint16_t)(counts_ - 1);
+		break;
+		
+		case 3:					// Duty, DATA = 16 bit fraction of the period
+			if(!lx_num(&at, want, LX_U_PCT)) return 0;
+			if(*want > 100UL * FX_ONE) return parse_fail(*arg, PE_RANGE);
+			INSTR->DATA = (uint16_t)fx_div_round(*want * 65535UL, 100UL * FX_ONE);
+			*got = fx_div_round((uint32_t)INSTR->DATA * (100UL * FX_ONE), 65535UL);
+		break;
+		
+		case 5:					// Stall (Delay ms)
+		case 36:				// Math subtract
+		case 37:				// Math add
+			if(!lx_num(&at, want, pgm_read_byte(&lx_cmds[c_].unit))) return 0;
+			*want = fx_div_round(*want, FX_ONE);
+			if(*want > 0xFFFF) return parse_fail(*arg, PE_RANGE);
+			INSTR->DATA = (uint16_t)*want;
+			*want *= FX_ONE;
+			*got = *want;
+		break;
+		
+		case 0:					// Output
+		case 11:				// Multi channel
+			w_ = lx_next(&at, &len_);
+			k_ = (len_ == 1 && (*w_ == '0' || *w_ == '1')) ? *w_ - '0' : lx_pick(w_, len_, lx_onoff, sizeof(lx_onoff));
+			if(k_ == 0xFF) return parse_fail(w_, PE_ARG);
+			INSTR->DATA = k_;
+		break;
+		
+		case 6:					// Type, ESC Default: 1500us Center, 400Hz, Servo: 1500us Center, 50Hz
+			w_ = lx_next(&at, &len_);
+			k_ = lx_pick(w_, len_, lx_types, sizeof(lx_types));
+			if(k_ == 0xFF) return parse_fail(w_, PE_ARG);
+			INSTR->DATA = k_ + 1;
+		break;
+		
+		case 7:					// Open Zepto
+			INSTR->DATA = 1;
+		break;
+		
+		case 9:					// Any argument resets after printing
+			lx_next(&at, &len_);
+			INSTR->DATA = (len_ != 0);
+		break;
+		
+		case 10:
+			if(!parse_ramp(&at, INSTR)) return 0;
+		break;
+		
+		case 12:				// Pulses per revolution, 0 stops
+			if(!lx_num(&at, want, LX_U_NONE)) return 0;
+			*want = fx_div_round(*want, FX_ONE);
+			if(*want > 99) return parse_fail(*arg, PE_RANGE);
+			INSTR->DATA = (uint16_t)*want;
+		break;
+		
+		case 14:
+			if(!parse_file(&at, INSTR)) return 0;
+		break;
+		
+		case 15:
+			if(!parse_sd(&at, INSTR)) return 0;
+		break;
+	}
+	
+	w_ = lx_next(&at, &len_);					// Nothing else may follow
+	if(*w_) return parse_fail(w_, PE_ARG);
+	INSTR->ARG |= chan_ << 4;
+	return 1;
+}
+
+// RAMP {H us | F Hz} {ms} [LIN | EXP | S] and RAMP STOP
+// Target ends up in ARG / DATA the same way HI_TIME and FREQ do it, shape and kind in ARG
+uint8_t parse_ramp(char **at, INSTRUCT_STRUCT *INS_OUT){	// 0 on syntax error
+	static const uint8_t kinds_[] PROGMEM = {ZK_STOP, ZK_FREQ, ZK_HI_TIME};
+	static const uint8_t shapes_[] PROGMEM = {ZK_LIN, ZK_EXP, ZK_SCURVE};	// RAMP_x order
+	uint8_t len_;
+	uint32_t want_;
+	uint32_t counts_;
+	
+	char *w_ = lx_next(at, &len_);
+	uint8_t kind_ = lx_pick(w_, len_, kinds_, sizeof(kinds_));
+	if(kind_ == 0xFF) return parse_fail(w_, PE_ARG);
+	if(kind_ == 0){											// STOP, CS 0
+		INS_OUT->ARG = 0;
+		return 1;
+	}
+	uint8_t is_time = (kind_ == 2);
+	
+	w_ = lx_skip(at);										// Target
+	if(!lx_num(at, &want_, (is_time) ? LX_U_US : LX_U_HZ)) return 0;
+	INS_OUT->ARG = t1_pick_cs(want_, is_time, &counts_);
+	if(!INS_OUT->ARG || counts_ < (is_time ? 1UL : 2UL)) return parse_fail(w_, PE_RANGE);
+	INS_OUT->DATA = (uint16_t)(counts_ - 1);
+	if(!is_time) INS_OUT->ARG |= RAMP_ARG_FREQ;
+	
+	w_ = lx_skip(at);										// Duration
+	if(!lx_num(at, &want_, LX_U_MS)) return 0;
+	want_ = fx_div_round(want_, FX_ONE);
+	if(want_ > 0xFFFF) return parse_fail(w_, PE_RANGE);
+	INS_OUT->TIME = (uint16_t)want_;
+	
+	w_ = lx_next(at, &len_);								// Shape, linear if not given
+	if(!len_) return 1;
+	kind_ = lx_pick(w_, len_, shapes_, sizeof(shapes_));
+	if(kind_ == 0xFF) return parse_fail(w_, PE_ARG);
+	INS_OUT->ARG |= (kind_ << RAMP_ARG_SHAPE);
+	return 1;
+}
+
+// FILE [LS] | FILE SAVE name | FILE PRESET name | FILE LOAD name | FILE RM name
+// The name goes to fs_arg zero padded, a-z 0-9
+uint8_t parse_file(char **at, INSTRUCT_STRUCT *INS_OUT){	// 0 on syntax error
+	static const uint8_t acts_[] PROGMEM = {ZK_LS, ZK_SAVE, ZK_PRESET, ZK_LOAD, ZK_RM};	// FS_A_x order
+	uint8_t len_;
+	uint8_t n_;
+	
+	for(n_ = 0; n_ < sizeof(fs_arg); n_++){
+		fs_arg[n_] = 0x00;
+	}
+	char *w_ = lx_next(at, &len_);
+	INS_OUT->DATA = FS_A_LS;
+	if(!len_) return 1;
+	INS_OUT->DATA = lx_pick(w_, len_, acts_, sizeof(acts_));
+	if(INS_OUT->DATA == 0xFF) return parse_fail(w_, PE_ARG);
+	if(INS_OUT->DATA == FS_A_LS) return 1;
+	
+	w_ = lx_next(at, &len_);
+	if(!len_) return parse_fail(w_, PE_ARG);
+	for(n_ = 0; n_ < len_; n_++){
+		if(n_ == FS_NAME_LEN) return parse_fail(&w_[n_], PE_RANGE);
+		if(!((w_[n_] >= 'a' && w_[n_] <= 'z') || (w_[n_] >= '0' && w_[n_] <= '9'))) return parse_fail(&w_[n_], PE_ARG);
+		fs_arg[n_] = w_[n_];
+	}
+	return 1;
+}
+
+// SD [LS] | SD RUN name.ext [repeat] | SD LOAD name.ext
+// The name goes to sd_arg as a FAT 8.3 entry name
+uint8_t parse_sd(char **at, INSTRUCT_STRUCT *INS_OUT){	// 0 on syntax error
+	static const uint8_t acts_[] PROGMEM = {ZK_LS, ZK_RUN, ZK_LOAD};	// SD_A_x order
+	uint8_t len_;
+	uint32_t want_;
+	uint8_t n_ = 0;
+	uint8_t dot_ = 0;
+	
+	char *w_ = lx_next(at, &len_);
+	INS_OUT->DATA = SD_A_LS;
+	if(!len_) return 1;
+	INS_OUT->DATA = lx_pick(w_, len_, acts_, sizeof(acts_));
+	if(INS_OUT->DATA == 0xFF) return parse_fail(w_, PE_ARG);
+	if(INS_OUT->DATA == SD_A_LS) return 1;
+	
+	w_ = lx_next(at, &len_);
+	for(uint8_t q = 0; q < SD_NAME_LEN; q++){
+		sd_arg[q] = ' ';
+	}
+	for(uint8_t q = 0; q < len_; q++){
+		if(w_[q] == '.' && n_ && !dot_){
+			n_ = 8;
+			dot_ = 1;
+			continue;
+		}
+		if(n_ == ((dot_) ? SD_NAME_LEN : 8)) return parse_fail(&w_[q], PE_RANGE);
+		sd_arg[n_++] = (w_[q] >= 'a' && w_[q] <= 'z') ? w_[q] - ('a' - 'A') : w_[q];
+	}
+	if(!n_) return parse_fail(w_, PE_ARG);
+	
+	INS_OUT->TIME = 1;
+	w_ = lx_skip(at);										// Repeat count, once if not given
+	if(*w_){
+		if(!lx_num(at, &want_, LX_U_NONE)) return 0;
+		want_ = fx_div_round(want_, FX_ONE);
+		if(!want_ || want_ > 0xFFFF) return parse_fail(w_, PE_RANGE);
+		INS_OUT->TIME = (uint16_t)want_;
+	}
+	return 1;
+}
+
+// TYPE presets, index is TYPE DATA - 1
+#define T1_PRESET_CT	2
+const T1_PRESET t1_presets[T1_PRESET_CT] PROGMEM = {
+	{1, 39978, 23986},		// ESC, 400Hz, 1500us Center (tuned, nominal 39999 / 23999)
+	{2, 39999, 2999}		// Servo, 50Hz, 1500us Center (x8 pre)
+};
+
+COMPILED_INSTR zepto_prog[Z_PROG_LEN];
+uint8_t ui_quiet = 0;				// Binary mode and SD streaming, no debug echo and no CTRL+X scanning
+
+uint8_t interpret(INSTRUCT_STRUCT *operation){
+	uint16_t ret_val = 1;
+	uint32_t t_start = timebase_now();
+	SIM_OP(operation->OPCODE);
+	pwm_src = operation->OPCODE;
+	
+	// Registers are written first, debug echo is queued after so the
+	// change never waits behind whatever the TX ring is still draining
+	switch(operation->OPCODE){
+		case 0:					// Output Set on PB2
+			pwm_set_out(operation->DATA);
+		break;
+		
+		case 1:					// Set Frequency, DATA == COMPA, ARG == CS code
+			if(mc_active && t1_rescale(operation->DATA, operation->ARG, MC_CS) == 0xFFFF){
+				ret_val = 4;	// Frame over 32ms, MC_CS can't count it
+			} else {
+				pwm_set_timing(operation->ARG, operation->DATA, pwm_stage.cmp);
+			}
+		break;
+		
+		case 3:					// Duty Set, DATA is a 16 bit fraction of the period
+			pwm_set_duty(operation->DATA);
+		break;
+		
+		case 4:	// Hi Time, DATA was computed for ARG's prescale
+			if(ARG_CH(operation->ARG)){
+				if(!mc_set_hi(ARG_CH(operation->ARG), operation->DATA, ARG_CS(operation->ARG))) ret_val = 4;
+			} else {
+				pwm_set_hi(operation->DATA, ARG_CS(operation->ARG));
+			}
+		break;
+		
+		case 5:	// Delay, CTRL+X aborts (not in binary mode, 0x18 is payload there)
+			for(uint16_t a = 0; a < operation->DATA; a++){
+				T2_1MS_SETUP_ENC
+				while(WAIT_FLAG_T2) SIM_IDLE();
+				if(!ui_quiet && serial_rx_abort()){
+					ret_val = 5;	// Aborted by user
+					break;
+				}
+			}
+		break;
+		case 6:	// Type Set
+			if(operation->DATA && operation->DATA <= T1_PRESET_CT){		// > 0x00 is valid type, 0x00 is error on set
+				T1_PRESET pre_;
+				memcpy_P(&pre_, &t1_presets[operation->DATA - 1], sizeof(pre_));
+				if(mc_active && t1_rescale(pre_.top, pre_.cs, MC_CS) == 0xFFFF){
+					ret_val = 4;
+				} else {
+					pwm_set_timing(pre_.cs, pre_.top, pre_.cmp);
+				}
+			}
+		break;
+		case 7:	// Zepto
+			term_Set_Scroll_All();
+			zepto_editor(zepto_prog, Z_PROG_LEN);
+			ret_val = 3;		// Shell needs a full redraw
+		break;
+		case 8:	// Binary framed mode, until the exit frame or CTRL+X
+			ret_val = bin_mode();
+		break;
+		case 9:	// Latency stats, DATA != 0 resets them after printing
+			stat_print();
+			if(operation->DATA) stat_reset();
+		break;
+		case 10:	// Ramp, ARG = shape | kind | CS of DATA, TIME = ms, CS 0 stops
+			if(!pwm_ramp_start(operation->ARG, operation->DATA, operation->TIME)) ret_val = 4;
+		break;
+		
+		case 11:	// Multi channel mode on / off
+			ret_val = mc_start(operation->DATA);
+		break;
+		
+		case 12:	// Input capture, DATA = pulses per revolution, 0 stops
+			ret_val = cap_start(operation->DATA);
+		break;
+		
+		case 13:	// Event log dump, empties it
+			ret_val = log_print();
+		break;
+		
+		case 14:	// FILE, DATA = FS_A_ action, name in fs_arg
+			ret_val = file_cmd(operation->DATA);
+		break;
+		
+		case 15:	// SD, DATA = SD_A_ action, name in sd_arg, TIME = repeat
+			ret_val = sd_shell(operation->DATA, operation->TIME);
+		break;
+		
+		case 16:	// MEM
+			ret_val = mem_print();
+		break;
+		
+		case 36:
+		case 37:
+			// Math: Subtract / Add, DATA in us
+			if(ARG_CH(operation->ARG)){
+				if(!mc_add_us(ARG_CH(operation->ARG), operation->DATA, operation->OPCODE == 36)) ret_val = 4;
+			} else {
+				pwm_add_us(operation->DATA, operation->OPCODE == 36);
+			}
+		break;
+		
+		default:
+			ret_val = 4;		// Syntax error or unrecognized instruction
+		break;	
+	
+	}
+	
+	if(operation->OPCODE < 5 || operation->OPCODE == 6 || (operation->OPCODE > 9 && operation->OPCODE < 13)){	// Not STALL, ZEPTO, BIN, STATS, LOG, FILE or SD
+		stat_apply_at = timebase_now();
+		stat_add(STAT_EXEC, stat_apply_at - t_start);
+		stat_applied = 1;
+	}
+	
+	if(!ui_quiet){
+		term_Set_Cursor_Pos(20, 3);
+		serialWrite('O');
+		serialWrite('P');
+		serialWrite(' ');
+		term_Send_Val_as_Digits(operation->OPCODE);
+	}
+	
+	return (uint8_t)ret_val;
+}
+
+
+  //////////////////////////////////////////////////////////////////////////
+ //							BINARY MODE									 //
+//////////////////////////////////////////////////////////////////////////
+
+// Framed packets for test rigs, same opcodes and DATA/ARG as interpret():
+//		SYNC OPCODE ARG DATA_L DATA_H CRC8
+// CRC8 is poly 0x07, init 0x00 over OPCODE to DATA_H. Every frame gets
+// ACK + interpret() return code or NAK + BIN_E_ code, nothing else is sent
+#define BIN_SYNC		0xA5
+#define BIN_ACK			0x06
+#define BIN_NAK			0x15
+#define BIN_OP_EXIT		0xFF		// Leave binary mode, ACKed first
+#define BIN_OP_SYNC		0xFE		// ACKed once the last change is live, code = pwm_commit_ct
+#define BIN_FRAME_LEN	5			// Bytes after SYNC
+#define BIN_TIMEOUT		(5 * TB_TICKS_PER_MS)	// Max gap inside a frame
+
+// NAK codes
+#define BIN_E_CRC		1
+#define BIN_E_TIMEOUT	2
+#define BIN_E_OPCODE	3			// Unknown, or not allowed here (ZEPTO, BIN)
+#define BIN_E_ARG		4			// CS code, channel or TYPE out of range
+
+uint8_t crc8_update(uint8_t crc, uint8_t data){
+	crc ^= data;
+	for(uint8_t n = 0; n < 8; n++){
+		crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+void bin_reply(uint8_t type, uint8_t code){
+	serialWrite(type);
+	serialWrite(code);
+}
+
+uint8_t bin_check(INSTRUCT_STRUCT *operation){	// 0 if interpret() may run it
+	switch(operation->OPCODE){
+		case 1:
+			if(!operation->ARG || operation->ARG > T1_CS_MAX) return BIN_E_ARG;
+		break;
+		
+		case 4:
+			if(!ARG_CS(operation->ARG) || ARG_CS(operation->ARG) > T1_CS_MAX) return BIN_E_ARG;
+			if(ARG_CH(operation->ARG) > MC_CH_CT) return BIN_E_ARG;
+		break;
+		
+		case 6:
+			if(!operation->DATA || operation->DATA > T1_PRESET_CT) return BIN_E_ARG;
+		break;
+		
+		case 36:
+		case 37:
+			if(ARG_CH(operation->ARG) > MC_CH_CT) return BIN_E_ARG;
+		break;
+		
+		case 0:
+		case 3:
+		case 5:
+		case 11:
+		case 12:
+		break;
+		
+		default:
+			return BIN_E_OPCODE;
+	}
+	return 0;
+}
+
+uint8_t bin_mode(){
+	uint8_t frame_[BIN_FRAME_LEN];
+	uint8_t got_ = 0;
+	uint8_t in_frame = 0;
+	uint8_t data_, tmp_;
+	uint32_t last_rx = 0;
+	INSTRUCT_STRUCT INSTR;
+	
+	term_Set_Scroll_All();
+	term_Clear_ALL();
+	term_Set_Cursor_Pos(1, 1);
+	serialWriteStr_P(PSTR("BINARY MODE\r\n"));
+	serialFlush();
+	ui_quiet = 1;
+	
+	while(1){
+		if(!serialTryGet(&data_)){
+			if(in_frame && (timebase_now() - last_rx) > BIN_TIMEOUT){
+				in_frame = 0;
+				bin_reply(BIN_NAK, BIN_E_TIMEOUT);
+			}
+			SIM_IDLE();
+			continue;
+		}
+		last_rx = timebase_now();
+		
+		if(!in_frame){						// Hunting for SYNC
+			if(data_ == BIN_SYNC){
+				in_frame = 1;
+				got_ = 0;
+			} else
+			if(data_ == CTRL_X){			// Way out for a human at a terminal
+				break;
+			}
+			continue;
+		}
+		
+		frame_[got_] = data_;
+		got_ += 1;
+		if(got_ < BIN_FRAME_LEN) continue;
+		in_frame = 0;
+		
+		tmp_ = 0;
+		for(uint8_t n = 0; n < BIN_FRAME_LEN - 1; n++){
+			tmp_ = crc8_update(tmp_, frame_[n]);
+		}
+		if(tmp_ != frame_[BIN_FRAME_LEN - 1]){
+			bin_reply(BIN_NAK, BIN_E_CRC);
+			continue;
+		}
+		if(frame_[0] == BIN_OP_EXIT){
+			bin_reply(BIN_ACK, 0);
+			break;
+		}
+		if(frame_[0] == BIN_OP_SYNC){
+			pwm_wait();
+			bin_reply(BIN_ACK, pwm_commit_ct);
+			continue;
+		}
+		
+		INSTR.OPCODE = frame_[0];
+		INSTR.ARG = frame_[1];
+		INSTR.DATA = frame_[2] | ((uint16_t)frame_[3] << 8);
+		INSTR.TIME = 0;
+		tmp_ = bin_check(&INSTR);
+		if(INSTR.OPCODE == 5) tmp_ = BIN_E_OPCODE;	// Nothing is read during a STALL, the rig does its own waiting
+		if(tmp_){
+			bin_reply(BIN_NAK, tmp_);
+			continue;
+		}
+		bin_reply(BIN_ACK, interpret(&INSTR));
+	}
+	
+	serialFlush();
+	ui_quiet = 0;
+	return 3;							// Shell needs a full redraw
+}
+
+
+  //////////////////////////////////////////////////////////////////////////
+ //							FIXED POINT									 //
+//////////////////////////////////////////////////////////////////////////
+
+// Decimal string to FX_FRAC fixed point, rounds on the first dropped digit
+// Returns number of chars consumed, 0 if there were no digits or it overflowed
+uint8_t fx_parse(const char *str, uint32_t *out){
+	uint32_t val_ = 0;
+	uint8_t n = 0;
+	uint8_t digits_ = 0;
+	uint8_t frac_ = 0xFF;						// Digits taken after '.', 0xFF until '.' is seen
+	uint8_t round_ = 0;
+	
+	for(;; n++){
+		if(str[n] == '.' && frac_ == 0xFF){
+			frac_ = 0;
+			continue;
+		}
+		if(str[n] < '0' || str[n] > '9') break;
+		digits_ += 1;
+		
+		if(frac_ == 0xFF || frac_ < FX_FRAC){
+			if(val_ > (0xFFFFFFFFUL - 9) / 10) return 0;
+			val_ = val_ * 10 + (str[n] - '0');
+			if(frac_ != 0xFF) frac_ += 1;
+		} else
+		if(frac_ == FX_FRAC){
+			round_ = (str[n] >= '5');
+			frac_ += 1;							// Anything further is ignored
+		}
+	}
+	if(!digits_) return 0;
+	
+	if(frac_ == 0xFF) frac_ = 0;
+	for(; frac_ < FX_FRAC; frac_++){
+		if(val_ > 0xFFFFFFFFUL / 10) return 0;
+		val_ *= 10;
+	}
+	if(round_ && val_ == 0xFFFFFFFFUL) return 0;
+	*out = val_ + round_;
+	return n;
+}
+
+uint32_t fx_div_round(uint32_t num, uint32_t den){	// Nearest integer of num / den, no overflow
+	if(!den) return 0xFFFFFFFFUL;
+	uint32_t q_ = num / den;
+	uint32_t r_ = num - q_ * den;
+	if(r_ >= den - r_) q_ += 1;
+	return q_;
+}
+
+// Counts per period, TOP = counts - 1. pre_shift is log2 of the prescaler.
+uint32_t fx_freq_to_counts(uint32_t freq, uint8_t pre_shift){
+	if(freq > (0xFFFFFFFFUL >> pre_shift)) return 0;	// Faster than the timer clock
+	return fx_div_round(FX_CLK, freq << pre_shift);
+}
+
+uint32_t fx_counts_to_freq(uint32_t counts, uint8_t pre_shift){
+	return fx_div_round(FX_CLK, counts << pre_shift);
+}
+
+// 16 counts per us at prescale 1, time is in 0.01 us so counts = time * 4 / 25
+uint32_t fx_time_to_counts(uint32_t time, uint8_t pre_shift){
+	if(time > 0x3FFFFFFFUL) return 0xFFFFFFFFUL;		// > 10s, never fits a TOP anyway
+	return fx_div_round(time * 4, 25UL << pre_shift);
+}
+
+uint32_t fx_counts_to_time(uint32_t counts, uint8_t pre_shift){
+	return fx_div_round((counts << pre_shift) * 25UL, 4);
+}
+
+// Log2 of the Timer1 prescale for each CS code, stopped timer counts as prescale 1
+const uint8_t t1_pre_shift[T1_CS_MAX + 1] PROGMEM = {0, 0, 3, 6, 8, 10};
+
+// Smallest prescale (highest TOP resolution) whose count fits 16 bits.
+// Returns the CS code and the count, 0 if even prescale 1024 overflows
+uint8_t t1_pick_cs(uint32_t want, uint8_t is_time, uint32_t *counts){
+	for(uint8_t cs = 1; cs <= T1_CS_MAX; cs++){
+		*counts = (is_time) ? fx_time_to_counts(want, pgm_read_byte(&t1_pre_shift[cs])) : fx_freq_to_counts(want, pgm_read_byte(&t1_pre_shift[cs]));
+		if(*counts <= 65536UL) return cs;
+	}
+	return 0;
+}
+
+// DATA is counts - 1, moves it between prescales (all powers of 2), saturating
+uint16_t t1_rescale(uint16_t data, uint8_t from_cs, uint8_t to_cs){
+	uint8_t from_ = pgm_read_byte(&t1_pre_shift[from_cs]);
+	uint8_t to_ = pgm_read_byte(&t1_pre_shift[to_cs]);
+	uint32_t counts_ = (uint32_t)data + 1;
+	
+	if(from_ > to_){
+		counts_ <<= (from_ - to_);
+	} else
+	if(to_ > from_){
+		counts_ = (counts_ + (1UL << (to_ - from_ - 1))) >> (to_ - from_);
+	}
+	if(!counts_) return 0;
+	return (counts_ > 65536UL) ? 0xFFFF : (uint16_t)(counts_ - 1);
+}
+
+uint16_t t1_us_to_counts(uint16_t us, uint8_t cs){	// 16 counts per us at prescale 1
+	uint8_t shift_ = pgm_read_byte(&t1_pre_shift[cs]);
+	uint32_t counts_ = (uint32_t)us << 4;
+	
+	if(shift_) counts_ = (counts_ + (1UL << (shift_ - 1))) >> shift_;
+	return (counts_ > 0xFFFF) ? 0xFFFF : (uint16_t)counts_;
+}
+
+int32_t fx_err_ppm(uint32_t want, uint32_t got){	// (got - want) / want, clamped to +-999999
+	uint32_t diff_ = (got > want) ? got - want : want - got;
+	uint32_t scale_ = 1000000UL;
+	uint32_t den_ = want;						// want itself still decides the sign
+	
+	if(!diff_) return 0;
+	while(diff_ > 0xFFFFFFFFUL / scale_){			// Trade precision to keep diff * scale in 32 bits
+		scale_ /= 10;
+		den_ /= 10;
+	}
+	uint32_t ppm_ = (den_) ? fx_div_round(diff_ * scale_, den_) : 999999UL;	// Nothing left of want, off the scale
+	if(ppm_ > 999999UL) ppm_ = 999999UL;
+	return (got > want) ? (int32_t)ppm_ : -(int32_t)ppm_;
+}
+
+// Case 200
+void goto_help(){
+	// lol no help yet
+}
+
+// Case 255
+void goto_credits(){
+	// Me
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							ZEPTO EDITOR								 //
+//////////////////////////////////////////////////////////////////////////
+
+#define ZEPTO_W		35
+#define ZEPTO_H		2
+#define Z_STATUS_W	22			// Status right of the editor, "ER 020 col 20 nesting"
+
+
+
+char zepto_array[Z_LINE_LEN][Z_LINE_CT] = {0x00};
+
+// Screen model for the text area. Edits only ever touch the cursor row, so
+// only that row is shadowed, every other row is either in sync with
+// zepto_array or flagged in z_dirty (screen content unknown, repaint whole row)
+#define Z_GAP_REWRITE	4		// Rewriting up to this many unchanged cells beats a cursor escape
+
+char z_shadow[Z_LINE_LEN];		// What the terminal shows on z_shadow_row, 0x00 shown as ' '
+uint8_t z_shadow_row = 0;
+uint32_t z_dirty = 0;
+
+void zepto_editor(COMPILED_INSTR* work_space, uint8_t len){
+	zepto_frame_cleanup();
+	zepto_frame_print();
+	zepto_invalidate();			// Text area was just blanked
+	uint16_t read_val;
+	uint8_t sm_rval;
+	uint8_t ins_mode = 1;		// If 1 normal cursor, otherwise overwrite anything
+	// Modes:
+	//	0 - Exit
+	//	1 - Input Collection
+	//	2 - Save Data
+	//	3 - Help Menu
+	//	4 - EEPROM Read
+	//	5 - EEPROM Save
+	//	6 - RES
+	//	7 - RES
+	//	8 - EXT Read	(external storage 0) (SD, FLASH, EEPROM, etc..)
+	//	9 - EXT Save	(external storage 0) (SD, FLASH, EEPROM, etc..)
+	//	....
+	//	16  - Compile program to output buffer
+	//	17	- Run program from output buffer, compiles first if the text changed
+	//	....
+	//	100 - Print Text Buffer to Screen
+	//  101 - Update Cursor
+	//	....
+	//	105 - Update Cursor Mode Text (INS vs. OVR)
+	//  ....
+	//	127	- Clear buffer
+	uint8_t zepto_mode = 100;
+	uint8_t prog_ok = 0;		// work_space holds a compile of the current text
+	uint8_t prog_len;
+	
+	
+	uint8_t cursor_x = 0;
+	uint8_t cursor_y = 0;
+	
+	while(zepto_mode){
+		/*
+		term_Set_Cursor_Pos(3,3);
+		serialWrite('X');
+		serialWrite(' ');
+		term_Send_Val_as_Digits(cursor_x);
+		term_Set_Cursor_Pos(5,3);
+		serialWrite('Y');
+		serialWrite(' ');
+		term_Send_Val_as_Digits(cursor_y);
+		*/
+		switch(zepto_mode){
+			////////////////////////////////////////////////////////////////////////////
+			case 1:		// General Purpose Input
+				read_val = serial_rx_ESC_seq();
+				term_Set_Cursor_Pos(21, 3);
+				term_Send_16_as_Digits(read_val);
+				
+				if(read_val & 0xFF){				// Normal Entry
+					sm_rval = (uint8_t)read_val;
+					
+					if(sm_rval >= 'A' && sm_rval <= 'Z'){
+						sm_rval -= 'A' - 'a';
+					}
+					if((sm_rval >= 'a' && sm_rval <= 'z')
+							|| (sm_rval == ' ')
+							|| (sm_rval == '.')
+							|| (sm_rval >= '0' && sm_rval <= '9')){	// Standard Text
+						if(cursor_x < Z_LINE_LEN - 1){
+							if(ins_mode){
+								for(uint8_t n = Z_LINE_LEN; n != cursor_x; n--){
+									zepto_array[n - 1][cursor_y] = zepto_array[n - 2][cursor_y];
+								}
+							}
+							
+							zepto_array[cursor_x][cursor_y] = sm_rval;	
+							prog_ok = 0;
+							
+							
+							cursor_x += 1;	
+							zepto_mode = 100;	// Print new array
+						}
+					} else
+					if(sm_rval == ENTER_KEY){				// Enter Key Pressed
+						if(cursor_y < Z_LINE_CT - 1){
+							cursor_y += 1;
+							cursor_x = 0;
+							zepto_mode = 100;	// Print new array
+						}
+					} else
+					if(sm_rval == BACKSPACE){
+						if(cursor_x > 0){
+							for(uint8_t n = cursor_x - 1; n < Z_LINE_LEN - 1; n++){
+								zepto_array[n][cursor_y] = zepto_array[n + 1][cursor_y];
+							}
+							cursor_x -= 1;
+							prog_ok = 0;
+							zepto_mode = 100;
+						} else {
+							zepto_mode = 101;			// Redraw cursor
+						}
+					} else
+					if(sm_rval == DELETE){
+						for(uint8_t n = cursor_x; n < Z_LINE_LEN - 1; n++){
+							zepto_array[n][cursor_y] = zepto_array[n + 1][cursor_y];
+						}
+						prog_ok = 0;
+						zepto_mode = 100;
+					} else
+					if(sm_rval == '~'){
+						ins_mode = (ins_mode) ? 0 : 1;
+						zepto_mode = 105;
+					} else
+					if(sm_rval == CTRL_R){
+						// Run in place
+						zepto_mode = 17;
+					} else
+					if(sm_rval == CTRL_E){
+						// Compile only
+						zepto_mode = 16;
+					} else
+					if(sm_rval == CTRL_N){
+						// Clear buffer
+						zepto_mode = 127;
+					} else
+					if(sm_rval == CTRL_O){
+						// Save to an EEPROM slot
+						zepto_mode = 5;
+					} else
+					if(sm_rval == CTRL_L){
+						// Load from an EEPROM slot
+						zepto_mode = 4;
+					} else
+					if(sm_rval == CTRL_A){
+						// Help Menu
+						zepto_mode = 3;
+					} else
+					if(sm_rval == CTRL_X){
+						// Quit
+						zepto_mode = 0;
+					}
+				} else {							// Arrow Key Entry
+					sm_rval = (uint8_t)(read_val >> 8);
+					switch(sm_rval){
+						case MOVE_UP:
+							if(cursor_y > 0){
+								cursor_y -= 1;
+								cursor_x = last_char(zepto_array, cursor_y);
+							}
+						break;
+						case MOVE_DOWN:
+							if(cursor_y < Z_LINE_CT - 1){
+								cursor_y += 1;
+								cursor_x = last_char(zepto_array, cursor_y);
+							}
+						break;
+						case MOVE_LEFT:
+							if(cursor_x > 0){
+								cursor_x -= 1;
+							}
+						break;
+						case MOVE_RIGHT:
+							if(cursor_x < Z_LINE_LEN - 1){
+								cursor_x += 1;
+							}
+						break;
+					}
+					zepto_mode = 100;	// Print new array
+				}
+				
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			case 2:		// Save Data to work_space
+			
+				zepto_mode = 1;
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			case 3:		// Help Menu (lol)
+				zepto_help_menu();
+				zepto_mode = 101;
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			case 4:		// EEPROM Read
+			case 5:		// EEPROM Save
+				term_Set_Cursor_Pos(TERM_H - ZEPTO_H, ZEPTO_W + 2);
+				serialWriteStr_P(PSTR("SLOT 0-3"));
+				while(term_col && term_col < ZEPTO_W + 2 + Z_STATUS_W) serialWrite(' ');
+				read_val = serial_rx_ESC_seq();
+				sm_rval = (uint8_t)read_val - '0';
+				
+				term_Set_Cursor_Pos(TERM_H - ZEPTO_H, ZEPTO_W + 2);
+				serialWriteStr_P(PSTR("        "));
+				term_Set_Cursor_Pos(TERM_H - ZEPTO_H, ZEPTO_W + 2);
+				if(!(read_val & 0xFF) || sm_rval >= Z_SLOT_CT){		// Anything else backs out
+					zepto_mode = 101;
+					break;
+				}
+				
+				if(zepto_mode == 5){
+					read_val = zepto_save(sm_rval);
+				} else {
+					read_val = zepto_load(sm_rval);
+					if(read_val == Z_EE_OK){
+						cursor_x = 0;
+						cursor_y = 0;
+						prog_ok = 0;
+					}
+				}
+				
+				if(read_val == Z_EE_OK){
+					serialWriteStr_P((zepto_mode == 5) ? PSTR("SV ") : PSTR("LD "));
+					term_Send_Val_as_Digits(sm_rval);
+				} else {
+					serialWriteStr_P((read_val == Z_EE_FULL) ? PSTR("FULL") : (read_val == Z_EE_EMPTY) ? PSTR("EMPTY") : PSTR("ER"));
+				}
+				zepto_mode = 100;
+			break;
+			// Cases >5 not used with default config
+			
+			////////////////////////////////////////////////////////////////////////////
+			case 16:											// Compile
+			case 17:											// Run compiled program, compile first if text changed
+				if(!prog_ok){
+					sm_rval = zepto_compile(work_space, len, &prog_len);
+					prog_ok = (sm_rval == 0);
+					
+					term_Set_Cursor_Pos(TERM_H - ZEPTO_H, ZEPTO_W + 2);
+					if(prog_ok){						// Compiled entry count
+						serialWrite('O');
+						serialWrite('K');
+						serialWrite(' ');
+						term_Send_Val_as_Digits(prog_len);
+					} else {							// Line that failed, where and why
+						serialWrite('E');
+						serialWrite('R');
+						serialWrite(' ');
+						term_Send_Val_as_Digits(sm_rval);
+						if(parse_err){
+							serialWrite(' ');
+							parse_err_send();
+						}
+					}
+					while(term_col && term_col < ZEPTO_W + 2 + Z_STATUS_W) serialWrite(' ');
+				}
+				
+				if(prog_ok && zepto_mode == 17){
+					seq_run(work_space);
+				}
+				
+				zepto_mode = 101;
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			case 100:	// Print changes to zepto_array to screen
+				zepto_redraw(cursor_y);
+				
+			//break;
+			
+			case 101:
+				term_Set_Cursor_Pos(cursor_y + ZEPTO_H + 1, cursor_x + ZEPTO_W + 5);
+				zepto_mode = 1;
+			break;
+			
+			case 105:	// Update cursor mode text
+				term_Set_Cursor_Pos(TERM_H - ZEPTO_H, TERM_W - 5);
+				if(ins_mode){
+					serialWrite('I');
+					serialWrite('N');
+					serialWrite('S');
+					} else {
+					serialWrite('O');
+					serialWrite('V');
+					serialWrite('R');
+				}
+				
+				term_Set_Cursor_Pos(cursor_y + ZEPTO_H + 1, cursor_x + ZEPTO_W + 5);
+				zepto_mode = 1;
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			case 127:
+				for(uint8_t n = 0; n < Z_LINE_CT; n++){
+					for(uint8_t m = 0; m < Z_LINE_LEN; m++){
+						if(zepto_array[m][n]){
+							z_dirty |= (1UL << n);		// Only rows that had text need repainting
+						}
+						zepto_array[m][n] = 0x00;
+					}
+				}
+				cursor_x = 0;
+				cursor_y = 0;
+				prog_ok = 0;
+				zepto_mode = 100;
+			break;
+			////////////////////////////////////////////////////////////////////////////
+			default:
+				// Error on mode set, exit program
+				zepto_mode = 0x00;
+			break;	
+		}
+	}
+	
+	zepto_frame_cleanup();
+}
+
+
+
+// Copy one line out of the column major zepto_array, stops at the first
+// char the editor would not accept. Returns the line length
+uint8_t zepto_get_line(uint8_t row_, char *line_){
+	uint8_t q;
+	for(q = 0; q < Z_LINE_LEN; q++){
+		char c_ = zepto_array[q][row_];
+		if(!((c_ >= 'a' && c_ <= 'z') || (c_ >= '0' && c_ <= '9') || c_ == '.' || c_ == ' ')){
+			break;
+		}
+		line_[q] = c_;
+	}
+	for(uint8_t p = q; p < MAX_ENTRY_LEN + 1; p++){
+		line_[p] = 0x00;
+	}
+	return q;
+}
+
+uint8_t z_emit(COMPILED_INSTR *prog, uint8_t *n, uint8_t len, uint8_t *addr, uint16_t data){
+	if(*n >= len - 1) return 0;			// Keep the last slot for ZOP_END
+	prog[*n].addr = addr;
+	prog[*n].data = data;
+	*n += 1;
+	return 1;
+}
+
+// One parsed instruction -> register writes at prog[*n], 0 if it can't be
+// compiled or doesn't fit. Shared by the editor and SD RUN
+uint8_t z_compile_ins(COMPILED_INSTR *prog, uint8_t *n, uint8_t len, INSTRUCT_STRUCT *ins){
+	uint8_t ok_;
+	uint16_t tmp_;
+	T1_PRESET pre_;
+	
+	switch(ins->OPCODE){
+		case 0:			// Output
+			ok_ = z_emit(prog, n, len, (uint8_t *)&pwm_stage.out, (0x01 << 8) | ((ins->DATA) ? 1 : 0))
+				&& z_emit(prog, n, len, Z_OP(ZOP_COMMIT), 0);
+		break;
+		case 1:			// Frequency
+			ok_ = z_emit(prog, n, len, (uint8_t *)&pwm_stage.cs, (0xFF << 8) | ins->ARG)
+				&& z_emit(prog, n, len, (uint8_t *)&pwm_stage.top, ins->DATA)
+				&& z_emit(prog, n, len, Z_OP(ZOP_COMMIT), 0);
+		break;
+		case 3:			// Duty
+			ok_ = z_emit(prog, n, len, Z_OP(ZOP_DUTY), ins->DATA);
+		break;
+		case 4:			// Hi time, prescale is only known at run time, channels always run at MC_CS
+			if(ARG_CH(ins->ARG)){
+				ok_ = z_emit(prog, n, len, Z_OP(ZOP_MC_HI + ARG_CH(ins->ARG) - 1), t1_rescale(ins->DATA, ARG_CS(ins->ARG), MC_CS));
+			} else {
+				ok_ = z_emit(prog, n, len, Z_OP(ZOP_HI_TIME + ins->ARG), ins->DATA);
+			}
+		break;
+		case 5:			// Stall
+			ok_ = z_emit(prog, n, len, Z_OP(ZOP_STALL), ins->DATA);
+		break;
+		case 6:			// Type
+			if(!ins->DATA || ins->DATA > T1_PRESET_CT) return 0;
+			memcpy_P(&pre_, &t1_presets[ins->DATA - 1], sizeof(pre_));
+			ok_ = z_emit(prog, n, len, (uint8_t *)&pwm_stage.cs, (0xFF << 8) | pre_.cs)
+				&& z_emit(prog, n, len, (uint8_t *)&pwm_stage.top, pre_.top)
+				&& z_emit(prog, n, len, (uint8_t *)&pwm_stage.cmp, pre_.cmp)
+				&& z_emit(prog, n, len, Z_OP(ZOP_COMMIT), 0);
+		break;
+		case 10:		// Ramp, runs on its own once started
+			ok_ = z_emit(prog, n, len, Z_OP(ZOP_RAMP_ARG), ins->ARG)
+				&& z_emit(prog, n, len, Z_OP(ZOP_RAMP_MS), ins->TIME)
+				&& z_emit(prog, n, len, Z_OP(ZOP_RAMP), ins->DATA);
+		break;
+		case 36:		// Math subtract
+		case 37:		// Math add
+			if(ARG_CH(ins->ARG)){
+				tmp_ = (ins->DATA > 0x7FFF) ? 0x7FFF : ins->DATA;
+				ok_ = z_emit(prog, n, len, Z_OP(ZOP_MC_ADD + ARG_CH(ins->ARG) - 1), (ins->OPCODE == 36) ? (uint16_t)-tmp_ : tmp_);
+			} else {
+				ok_ = z_emit(prog, n, len, Z_OP((ins->OPCODE == 36) ? ZOP_SUB : ZOP_ADD), ins->DATA);
+			}
+		break;
+		default:		// Zepto inside Zepto and friends
+			ok_ = 0;
+		break;
+	}
+	return ok_;
+}
+
+// Control flow lines, compiled here and never seen by parse_entry(). The
+// words are z_keywords[] from ZK_CTL on, in ZC_ order, so they store as one
+// token. j is the old j LL CC, any other letter is an instruction
+#define ZK_CTL			24
+#define ZC_NONE			0
+#define ZC_LOOP			1		// loop n		n passes of the lines up to its next
+#define ZC_NEXT			2
+#define ZC_LABEL		3		// label name	target of call and goto, emits nothing
+#define ZC_CALL			4		// call name	ret comes back to the line after
+#define ZC_RET			5
+#define ZC_GOTO			6		// goto name
+#define ZC_END			7		// Stop here, subroutines go after it
+#define ZC_J			8		// j LL CC		CC more passes from line LL, armed again once they ran out
+#define Z_J_MAX			255
+
+// Next word of str, leading spaces skipped, its length in *len (0 at the end)
+const char *z_word(const char *str, uint8_t *len){
+	while(*str == ' ') str++;
+	for(*len = 0; str[*len] && str[*len] != ' '; *len += 1);
+	return str;
+}
+
+uint8_t z_ctl_word(const char *word, uint8_t len){	// ZC_ code, any case
+	if(len == 1 && (word[0] | 0x20) == 'j') return ZC_J;
+	for(uint8_t c = ZC_LOOP; c < ZC_J; c++){
+		const char *key_ = z_keywords[ZK_CTL + c - 1];
+		uint8_t q = 0;
+		while(q < len && pgm_read_byte(&key_[q]) == (word[q] | 0x20)) q++;
+		if(q == len && !pgm_read_byte(&key_[q])) return c;
+	}
+	return ZC_NONE;
+}
+
+uint8_t z_num(const char *word, uint8_t len, uint16_t *val){	// Digits only, 1 if it fits 16 bits
+	uint32_t v_ = 0;
+	if(!len || len > 5) return 0;
+	for(uint8_t q = 0; q < len; q++){
+		if(word[q] < '0' || word[q] > '9') return 0;
+		v_ = v_ * 10 + (word[q] - '0');
+	}
+	if(v_ > 0xFFFF) return 0;
+	*val = v_;
+	return 1;
+}
+
+uint8_t z_fail(uint8_t row, const char *at, uint8_t why){	// parse_fail() for a control line, returns the 1 based line
+	parse_fail(at, why);
+	return row + 1;
+}
+
+uint8_t z_find_label(const char *name, uint8_t len){	// Row of the first "label name", Z_LINE_CT if none
+	char line_[MAX_ENTRY_LEN + 1];
+	uint8_t wlen_;
+	
+	for(uint8_t row_ = 0; row_ < Z_LINE_CT; row_++){
+		if(!zepto_array[0][row_]) continue;
+		zepto_get_line(row_, line_);
+		const char *w_ = z_word(line_, &wlen_);
+		if(z_ctl_word(w_, wlen_) != ZC_LABEL) continue;
+		w_ = z_word(w_ + wlen_, &wlen_);
+		if(wlen_ == len && !memcmp(w_, name, len)) return row_;
+	}
+	return Z_LINE_CT;
+}
+
+// Text -> register write program, one pass over the lines plus a patch pass
+// that turns the line numbers of j, goto and call into entries. Labels are
+// looked up while compiling, nothing is searched while the program runs.
+// Returns 0 on success or the 1 based line that failed, a loop without its
+// next fails on the loop line. parse_err has the column and why
+uint8_t zepto_compile(COMPILED_INSTR *prog, uint8_t len, uint8_t *prog_len){
+	char line_[MAX_ENTRY_LEN + 1];
+	uint8_t line_pc[Z_LINE_CT];			// First entry of each line, for jumps
+	uint8_t open_[Z_STACK_DEPTH];		// Rows of the loops still open
+	uint8_t depth_ = 0;
+	uint8_t jmps_ = 0;
+	uint8_t n_ = 0;
+	uint8_t ok_;
+	INSTRUCT_STRUCT ins_;
+	
+	parse_err = PE_NONE;
+	parse_base = line_;
+	for(uint8_t row_ = 0; row_ < Z_LINE_CT; row_++){
+		line_pc[row_] = n_;
+		if(!zepto_array[0][row_]) continue;
+		zepto_get_line(row_, line_);
+		
+		uint8_t wlen_, alen_, blen_;
+		const char *w_ = z_word(line_, &wlen_);
+		const char *a_ = z_word(w_ + wlen_, &alen_);		// Arguments
+		const char *b_ = z_word(a_ + alen_, &blen_);
+		uint8_t ctl_ = z_ctl_word(w_, wlen_);
+		uint16_t val_;
+		uint16_t ct_;
+		
+		switch(ctl_){
+			case ZC_NONE:
+				if(parse_entry(line_, 0, &ins_) != 1) return row_ + 1;
+				ok_ = z_compile_ins(prog, &n_, len, &ins_);
+			break;
+			case ZC_LOOP:
+				if(!z_num(a_, alen_, &val_)) return z_fail(row_, a_, PE_NUM);
+				if(!val_) return z_fail(row_, a_, PE_RANGE);
+				if(blen_) return z_fail(row_, b_, PE_ARG);
+				if(depth_ == Z_STACK_DEPTH) return z_fail(row_, w_, PE_NEST);
+				open_[depth_++] = row_;
+				ok_ = z_emit(prog, &n_, len, Z_OP(ZOP_LOOP), val_);
+			break;
+			case ZC_NEXT:
+				if(alen_) return z_fail(row_, a_, PE_ARG);
+				if(!depth_) return z_fail(row_, w_, PE_NEST);
+				depth_ -= 1;
+				ok_ = z_emit(prog, &n_, len, Z_OP(ZOP_NEXT), 0);
+			break;
+			case ZC_LABEL:
+				if(!alen_ || z_find_label(a_, alen_) != row_) return z_fail(row_, a_, PE_ARG);	// Taken twice
+				if(blen_) return z_fail(row_, b_, PE_ARG);
+				ok_ = 1;
+			break;
+			case ZC_CALL:
+			case ZC_GOTO:
+				if(!alen_) return z_fail(row_, a_, PE_ARG);
+				if((val_ = z_find_label(a_, alen_)) == Z_LINE_CT) return z_fail(row_, a_, PE_WORD);
+				if(blen_) return z_fail(row_, b_, PE_ARG);
+				ok_ = z_emit(prog, &n_, len, Z_OP((ctl_ == ZC_CALL) ? ZOP_CALL : ZOP_GOTO), val_);	// Line now, patched below
+			break;
+			case ZC_RET:
+			case ZC_END:
+				if(alen_) return z_fail(row_, a_, PE_ARG);
+				ok_ = z_emit(prog, &n_, len, Z_OP((ctl_ == ZC_RET) ? ZOP_RET : ZOP_END), 0);
+			break;
+			default:		// ZC_J
+				if(!z_num(a_, alen_, &val_)) return z_fail(row_, a_, PE_NUM);
+				if(!val_ || val_ > Z_LINE_CT) return z_fail(row_, a_, PE_RANGE);
+				if(!z_num(b_, blen_, &ct_)) return z_fail(row_, b_, PE_NUM);
+				if(!ct_ || ct_ > Z_J_MAX) return z_fail(row_, b_, PE_RANGE);
+				if(jmps_ == Z_JMP_CT) return z_fail(row_, w_, PE_FULL);
+				a_ = z_word(b_ + blen_, &wlen_);
+				if(*a_) return z_fail(row_, a_, PE_ARG);
+				ok_ = z_emit(prog, &n_, len, Z_OP(ZOP_JMP + jmps_), (val_ - 1) | (ct_ << 8));	// Line now, patched below
+				jmps_ += 1;
+			break;
+		}
+		if(!ok_) return z_fail(row_, w_, (n_ >= len - 1) ? PE_FULL : PE_ALONE);
+	}
+	if(depth_){									// Loop without its next
+		parse_err = PE_NEST;
+		parse_err_col = 1;
+		return open_[depth_ - 1] + 1;
+	}
+	
+	prog[n_].addr = Z_OP(ZOP_END);
+	prog[n_].data = 0;
+	
+	for(uint8_t q = 0; q < n_; q++){		// Jump targets: line -> entry
+		uintptr_t op_ = (uintptr_t)prog[q].addr;
+		if(op_ == ZOP_GOTO || op_ == ZOP_CALL || (op_ >= ZOP_JMP && op_ < ZOP_JMP + Z_JMP_CT)){
+			prog[q].data = (prog[q].data & 0xFF00) | line_pc[prog[q].data & 0xFF];
+		}
+	}
+	*prog_len = n_;
+	return 0;
+}
+
+void zepto_vm_reset(ZEPTO_VM *vm, COMPILED_INSTR *prog){
+	vm->prog = prog;
+	vm->pc = 0;
+	vm->sp = 0;
+	vm->jmp_armed = 0;
+	vm->ramp_arg = 0;
+	vm->ramp_ms = 0;
+}
+
+// Execute up to budget entries, stops early at a STALL or the end (Z_SLICE_x)
+// Touches registers only, safe to call from an ISR
+uint8_t zepto_run_slice(ZEPTO_VM *vm, uint16_t *stall_ms, uint8_t budget){
+	uint8_t op_;
+	pwm_src = 7;
+	for(; budget; budget--){
+		COMPILED_INSTR *ins_ = &vm->prog[vm->pc];
+		vm->pc += 1;
+		
+		if((uintptr_t)ins_->addr >= Z_OP_LIMIT){					// Register write
+			if(ins_->addr == (uint8_t *)&pwm_stage.top || ins_->addr == (uint8_t *)&pwm_stage.cmp){
+				pwm_ramp_stop();		// Timing set point, same as the shell
+				*(volatile uint16_t *)ins_->addr = ins_->data;
+			} else {
+				*(volatile uint8_t *)ins_->addr = (*(volatile uint8_t *)ins_->addr & ~(ins_->data >> 8)) | (ins_->data & 0xFF);
+			}
+			continue;
+		}
+		
+		switch((uintptr_t)ins_->addr){
+			case ZOP_END:
+				vm->pc -= 1;			// Stay on END
+			return Z_SLICE_END;
+			
+			case ZOP_STALL:
+				*stall_ms = ins_->data;
+			return Z_SLICE_STALL;
+			
+			case ZOP_DUTY:
+				pwm_set_duty(ins_->data);
+			break;
+			
+			case ZOP_SUB:
+				pwm_add_us(ins_->data, 1);
+			break;
+			
+			case ZOP_ADD:
+				pwm_add_us(ins_->data, 0);
+			break;
+			
+			case ZOP_GOTO:
+				vm->pc = ins_->data;
+			break;
+			
+			case ZOP_LOOP:
+			case ZOP_CALL:
+				if(vm->sp == Z_STACK_DEPTH){		// Calls nested too deep, stops like END
+					vm->pc -= 1;
+					return Z_SLICE_END;
+				}
+				if((uintptr_t)ins_->addr == ZOP_LOOP){
+					vm->stack[vm->sp].pc = vm->pc;
+					vm->stack[vm->sp].ct = ins_->data;
+				} else {
+					vm->stack[vm->sp].pc = vm->pc;
+					vm->stack[vm->sp].ct = 0;
+					vm->pc = ins_->data;
+				}
+				vm->sp += 1;
+			break;
+			
+			case ZOP_NEXT:
+				if(!vm->sp || !vm->stack[vm->sp - 1].ct){	// Got here without its loop (goto, call)
+					vm->pc -= 1;
+					return Z_SLICE_END;
+				}
+				if(--vm->stack[vm->sp - 1].ct){
+					vm->pc = vm->stack[vm->sp - 1].pc;
+				} else {
+					vm->sp -= 1;
+				}
+			break;
+			
+			case ZOP_RET:					// Loops still open in the subroutine go with it
+				while(vm->sp && vm->stack[vm->sp - 1].ct) vm->sp -= 1;
+				if(!vm->sp){
+					vm->pc -= 1;
+					return Z_SLICE_END;
+				}
+				vm->sp -= 1;
+				vm->pc = vm->stack[vm->sp].pc;
+			break;
+			
+			case ZOP_COMMIT:
+				pwm_commit();			// ISR context, interrupts are already off
+			break;
+			
+			case ZOP_RAMP_ARG:
+				vm->ramp_arg = ins_->data;
+			break;
+			
+			case ZOP_RAMP_MS:
+				vm->ramp_ms = ins_->data;
+			break;
+			
+			case ZOP_RAMP:
+				pwm_ramp_start(vm->ramp_arg, ins_->data, vm->ramp_ms);
+			break;
+			
+			default:
+				op_ = (uintptr_t)ins_->addr;
+				if(op_ >= ZOP_JMP){							// + counter
+					uint8_t bit_ = 1 << (op_ - ZOP_JMP);
+					uint8_t *left_ = &vm->jmp_ct[op_ - ZOP_JMP];
+					if(!(vm->jmp_armed & bit_)){
+						*left_ = ins_->data >> 8;
+						vm->jmp_armed |= bit_;
+					}
+					if(*left_){
+						*left_ -= 1;
+						vm->pc = ins_->data & 0xFF;
+					} else {
+						vm->jmp_armed &= ~bit_;				// Ran out, the next pass through arms it again
+					}
+				} else
+				if(op_ >= ZOP_MC_ADD){						// + channel, signed us
+					mc_add_us(op_ - ZOP_MC_ADD + 1, ((int16_t)ins_->data < 0) ? -ins_->data : ins_->data, (int16_t)ins_->data < 0);
+				} else
+				if(op_ >= ZOP_MC_HI){						// + channel
+					mc_set_hi(op_ - ZOP_MC_HI + 1, ins_->data, MC_CS);
+				} else {									// ZOP_HI_TIME + CS
+					pwm_set_hi(ins_->data, op_ - ZOP_HI_TIME);
+				}
+			break;
+		}
+	}
+	return Z_SLICE_YIELD;
+}
+
+void zepto_invalidate(){		// Call whenever the text area was blanked or zepto_array changed off the cursor row
+	z_dirty = (1UL << Z_LINE_CT) - 1;
+}
+
+// Emit only the cells of row_ that differ from what the terminal shows.
+// shown_ == NULL means the row's screen content is unknown
+void z_diff_row(uint8_t row_, const char *shown_){
+	uint8_t last_ = 0xFF;				// Column after the last cell written, 0xFF == cursor not on this row
+	
+	for(uint8_t m = 0; m < Z_LINE_LEN; m++){
+		char want_ = (zepto_array[m][row_]) ? zepto_array[m][row_] : ' ';
+		if(shown_ && ((shown_[m]) ? shown_[m] : ' ') == want_) continue;
+		
+		if(last_ != 0xFF && m - last_ <= Z_GAP_REWRITE){
+			for(; last_ < m; last_++){	// Cheaper to rewrite the gap than to move
+				serialWrite((zepto_array[last_][row_]) ? zepto_array[last_][row_] : ' ');
+			}
+		} else {
+			term_Set_Cursor_Pos(row_ + ZEPTO_H + 1, m + ZEPTO_W + 5);
+		}
+		serialWrite(want_);
+		last_ = m + 1;
+	}
+}
+
+void zepto_redraw(uint8_t cur_row){
+	uint32_t t_start = timebase_now();
+	
+	if(!(z_dirty & (1UL << z_shadow_row))){
+		z_diff_row(z_shadow_row, z_shadow);		// Edits since the last redraw
+	}
+	
+	for(uint8_t n = 0; z_dirty; n++){
+		if(z_dirty & (1UL << n)){
+			z_diff_row(n, NULL);
+			z_dirty &= ~(1UL << n);
+		}
+	}
+	
+	z_shadow_row = cur_row;						// Screen now matches zepto_array everywhere
+	for(uint8_t m = 0; m < Z_LINE_LEN; m++){
+		z_shadow[m] = zepto_array[m][cur_row];
+	}
+	stat_add(STAT_ZDRAW, timebase_now() - t_start);
+}
+
+uint8_t last_char(const char str[Z_LINE_LEN][Z_LINE_CT], uint8_t row_){
+	uint8_t n;
+	for(n = 0; n < Z_LINE_LEN - 1; n++){
+		if(!str[n][row_]) break;
+	}
+	return n ;
+}
+
+void zepto_frame_print(){
+	static const char zepto_nametag[] PROGMEM = "ZEPTO\0";
+	
+	for(uint8_t n = 0; n < Z_LINE_CT; n++){
+		term_Set_Cursor_Pos(n + ZEPTO_H + 1, ZEPTO_W + 1);
+		term_Send_Val_as_Digits(n + 1);
+	}
+	
+	for(uint8_t n = ZEPTO_H; n < TERM_H; n++){
+		term_Set_Cursor_Pos(n, ZEPTO_W);
+		serialWrite('#');
+		serialWrite(' ');
+	}
+	
+	term_Set_Cursor_Pos(ZEPTO_H + 1, TERM_W - sizeof(zepto_nametag));
+	serialWriteStr_P(zepto_nametag);
+}
+
+void zepto_frame_cleanup(){
+	for(uint8_t n = ZEPTO_H; n < TERM_H; n++){
+		term_Set_Cursor_Pos(n, ZEPTO_W);
+		
+		for(uint8_t m = ZEPTO_W; m < TERM_W - 1; m++){
+			serialWrite(' ');		
+		}
+	}	
+}
+
+void zepto_help_menu(){
+	static uint8_t wr_o_cl = 0;
+	
+	static const char zep_help[6][18] PROGMEM = {"CTRL+R: Interpret", "CTRL+E: Compile", "CTRL+N: Clear",
+		"CTRL+O: Save", "CTRL+L: Load", "CTRL+X: Exit"};
+	
+	wr_o_cl = (wr_o_cl) ? 0 : 1;
+	
+	// Help -> TERM_W - 18
+	if(wr_o_cl){
+		for(uint8_t n = 0; n < 6; n++){
+			term_Set_Cursor_Pos(TERM_H - (10 - n), TERM_W - 18);
+			serialWriteStr_P(zep_help[n]);
+		}
+	} else {
+		for(uint8_t n = 0; n < 6; n++){
+			term_Set_Cursor_Pos(TERM_H - (10 - n), TERM_W - 18);
+			for(uint8_t m = 0; m < 17; m++){
+				serialWrite(' ');
+			}
+		}
+	}
+	
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							ZEPTO STORAGE								 //
+//////////////////////////////////////////////////////////////////////////
+
+// Programs are kept as tokens, not as the 400 byte text buffer. EEPROM
+// 0x000 - 0x17F holds Z_SLOT_CT slots of Z_SLOT_LEN bytes:
+//	len		token bytes, 0xFF == erased, empty slot
+//	crc		crc8_update() over the tokens
+//	tokens	words of each line, single spaced when loaded back:
+//		0x00 - 0x3F		z_keywords[] entry
+//		0x41 - 0x5F		any other word, (b & 0x1F) chars follow
+//		0x61 - 0x7A		one letter word, the letter itself
+//		0x80 - 0xBF		number, ZT_NUM | unit << 2 | decimals, digits as a 7 bit varint
+//		0xC0 - 0xD3		line (b & 0x1F) starts
+// eeprom_update_byte() skips bytes that didn't change, saving the same
+// program again costs no wear and an edit only rewrites from where the
+// tokens start to differ. Slot 0 is loaded into the editor at boot
+#define Z_EE_BASE		0x000
+#define Z_SLOT_LEN		96
+#define Z_SLOT_ADDR(n)	((uint8_t *)(uintptr_t)(Z_EE_BASE + (n) * Z_SLOT_LEN))
+#define Z_TOK_MAX		(Z_SLOT_LEN - 2)
+
+#define ZT_KEY_CT		(sizeof(z_keywords) / sizeof(z_keywords[0]))
+#define ZT_RAW			0x40
+#define ZT_NUM			0x80
+#define ZT_LINE			0xC0
+#define ZT_NUM_DIGITS	9			// More is stored as a word
+#define ZT_UNIT_CT		(sizeof(z_units) / sizeof(z_units[0]))
+
+const char z_keywords[][8] PROGMEM = {"output", "freq", "period", "duty", "stall", "stats", "type", "esc", "serv", "servo",
+	"ramp", "stop", "lin", "exp", "madd", "msub", "ma", "ms", "mu", "multi", "capture", "log", "on", "off",
+	"loop", "next", "label", "call", "ret", "goto", "end",		// From ZK_CTL, append only, slots keep the indices
+	"hi_time", "zepto", "bin", "file", "sd", "mem", "ls", "save", "preset", "load", "rm", "run", "scurve"};
+const char z_units[][4] PROGMEM = {"", "us", "ms", "s", "hz", "khz", "%"};		// LX_U_x order, append only
+
+uint8_t z_tok_word(const char *word, uint8_t len, uint8_t *out){	// Bytes written to out, at most len + 1
+	uint8_t n = 0;
+	uint8_t digits_ = 0;
+	uint8_t dec_ = 0xFF;				// Digits after '.', 0xFF until '.' is seen
+	uint32_t val_ = 0;
+	
+	for(uint8_t k = 0; k < ZT_KEY_CT; k++){
+		uint8_t q = 0;
+		while(q < len && pgm_read_byte(&z_keywords[k][q]) == word[q]) q++;
+		if(q == len && !pgm_read_byte(&z_keywords[k][q])){
+			out[0] = k;
+			return 1;
+		}
+	}
+	if(len == 1 && word[0] >= 'a' && word[0] <= 'z'){
+		out[0] = word[0];
+		return 1;
+	}
+	
+	for(; n < len; n++){				// Number, no leading zero so "04" stays as typed
+		if(word[n] == '.' && dec_ == 0xFF){
+			dec_ = 0;
+			continue;
+		}
+		if(word[n] < '0' || word[n] > '9') break;
+		if(digits_ == ZT_NUM_DIGITS || dec_ == 3 || (digits_ == 1 && !val_ && dec_ == 0xFF)) break;
+		val_ = val_ * 10 + (word[n] - '0');
+		digits_ += 1;
+		if(dec_ != 0xFF) dec_ += 1;
+	}
+	if(digits_ && word[0] != '.' && dec_ != 0){
+		for(uint8_t u = 0; u < ZT_UNIT_CT; u++){
+			uint8_t q = 0;
+			while(n + q < len && pgm_read_byte(&z_units[u][q]) == word[n + q]) q++;
+			if(n + q != len || pgm_read_byte(&z_units[u][q])) continue;
+			
+			out[0] = ZT_NUM | (u << 2) | ((dec_ == 0xFF) ? 0 : dec_);
+			n = 1;
+			for(; val_ > 0x7F; val_ >>= 7){
+				out[n++] = (val_ & 0x7F) | 0x80;
+			}
+			out[n++] = val_;
+			return n;
+		}
+	}
+	
+	out[0] = ZT_RAW | len;
+	for(n = 0; n < len; n++){
+		out[n + 1] = word[n];
+	}
+	return len + 1;
+}
+
+// Editor text to tokens, tok needs max + Z_LINE_LEN + 1 bytes. Returns the
+// token count, more than max if it didn't fit
+uint8_t zepto_tokenize(uint8_t *tok, uint8_t max){
+	char line_[MAX_ENTRY_LEN + 1];
+	uint8_t n_ = 0;
+	
+	for(uint8_t row_ = 0; row_ < Z_LINE_CT && n_ <= max; row_++){
+		uint8_t len_ = zepto_get_line(row_, line_);
+		uint8_t start_ = 0;
+		while(start_ < len_ && line_[start_] == ' ') start_++;
+		if(start_ == len_) continue;
+		
+		tok[n_++] = ZT_LINE | row_;
+		while(start_ < len_ && n_ <= max){
+			uint8_t end_ = start_;
+			while(end_ < len_ && line_[end_] != ' ') end_++;
+			n_ += z_tok_word(&line_[start_], end_ - start_, &tok[n_]);
+			start_ = end_;
+			while(start_ < len_ && line_[start_] == ' ') start_++;
+		}
+	}
+	return n_;
+}
+
+// Tokens back into the editor, whatever was there is cleared first
+uint8_t zepto_detok(const uint8_t *tok, uint8_t len){	// Z_EE_OK or Z_EE_BAD
+	uint8_t row_ = 0xFF;
+	uint8_t col_ = 0;
+	
+	for(uint8_t n = 0; n < Z_LINE_CT; n++){
+		for(uint8_t m = 0; m < Z_LINE_LEN; m++){
+			if(zepto_array[m][n]) z_dirty |= (1UL << n);
+			zepto_array[m][n] = 0x00;
+		}
+	}
+	
+	for(uint8_t n = 0; n < len;){
+		char word_[ZT_NUM_DIGITS + 5];
+		uint8_t wlen_ = 0;
+		uint8_t b_ = tok[n++];
+		
+		if(b_ >= ZT_LINE){
+			row_ = b_ & 0x1F;
+			col_ = 0;
+			if(row_ >= Z_LINE_CT) return Z_EE_BAD;
+			z_dirty |= (1UL << row_);
+			continue;
+		}
+		if(row_ == 0xFF) return Z_EE_BAD;
+		if(col_) zepto_array[col_++][row_] = ' ';
+		
+		if(b_ >= ZT_NUM){
+			uint32_t val_ = 0;
+			uint8_t dec_ = b_ & 0x03;
+			const char *unit_ = z_units[((b_ >> 2) & 0x0F) < ZT_UNIT_CT ? (b_ >> 2) & 0x0F : 0];
+			for(uint8_t sh_ = 0; n < len; sh_ += 7){
+				uint8_t v_ = tok[n++];
+				val_ |= (uint32_t)(v_ & 0x7F) << sh_;
+				if(!(v_ & 0x80)) break;
+			}
+			do{									// Digits backwards, '.' dec_ digits in, "0." if nothing is left
+				word_[wlen_++] = '0' + val_ % 10;
+				val_ /= 10;
+				if(wlen_ == dec_) word_[wlen_++] = '.';
+			} while(val_ || wlen_ <= dec_ + (dec_ ? 1 : 0));
+			while(wlen_ && col_ < Z_LINE_LEN) zepto_array[col_++][row_] = word_[--wlen_];
+			while(pgm_read_byte(unit_) && col_ < Z_LINE_LEN) zepto_array[col_++][row_] = pgm_read_byte(unit_++);
+		} else
+		if(b_ >= 'a' && b_ <= 'z'){
+			if(col_ < Z_LINE_LEN) zepto_array[col_++][row_] = b_;
+		} else
+		if(b_ > ZT_RAW && b_ < 0x60){
+			for(uint8_t q = 0; q < (b_ & 0x1F) && n < len; q++){
+				char c_ = tok[n++];
+				if(col_ < Z_LINE_LEN) zepto_array[col_++][row_] = c_;
+			}
+		} else
+		if(b_ < ZT_KEY_CT){
+			for(const char *k_ = z_keywords[b_]; pgm_read_byte(k_) && col_ < Z_LINE_LEN; k_++){
+				zepto_array[col_++][row_] = pgm_read_byte(k_);
+			}
+		} else {
+			return Z_EE_BAD;
+		}
+	}
+	return Z_EE_OK;
+}
+
+uint8_t zepto_save(uint8_t slot){
+	uint8_t tok_[Z_TOK_MAX + Z_LINE_LEN + 1];
+	uint8_t n_ = zepto_tokenize(tok_, Z_TOK_MAX);
+	uint8_t crc_ = 0;
+	
+	if(n_ > Z_TOK_MAX) return Z_EE_FULL;
+	
+	uint8_t *ee_ = Z_SLOT_ADDR(slot);
+	for(uint8_t n = 0; n < n_; n++){
+		crc_ = crc8_update(crc_, tok_[n]);
+		eeprom_update_byte(ee_ + 2 + n, tok_[n]);
+	}
+	eeprom_update_byte(ee_ + 1, crc_);
+	eeprom_update_byte(ee_, n_);		// Last, a save cut short fails the CRC
+	return Z_EE_OK;
+}
+
+uint8_t zepto_load(uint8_t slot){		// Buffer is only touched if the slot checks out
+	uint8_t tok_[Z_TOK_MAX];
+	uint8_t *ee_ = Z_SLOT_ADDR(slot);
+	uint8_t len_ = eeprom_read_byte(ee_);
+	uint8_t crc_ = 0;
+	
+	if(len_ == 0xFF) return Z_EE_EMPTY;
+	if(len_ > Z_TOK_MAX) return Z_EE_BAD;
+	for(uint8_t n = 0; n < len_; n++){
+		tok_[n] = eeprom_read_byte(ee_ + 2 + n);
+		crc_ = crc8_update(crc_, tok_[n]);
+	}
+	if(crc_ != eeprom_read_byte(ee_ + 1)) return Z_EE_BAD;
+	return zepto_detok(tok_, len_);
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							FILE SYSTEM									 //
+//////////////////////////////////////////////////////////////////////////
+
+// Named files in EEPROM 0x180 - 0x3FF, after the Zepto slots, FS_BLK_CT
+// blocks of FS_BLK bytes:
+//	head	tag next seq_lo seq_hi len crc name[FS_NAME_LEN] data...
+//	body	FS_T_BODY next data...
+// tag FS_T_SCRIPT / FS_T_PRESET marks a head, next is the file's following
+// block or FS_END, crc covers name and data. Files are never rewritten in
+// place, it's a log: a save puts the new copy into free blocks taken round
+// robin from fs_cur, tag byte of the head last, then kills the old copy's
+// head with FS_T_DEAD. Every block gets the same share of the writes and a
+// save cut short leaves the old copy live.
+// fs_mount() reads EEPROM once into fs_map / fs_hash, after that a lookup
+// only reads the names of heads whose hash matches, chains come from fs_map
+#define FS_BASE			0x180
+#define FS_BLK			32
+#define FS_BLK_CT		20			// Up to E2END
+#define FS_BLK_ADDR(b)	((uint8_t *)(uintptr_t)(FS_BASE + (uint16_t)(b) * FS_BLK))
+#define FS_H_NEXT		1
+#define FS_H_SEQ		2
+#define FS_H_LEN		4
+#define FS_H_CRC		5
+#define FS_H_NAME		6
+#define FS_HEAD_LEN		(FS_H_NAME + FS_NAME_LEN)
+#define FS_HEAD_DATA	(FS_BLK - FS_HEAD_LEN)
+#define FS_BODY_DATA	(FS_BLK - 2)
+#define FS_DATA_MAX		128
+#define FS_BLKS(len)	(((len) <= FS_HEAD_DATA) ? 1 : 1 + ((len) - FS_HEAD_DATA + FS_BODY_DATA - 1) / FS_BODY_DATA)
+#define FS_PRESET_LEN	6			// cs, top, cmp, out
+
+#define FS_T_DEAD		0x00
+#define FS_T_BODY		0x40
+#define FS_T_SCRIPT		0x81
+#define FS_T_PRESET		0x82
+
+#define FS_END			0x3F		// fs_map next, end of file
+#define FS_M_HEAD		0x80
+#define FS_M_FREE		0xFF
+
+uint8_t fs_map[FS_BLK_CT];				// FS_M_FREE or next block, | FS_M_HEAD on heads
+uint8_t fs_hash[FS_BLK_CT];				// Heads, crc8 of the name
+uint8_t fs_free = 0;					// FS_M_FREE blocks
+uint8_t fs_cur = 0;						// Round robin allocation starts here
+uint16_t fs_seq = 0;					// Stamp of the next save
+char fs_arg[FS_NAME_LEN + 1];			// FILE name, parse_file() to interpret()
+
+uint8_t fs_name_hash(const char *name){	// name zero padded to FS_NAME_LEN
+	uint8_t crc_ = 0;
+	for(uint8_t q = 0; q < FS_NAME_LEN; q++){
+		crc_ = crc8_update(crc_, name[q]);
+	}
+	return crc_;
+}
+
+uint16_t fs_head_seq(uint8_t blk){
+	uint8_t *ee_ = FS_BLK_ADDR(blk);
+	return eeprom_read_byte(ee_ + FS_H_SEQ) | ((uint16_t)eeprom_read_byte(ee_ + FS_H_SEQ + 1) << 8);
+}
+
+uint8_t fs_check(uint8_t blk){			// Head's chain holds together and matches its CRC
+	uint8_t *head_ = FS_BLK_ADDR(blk);
+	uint8_t *ee_ = head_;
+	uint8_t len_ = eeprom_read_byte(head_ + FS_H_LEN);
+	uint8_t off_ = FS_HEAD_LEN;
+	uint8_t crc_ = 0;
+	
+	if(len_ > FS_DATA_MAX) return 0;
+	for(uint8_t q = 0; q < FS_NAME_LEN; q++){
+		crc_ = crc8_update(crc_, eeprom_read_byte(head_ + FS_H_NAME + q));
+	}
+	for(uint8_t n = 0; n < len_; n++){
+		if(off_ == FS_BLK){
+			blk = eeprom_read_byte(ee_ + FS_H_NEXT);
+			if(blk >= FS_BLK_CT || fs_map[blk] != FS_M_FREE) return 0;
+			ee_ = FS_BLK_ADDR(blk);
+			if(eeprom_read_byte(ee_) != FS_T_BODY) return 0;
+			off_ = 2;
+		}
+		crc_ = crc8_update(crc_, eeprom_read_byte(ee_ + off_++));
+	}
+	return eeprom_read_byte(ee_ + FS_H_NEXT) == FS_END && crc_ == eeprom_read_byte(head_ + FS_H_CRC);
+}
+
+void fs_take(uint8_t blk){				// Checked chain from EEPROM into fs_map
+	uint8_t head_ = FS_M_HEAD;
+	fs_hash[blk] = 0;
+	for(uint8_t q = 0; q < FS_NAME_LEN; q++){
+		fs_hash[blk] = crc8_update(fs_hash[blk], eeprom_read_byte(FS_BLK_ADDR(blk) + FS_H_NAME + q));
+	}
+	for(uint8_t next_ = 0; next_ != FS_END; blk = next_){
+		next_ = eeprom_read_byte(FS_BLK_ADDR(blk) + FS_H_NEXT);
+		fs_map[blk] = next_ | head_;
+		head_ = 0;
+		fs_free -= 1;
+	}
+}
+
+void fs_mount(){
+	uint8_t newest_ = FS_END;
+	char name_[FS_NAME_LEN + 1];
+	
+	for(uint8_t b = 0; b < FS_BLK_CT; b++){
+		fs_map[b] = FS_M_FREE;
+	}
+	fs_free = FS_BLK_CT;
+	
+	for(uint8_t b = 0; b < FS_BLK_CT; b++){
+		uint8_t tag_ = eeprom_read_byte(FS_BLK_ADDR(b));
+		if(tag_ != FS_T_SCRIPT && tag_ != FS_T_PRESET) continue;
+		if(fs_map[b] != FS_M_FREE || !fs_check(b)) continue;		// Torn save or a block already taken
+		
+		for(uint8_t q = 0; q < FS_NAME_LEN; q++){
+			name_[q] = eeprom_read_byte(FS_BLK_ADDR(b) + FS_H_NAME + q);
+		}
+		uint8_t old_ = fs_find(name_);
+		if(old_ != FS_END){					// Save cut short after its head, the newer one stays
+			if((int16_t)(fs_head_seq(b) - fs_head_seq(old_)) < 0){
+				eeprom_update_byte(FS_BLK_ADDR(b), FS_T_DEAD);
+				continue;
+			}
+			fs_remove(old_);
+		}
+		
+		fs_take(b);
+		if(newest_ == FS_END || (int16_t)(fs_head_seq(b) - fs_head_seq(newest_)) > 0) newest_ = b;
+	}
+	
+	fs_seq = (newest_ == FS_END) ? 0 : fs_head_seq(newest_) + 1;
+	fs_cur = (newest_ == FS_END) ? 0 : (newest_ + 1) % FS_BLK_CT;	// Carries on where the last save stopped
+}
+
+uint8_t fs_find(const char *name){		// Head block, FS_END if there's no such file
+	uint8_t hash_ = fs_name_hash(name);
+	
+	for(uint8_t b = 0; b < FS_BLK_CT; b++){
+		if(fs_map[b] == FS_M_FREE || !(fs_map[b] & FS_M_HEAD) || fs_hash[b] != hash_) continue;
+		uint8_t q = 0;
+		while(q < FS_NAME_LEN && eeprom_read_byte(FS_BLK_ADDR(b) + FS_H_NAME + q) == (uint8_t)name[q]) q++;
+		if(q == FS_NAME_LEN) return b;
+	}
+	return FS_END;
+}
+
+void fs_remove(uint8_t blk){			// One byte written, the blocks are free in fs_map
+	eeprom_update_byte(FS_BLK_ADDR(blk), FS_T_DEAD);
+	while(blk != FS_END){
+		uint8_t next_ = fs_map[blk] & FS_END;
+		fs_map[blk] = FS_M_FREE;
+		fs_free += 1;
+		blk = next_;
+	}
+}
+
+uint8_t fs_write(const char *name, uint8_t tag, const uint8_t *data, uint8_t len){	// name zero padded
+	uint8_t blks_[FS_BLK_CT];
+	uint8_t need_ = FS_BLKS(len);
+	uint8_t old_ = fs_find(name);
+	uint8_t crc_ = 0;
+	
+	if(len > FS_DATA_MAX || need_ > fs_free) return Z_EE_FULL;	// Old copy stays until the new one is down
+	
+	for(uint8_t n = 0; n < need_; n++){			// Next free blocks round robin
+		while(fs_map[fs_cur] != FS_M_FREE) fs_cur = (fs_cur + 1) % FS_BLK_CT;
+		blks_[n] = fs_cur;
+		fs_cur = (fs_cur + 1) % FS_BLK_CT;
+	}
+	
+	for(uint8_t n = need_; n--;){				// Body blocks first, the head commits
+		uint8_t *ee_ = FS_BLK_ADDR(blks_[n]);
+		uint8_t off_ = (n) ? 2 : FS_HEAD_LEN;
+		uint8_t at_ = (n) ? FS_HEAD_DATA + (n - 1) * FS_BODY_DATA : 0;
+		
+		eeprom_update_byte(ee_ + FS_H_NEXT, (n + 1 < need_) ? blks_[n + 1] : FS_END);
+		for(; off_ < FS_BLK && at_ < len; off_++, at_++){
+			eeprom_update_byte(ee_ + off_, data[at_]);
+		}
+		if(n) eeprom_update_byte(ee_, FS_T_BODY);
+	}
+	
+	uint8_t *head_ = FS_BLK_ADDR(blks_[0]);
+	for(uint8_t q = 0; q < FS_NAME_LEN; q++){
+		crc_ = crc8_update(crc_, name[q]);
+		eeprom_update_byte(head_ + FS_H_NAME + q, name[q]);
+	}
+	for(uint8_t n = 0; n < len; n++){
+		crc_ = crc8_update(crc_, data[n]);
+	}
+	eeprom_update_byte(head_ + FS_H_SEQ, fs_seq);
+	eeprom_update_byte(head_ + FS_H_SEQ + 1, fs_seq >> 8);
+	eeprom_update_byte(head_ + FS_H_LEN, len);
+	eeprom_update_byte(head_ + FS_H_CRC, crc_);
+	eeprom_update_byte(head_, tag);
+	fs_seq += 1;
+	
+	if(old_ != FS_END) fs_remove(old_);
+	fs_take(blks_[0]);
+	return Z_EE_OK;
+}
+
+uint8_t fs_read(uint8_t blk, uint8_t *data){	// FS_DATA_MAX bytes of room, returns the length
+	uint8_t *ee_ = FS_BLK_ADDR(blk);
+	uint8_t len_ = eeprom_read_byte(ee_ + FS_H_LEN);
+	uint8_t off_ = FS_HEAD_LEN;
+	
+	for(uint8_t n = 0; n < len_; n++){
+		if(off_ == FS_BLK){
+			blk = fs_map[blk] & FS_END;
+			ee_ = FS_BLK_ADDR(blk);
+			off_ = 2;
+		}
+		data[n] = eeprom_read_byte(ee_ + off_++);
+	}
+	return len_;
+}
+
+// FILE, full screen: what the action did, then the directory
+//	name kind bytes		kind Z a script (Zepto text), P a preset (Timer1 state)
+//	FREE blocks bytes	data bytes the free blocks hold, a file takes up to FS_DATA_MAX
+uint8_t file_cmd(uint8_t action){
+	uint8_t buf_[FS_DATA_MAX + Z_LINE_LEN + 1];	// Tokenizer runs one word past the end
+	uint8_t blk_ = fs_find(fs_arg);
+	uint8_t ret_ = Z_EE_OK;
+	uint8_t len_;
+	
+	switch(action){
+		case FS_A_SAVE:
+			len_ = zepto_tokenize(buf_, FS_DATA_MAX);
+			ret_ = (len_ > FS_DATA_MAX) ? Z_EE_FULL : fs_write(fs_arg, FS_T_SCRIPT, buf_, len_);
+		break;
+		
+		case FS_A_PRESET:{
+			uint8_t sreg_ = SREG;
+			cli();
+			buf_[0] = pwm_stage.cs;
+			buf_[1] = pwm_stage.top;
+			buf_[2] = pwm_stage.top >> 8;
+			buf_[3] = pwm_stage.cmp;
+			buf_[4] = pwm_stage.cmp >> 8;
+			buf_[5] = pwm_stage.out;
+			SREG = sreg_;
+			ret_ = fs_write(fs_arg, FS_T_PRESET, buf_, FS_PRESET_LEN);
+		}
+		break;
+		
+		case FS_A_LOAD:
+			if(blk_ == FS_END){
+				ret_ = Z_EE_EMPTY;
+				break;
+			}
+			len_ = fs_read(blk_, buf_);
+			if(eeprom_read_byte(FS_BLK_ADDR(blk_)) == FS_T_SCRIPT){
+				ret_ = zepto_detok(buf_, len_);
+			} else
+			if(len_ == FS_PRESET_LEN && buf_[0] && buf_[0] <= T1_CS_MAX){
+				if(!pwm_wait()) return 5;
+				pwm_batch_open();				// Timing and output go live on the same edge
+				pwm_set_timing(buf_[0], buf_[1] | ((uint16_t)buf_[2] << 8), buf_[3] | ((uint16_t)buf_[4] << 8));
+				pwm_set_out(buf_[5]);
+				pwm_batch_close();
+			} else {
+				ret_ = Z_EE_BAD;
+			}
+		break;
+		
+		case FS_A_RM:
+			if(blk_ == FS_END){
+				ret_ = Z_EE_EMPTY;
+			} else {
+				fs_remove(blk_);
+			}
+		break;
+	}
+	
+	term_Set_Scroll_All();
+	term_Clear_ALL();
+	term_Set_Cursor_Pos(1, 1);
+	serialWriteStr_P(PSTR("FILE"));
+	if(action != FS_A_LS){
+		serialWrite(' ');
+		serialWriteStr(fs_arg);
+		serialWriteStr_P((ret_ == Z_EE_OK) ? PSTR(" OK") : (ret_ == Z_EE_FULL) ? PSTR(" FULL") : (ret_ == Z_EE_EMPTY) ? PSTR(" NONE") : PSTR(" ER"));
+	}
+	serialWriteStr_P(PSTR("\r\n"));
+	
+	for(uint8_t b = 0; b < FS_BLK_CT; b++){
+		if(fs_map[b] == FS_M_FREE || !(fs_map[b] & FS_M_HEAD)) continue;
+		uint8_t *ee_ = FS_BLK_ADDR(b);
+		uint8_t q;
+		for(q = 0; q < FS_NAME_LEN && eeprom_read_byte(ee_ + FS_H_NAME + q); q++){
+			serialWrite(eeprom_read_byte(ee_ + FS_H_NAME + q));
+		}
+		for(; q < FS_NAME_LEN + 1; q++){
+			serialWrite(' ');
+		}
+		serialWrite((eeprom_read_byte(ee_) == FS_T_SCRIPT) ? 'Z' : 'P');
+		serialWrite(' ');
+		term_Send_Val_Unpadded(eeprom_read_byte(ee_ + FS_H_LEN));
+		serialWriteStr_P(PSTR("\r\n"));
+	}
+	
+	serialWriteStr_P(PSTR("FREE "));
+	term_Send_Val_Unpadded(fs_free);
+	serialWrite(' ');
+	term_Send_32_as_Digits((fs_free) ? FS_HEAD_DATA + (fs_free - 1) * FS_BODY_DATA : 0, 0);
+	serialWriteStr_P(PSTR("\r\nEND, any key\r\n"));
+	serialGet();
+	return 3;							// Shell needs a full redraw
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							SEQUENCER									 //
+//////////////////////////////////////////////////////////////////////////
+
+// Runs a compiled program from the Timer2 1ms tick. STALLs become absolute
+// deadlines (previous deadline + ms), so UART or UI work in the foreground
+// can't stretch a step and errors don't accumulate. Each step's register
+// writes land within ISR latency (a few us) of its tick.
+
+#define SEQ_IDLE		0
+#define SEQ_RUN			1
+#define SEQ_BURST		32		// Max entries per tick, a STALL-less j loop yields instead of hogging the ISR
+
+volatile uint8_t seq_state = SEQ_IDLE;
+volatile uint32_t seq_ms = 0;			// Ticks since seq_start()
+uint32_t seq_deadline = 0;				// seq_ms of the next step
+ZEPTO_VM seq_vm;
+volatile uint8_t seq_stream = 0;		// Program comes from SD RUN, END means ask sd_feed()
+
+ISR(TIMER2_COMPA_vect){
+	uint16_t stall_;
+	uint8_t slice_, feed_;
+	
+	if(seq_state != SEQ_RUN){			// Plain delay, one shot
+		WAIT_FLAG_T2 = 0;
+		T2_STOP_TIMER
+		T2_NE_COMPA_ISR
+		return;
+	}
+	
+	seq_ms += 1;
+	if(seq_ms != seq_deadline) return;
+	
+	uint8_t src_ = pwm_src;				// The foreground may be half way through its own command
+	for(;;){							// SD RUN swaps to its other half in the same tick
+		slice_ = zepto_run_slice(&seq_vm, &stall_, SEQ_BURST);
+		if(slice_ != Z_SLICE_END || !seq_stream) break;
+		feed_ = sd_feed(&seq_vm);
+		if(feed_ == SD_FEED_NEXT) continue;
+		if(feed_ == SD_FEED_WAIT) slice_ = Z_SLICE_YIELD;
+		break;
+	}
+	pwm_src = src_;
+	
+	switch(slice_){
+		case Z_SLICE_STALL:
+			seq_deadline += (stall_) ? stall_ : 1;
+		break;
+		case Z_SLICE_YIELD:
+			seq_deadline += 1;
+		break;
+		default:						// Done
+			seq_state = SEQ_IDLE;
+			T2_STOP_TIMER
+			T2_NE_COMPA_ISR
+		break;
+	}
+}
+
+void seq_start(COMPILED_INSTR *prog){	// First step runs on the next tick
+	T2_STOP_TIMER
+	zepto_vm_reset(&seq_vm, prog);
+	seq_stream = 0;
+	seq_ms = 0;
+	seq_deadline = 1;
+	seq_state = SEQ_RUN;
+	T2_1MS_SETUP
+	TCCR2B = (1 << CS22);				// Free running 1ms CTC
+}
+
+void seq_stop(){
+	T2_STOP_TIMER
+	T2_NE_COMPA_ISR
+	seq_state = SEQ_IDLE;
+}
+
+// Start prog and wait for it, CTRL+X stops it. Returns 5 if stopped
+uint8_t seq_run(COMPILED_INSTR *prog){
+	seq_start(prog);
+	while(seq_state == SEQ_RUN){
+		SIM_IDLE();
+		if(serial_rx_abort()){
+			seq_stop();
+			pwm_ramp_stop();			// A ramp the program started goes too
+			return 5;
+		}
+	}
+	return 1;
+}
+
+  //////////////////////////////////////////////////////////////////////////
+ //							SD CARD										 //
+//////////////////////////////////////////////////////////////////////////
+
+// SPI mode card, CS on PC0 (A0), MOSI PB3, MISO PB4, SCK PB5. Blocks are
+// streamed a byte at a time and never buffered, a 512 byte sector costs no
+// RAM. FAT16 or FAT32, first partition or a bare volume, root directory
+// and 8.3 names only.
+//
+// SD RUN compiles the file into one half of zepto_prog while the sequencer
+// runs the other. The END closing a half makes the ISR ask sd_feed(), which
+// swaps halves inside the same tick. A half that isn't ready yet costs a
+// tick (sd_late) and every later step moves by that much.
+
+#define SD_CS_LO		PORTC &= ~(1 << PINC0);
+#define SD_CS_HI		PORTC |= (1 << PINC0);
+#define SD_BLK			512
+#define SD_HALF			(Z_PROG_LEN / 2)
+#define SD_INS_MAX		5			// Entries one line compiles to, + END slot
+#define SD_TIMEOUT		(250 * TB_TICKS_PER_MS)	// Card init, read token
+#define SD_SPI_SPINS	2000		// SPIF polls for one byte, 125kHz takes 1024 cycles
+#define SD_EOC			0x0FFFFFFFUL	// End of a cluster chain
+#define SD_ROOT16		1			// SD_FILE cl of the FAT16 root directory
+
+// sd_shell() results
+#define SD_R_OK			0
+#define SD_R_NONE		1			// No such file
+#define SD_R_NO_CARD	2
+#define SD_R_NO_FAT		3
+#define SD_R_ER			4			// Bad line / record, sd_line has it
+#define SD_R_STOP		5			// CTRL+X
+
+typedef struct{
+	uint32_t cl;				// Cluster, SD_ROOT16 or SD_EOC
+	uint32_t left;				// Bytes left
+	uint16_t sec;				// Sector in the cluster / root directory
+	uint16_t off;				// Byte in the sector
+} SD_FILE;
+
+typedef struct{
+	char name[SD_NAME_LEN];		// As on the card, no dot
+	uint32_t cl;				// First cluster
+	uint32_t len;				// Bytes
+} SD_ENT;
+
+char sd_arg[SD_NAME_LEN];
+uint8_t sd_hc = 0;				// Block addressed card
+uint8_t sd_fat32 = 0;
+uint8_t sd_spc = 1;				// Sectors per cluster
+uint16_t sd_blk_left = 0;		// Bytes left in the open block, 0 if none is open
+uint16_t sd_root_secs = 0;		// FAT16 root directory
+uint32_t sd_fat_lba = 0;
+uint32_t sd_root = 0;			// FAT16 root directory LBA, FAT32 root cluster
+uint32_t sd_data_lba = 0;		// Cluster 2
+
+SD_FILE sd_file;
+uint32_t sd_file_cl = 0;		// Start of the file for repeats
+uint32_t sd_file_len = 0;
+uint8_t sd_bin = 0;				// .BIN records instead of text lines
+uint16_t sd_repeat = 0;			// Passes left after this one
+uint16_t sd_line = 0;			// Line / record of this pass
+uint16_t sd_lines = 0;			// Compiled over all passes
+uint16_t sd_pass_lines = 0;
+COMPILED_INSTR sd_pend[SD_INS_MAX];	// Compiled line that didn't fit the last half
+uint8_t sd_pend_n = 0;
+
+volatile uint8_t sd_ready[2];	// Half of zepto_prog filled and not run to its END yet
+volatile uint8_t sd_eof = 0;	// No more halves coming
+volatile uint16_t sd_late = 0;	// Ticks the sequencer waited on the card
+uint8_t sd_spi_err = 0;			// A byte timed out or the SPI left master mode, cleared by sd_open()
+
+uint8_t sd_spi(uint8_t data){			// 0xFF and sd_spi_err once a byte fails
+	if(sd_spi_err) return 0xFF;
+	SPDR = data;
+	for(uint16_t n = SD_SPI_SPINS; !(SPSR & (1 << SPIF)); n--){
+		if(!n || !(SPCR & (1 << MSTR))){	// SS went low under us, the clock stopped
+			sd_spi_err = 1;
+			return 0xFF;
 		}
+		SIM_IDLE();
+	}
+	if(!(SPCR & (1 << MSTR))){			// SS also flags SPIF
+		sd_spi_err = 1;
+		return 0xFF;
 	}
+	return SPDR;
+}
+
+void sd_deselect(){
+	SD_CS_HI
+	sd_spi(0xFF);						// Card lets go of MISO on the next clock
+}
+
+uint8_t sd_cmd(uint8_t cmd, uint32_t arg){	// R1, 0xFF if the card never answered
+	uint8_t r1_ = 0xFF;
 	
-	zepto_frame_cleanup();
+	SD_CS_LO
+	sd_spi(0xFF);
+	sd_spi(0x40 | cmd);
+	for(int8_t sh_ = 24; sh_ >= 0; sh_ -= 8){
+		sd_spi(arg >> sh_);
+	}
+	sd_spi((cmd == 0) ? 0x95 : (cmd == 8) ? 0x87 : 0x01);	// Only these two are checked in SPI mode
+	for(uint8_t n = 0; n < 10 && (r1_ & 0x80); n++){
+		r1_ = sd_spi(0xFF);
+	}
+	return r1_;
+}
+
+uint8_t sd_init(){						// 1 if a card is ready
+	uint8_t r1_;
+	uint8_t v2_ = 0;
+	uint32_t t_start = timebase_now();
+	
+	SD_CS_HI
+	DDRC |= (1 << PINC0);
+	DDRB |= (1 << PINB3) | (1 << PINB5);
+	SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);	// 125kHz until it's up
+	SPSR = 0x00;
+	sd_spi_err = 0;
+	sd_blk_left = 0;
+	for(uint8_t n = 0; n < 10; n++){	// 80 clocks with CS high
+		sd_spi(0xFF);
+	}
+	
+	r1_ = sd_cmd(0, 0);
+	sd_deselect();
+	if(r1_ != 0x01) return 0;
+	
+	if(sd_cmd(8, 0x1AA) == 0x01){		// v2 card, rest of R7 ends in the check pattern
+		sd_spi(0xFF);
+		sd_spi(0xFF);
+		sd_spi(0xFF);
+		v2_ = (sd_spi(0xFF) == 0xAA);
+		if(!v2_){
+			sd_deselect();
+			return 0;
+		}
+	}
+	sd_deselect();
+	
+	do{
+		sd_cmd(55, 0);
+		sd_deselect();
+		r1_ = sd_cmd(41, (v2_) ? 0x40000000UL : 0);	// HCS
+		sd_deselect();
+		if(timebase_now() - t_start > SD_TIMEOUT) return 0;
+	} while(r1_);
+	
+	sd_hc = 0;
+	if(v2_){
+		if(sd_cmd(58, 0)) {
+			sd_deselect();
+			return 0;
+		}
+		sd_hc = (sd_spi(0xFF) & 0x40) ? 1 : 0;	// CCS
+		sd_spi(0xFF);
+		sd_spi(0xFF);
+		sd_spi(0xFF);
+		sd_deselect();
+	}
+	if(!sd_hc){
+		r1_ = sd_cmd(16, SD_BLK);
+		sd_deselect();
+		if(r1_) return 0;
+	}
+	
+	SPCR = (1 << SPE) | (1 << MSTR);	// F_CPU / 2
+	SPSR = (1 << SPI2X);
+	return !sd_spi_err;
 }
 
+uint8_t sd_byte(){						// Next byte of the open block, closes it after the last
+	uint8_t data_ = sd_spi(0xFF);
+	sd_blk_left -= 1;
+	if(!sd_blk_left){
+		sd_spi(0xFF);					// CRC
+		sd_spi(0xFF);
+		sd_deselect();
+	}
+	return data_;
+}
 
+void sd_close(){
+	while(sd_blk_left) sd_byte();
+}
 
-uint8_t last_char(const char str[Z_LINE_LEN][Z_LINE_CT], uint8_t row_){
-	uint8_t n;
-	for(n = 0; n < Z_LINE_LEN - 1; n++){
-		if(!str[n][row_]) break;
+uint8_t sd_open(uint32_t lba){			// 1 once the data token is in, sd_byte() from there
+	uint32_t t_start = timebase_now();
+	uint8_t tok_;
+	
+	sd_close();
+	sd_spi_err = 0;
+	if(sd_cmd(17, (sd_hc) ? lba : lba << 9)){
+		sd_deselect();
+		return 0;
 	}
-	return n ;
+	do{
+		tok_ = sd_spi(0xFF);
+		if(timebase_now() - t_start > SD_TIMEOUT){
+			sd_deselect();
+			return 0;
+		}
+	} while(tok_ == 0xFF);
+	if(tok_ != 0xFE){
+		sd_deselect();
+		return 0;
+	}
+	sd_blk_left = SD_BLK;
+	return 1;
 }
 
-void zepto_frame_print(){
-	const char zepto_nametag[] = "ZEPTO\0";
+uint8_t sd_read(uint32_t lba, uint16_t off, uint8_t *buf, uint8_t len){
+	if(!sd_open(lba)) return 0;
+	for(; off; off--){
+		sd_byte();
+	}
+	for(uint8_t n = 0; n < len; n++){
+		buf[n] = sd_byte();
+	}
+	sd_close();
+	return !sd_spi_err;
+}
+
+uint32_t sd_le(const uint8_t *buf, uint8_t len){	// Little endian field
+	uint32_t val_ = 0;
+	while(len--) val_ = (val_ << 8) | buf[len];
+	return val_;
+}
+
+uint8_t sd_mount(){						// SD_R_OK, SD_R_NO_CARD or SD_R_NO_FAT
+	uint8_t bpb_[8];					// A few BPB fields per read, the sector never sits on the stack
+	uint32_t part_ = 0;
+	uint32_t fat_sz, total_, ents_;
+	uint8_t fats_;
 	
-	for(uint8_t n = 0; n < Z_LINE_CT; n++){
-		term_Set_Cursor_Pos(n + ZEPTO_H + 1, ZEPTO_W + 1);
-		term_Send_Val_as_Digits(n + 1);
+	if(!sd_init() || !sd_read(0, 0, bpb_, 1) || !sd_read(0, 0x0B, &bpb_[1], 2)) return SD_R_NO_CARD;
+	if(!(bpb_[0] == 0xEB || bpb_[0] == 0xE9) || sd_le(&bpb_[1], 2) != SD_BLK){	// MBR, take the first partition
+		if(!sd_read(0, 0x1C6, bpb_, 4)) return SD_R_NO_CARD;
+		part_ = sd_le(bpb_, 4);
 	}
+	if(!sd_read(part_, 0x0B, bpb_, 8)) return SD_R_NO_CARD;	// 0x0B - 0x12
+	if(sd_le(bpb_, 2) != SD_BLK || !bpb_[2] || !bpb_[5]) return SD_R_NO_FAT;
 	
-	for(uint8_t n = ZEPTO_H; n < TERM_H; n++){
-		term_Set_Cursor_Pos(n, ZEPTO_W);
-		serialWrite('#');
-		serialWrite(' ');
+	sd_spc = bpb_[2];
+	sd_fat_lba = part_ + sd_le(&bpb_[3], 2);
+	fats_ = bpb_[5];
+	ents_ = sd_le(&bpb_[6], 2);
+	if(!sd_read(part_, 0x13, bpb_, 5)) return SD_R_NO_CARD;	// 0x13 - 0x17
+	total_ = sd_le(bpb_, 2);
+	fat_sz = sd_le(&bpb_[3], 2);
+	if(!total_ || !fat_sz){				// 32 bit fields, big FAT16 or FAT32
+		if(!sd_read(part_, 0x20, bpb_, 8)) return SD_R_NO_CARD;	// 0x20 - 0x27
+		if(!total_) total_ = sd_le(bpb_, 4);
+		if(!fat_sz) fat_sz = sd_le(&bpb_[4], 4);
 	}
+	sd_root = sd_fat_lba + fats_ * fat_sz;
+	sd_root_secs = (ents_ * 32 + SD_BLK - 1) / SD_BLK;
+	sd_data_lba = sd_root + sd_root_secs;
 	
-	term_Set_Cursor_Pos(ZEPTO_H + 1, TERM_W - sizeof(zepto_nametag));
-	serialWriteStr(zepto_nametag);
+	total_ = (total_ - (sd_data_lba - part_)) / sd_spc;	// Clusters decide the FAT type
+	if(total_ < 4085) return SD_R_NO_FAT;					// FAT12
+	sd_fat32 = (total_ >= 65525);
+	if(sd_fat32){
+		if(!sd_read(part_, 0x2C, bpb_, 4)) return SD_R_NO_CARD;
+		sd_root = sd_le(bpb_, 4);
+	}
+	return SD_R_OK;
 }
 
-void zepto_frame_cleanup(){
-	for(uint8_t n = ZEPTO_H; n < TERM_H; n++){
-		term_Set_Cursor_Pos(n, ZEPTO_W);
+uint32_t fat_next(uint32_t cl){
+	uint8_t buf_[4];
+	uint32_t at_ = cl << ((sd_fat32) ? 2 : 1);
+	
+	if(!sd_read(sd_fat_lba + (at_ / SD_BLK), at_ % SD_BLK, buf_, (sd_fat32) ? 4 : 2)) return SD_EOC;
+	if(sd_fat32){
+		cl = sd_le(buf_, 4) & 0x0FFFFFFFUL;
+	} else {
+		cl = sd_le(buf_, 2);
+		if(cl >= 0xFFF8) cl = SD_EOC;
+	}
+	return (cl < 2 || cl >= 0x0FFFFFF8UL) ? SD_EOC : cl;
+}
+
+uint8_t fat_getc(SD_FILE *f, uint8_t *data){	// 0 at the end of the file or on a card error
+	if(!f->left || f->cl == SD_EOC) return 0;
+	if(!sd_blk_left){
+		uint32_t lba_ = (f->cl == SD_ROOT16) ? sd_root + f->sec : sd_data_lba + (f->cl - 2) * sd_spc + f->sec;
+		if(!sd_open(lba_)){
+			f->cl = SD_EOC;
+			return 0;
+		}
+	}
+	
+	*data = sd_byte();
+	if(sd_spi_err){						// Whatever came in is garbage
+		sd_close();
+		f->cl = SD_EOC;
+		return 0;
+	}
+	f->left -= 1;
+	f->off += 1;
+	if(f->off == SD_BLK){				// sd_byte() closed the block
+		f->off = 0;
+		f->sec += 1;
+		if(f->cl == SD_ROOT16){
+			if(f->sec == sd_root_secs) f->cl = SD_EOC;
+		} else
+		if(f->sec == sd_spc){
+			f->sec = 0;
+			f->cl = fat_next(f->cl);
+		}
+	} else
+	if(!f->left){
+		sd_close();
+	}
+	return 1;
+}
+
+void fat_open(SD_FILE *f, uint32_t cl, uint32_t len){	// cl 0 opens the root directory
+	if(!cl){
+		cl = (sd_fat32) ? sd_root : SD_ROOT16;
+		len = 0xFFFFFFFFUL;
+	}
+	f->cl = (cl == SD_ROOT16 || cl >= 2) ? cl : SD_EOC;
+	f->left = len;
+	f->sec = 0;
+	f->off = 0;
+}
+
+uint8_t fat_dir_next(SD_FILE *dir, SD_ENT *ent){	// Next plain file, 0 at the end
+	uint8_t data_, attr_ = 0;
+	
+	while(1){
+		ent->cl = 0;
+		ent->len = 0;
+		for(uint8_t n = 0; n < 32; n++){	// Only the fields used are kept of the 32 bytes
+			if(!fat_getc(dir, &data_)) return 0;
+			if(n < SD_NAME_LEN){
+				ent->name[n] = data_;
+			} else
+			if(n == 11){
+				attr_ = data_;
+			} else
+			if((n == 20 || n == 21) && sd_fat32){
+				ent->cl |= (uint32_t)data_ << (8 * (n - 18));
+			} else
+			if(n == 26 || n == 27){
+				ent->cl |= (uint32_t)data_ << (8 * (n - 26));
+			} else
+			if(n >= 28){
+				ent->len |= (uint32_t)data_ << (8 * (n - 28));
+			}
+		}
+		if(!ent->name[0]){				// Nothing used after this one
+			sd_close();
+			return 0;
+		}
+		if((uint8_t)ent->name[0] == 0xE5 || (attr_ & 0x18)) continue;	// Deleted, volume label, directory, long name
+		return 1;
+	}
+}
+
+uint8_t sd_gets(char *line){			// Chars in the line, more than MAX_ENTRY_LEN if it was cut, 0xFF at the end
+	uint8_t n_ = 0;
+	uint8_t data_;
+	
+	while(fat_getc(&sd_file, &data_)){
+		if(data_ == '\n'){
+			line[(n_ > MAX_ENTRY_LEN) ? MAX_ENTRY_LEN : n_] = 0x00;
+			return n_;
+		}
+		if(data_ != '\r' && n_ < MAX_ENTRY_LEN + 1){
+			if(n_ < MAX_ENTRY_LEN) line[n_] = data_;
+			n_ += 1;
+		}
+	}
+	line[(n_ > MAX_ENTRY_LEN) ? MAX_ENTRY_LEN : n_] = 0x00;
+	return (n_) ? n_ : 0xFF;				// Last line without a newline still counts
+}
+
+// Next line / record of the file compiled into sd_pend, repeats start over
+// at the end. SD_R_OK, SD_R_NONE at the real end, or SD_R_ER
+uint8_t sd_next(){
+	char line_[MAX_ENTRY_LEN + 1];
+	INSTRUCT_STRUCT ins_;
+	uint8_t len_, at_ = 0, wlen_;
+	
+	while(1){
+		if(sd_bin){
+			uint8_t rec_[4];
+			for(len_ = 0; len_ < sizeof(rec_) && fat_getc(&sd_file, &rec_[len_]); len_++);
+			if(len_ && len_ < sizeof(rec_)) return SD_R_ER;		// Cut short
+			len_ = (len_) ? 1 : 0xFF;
+			ins_.OPCODE = rec_[0];
+			ins_.ARG = rec_[1];
+			ins_.DATA = rec_[2] | ((uint16_t)rec_[3] << 8);
+			ins_.TIME = 0;
+		} else {
+			len_ = sd_gets(line_);
+		}
 		
-		for(uint8_t m = ZEPTO_W; m < TERM_W - 1; m++){
-			serialWrite(' ');		
+		if(len_ == 0xFF){				// End of this pass
+			if(sd_file.left) return SD_R_ER;			// Card went away
+			if(!sd_repeat || !sd_pass_lines) return SD_R_NONE;
+			sd_repeat -= 1;
+			sd_pass_lines = 0;
+			sd_line = 0;
+			sd_close();
+			fat_open(&sd_file, sd_file_cl, sd_file_len);
+			continue;
 		}
-	}	
+		sd_line += 1;
+		
+		if(sd_bin){
+			if(bin_check(&ins_)) return SD_R_ER;
+		} else {
+			parse_base = line_;
+			for(at_ = 0; line_[at_] == ' '; at_++);
+			if(!line_[at_] || line_[at_] == '#') continue;			// Blank, comment of any length
+			if(len_ > MAX_ENTRY_LEN) return SD_R_ER;
+			z_word(&line_[at_], &wlen_);
+			if(z_ctl_word(&line_[at_], wlen_)){					// No lines to jump to
+				parse_fail(&line_[at_], PE_WORD);
+				return SD_R_ER;
+			}
+			if(parse_entry(line_, 0, &ins_) != 1) return SD_R_ER;
+		}
+		
+		sd_pend_n = 0;
+		if(!z_compile_ins(sd_pend, &sd_pend_n, SD_INS_MAX, &ins_)){
+			if(!sd_bin) parse_fail(&line_[at_], PE_ALONE);
+			return SD_R_ER;
+		}
+		sd_lines += 1;
+		sd_pass_lines += 1;
+		return SD_R_OK;
+	}
 }
 
-void zepto_help_menu(){
-	static uint8_t wr_o_cl = 0;
+uint8_t sd_fill(uint8_t half){			// Compile into an idle half, SD_R_OK or SD_R_ER
+	COMPILED_INSTR *prog_ = &zepto_prog[half * SD_HALF];
+	uint8_t n_ = 0;
+	uint8_t ret_ = SD_R_OK;
+	
+	while(1){
+		if(!sd_pend_n){
+			ret_ = sd_next();
+			if(ret_ != SD_R_OK) break;
+		}
+		if(n_ + sd_pend_n > SD_HALF - 1) break;	// Keep it for the next half
+		for(uint8_t q = 0; q < sd_pend_n; q++){
+			prog_[n_++] = sd_pend[q];
+		}
+		sd_pend_n = 0;
+	}
+	if(ret_ == SD_R_ER) return ret_;
 	
-	const char zep_help_0[] = "CTRL+R: Interpret\0";
-	const char zep_help_1[] = "CTRL+E: Compile\0";
-	const char zep_help_2[] = "CTRL+N: Clear\0";
-	const char zep_help_3[] = "CTRL+X: Exit\0";
+	if(n_){
+		prog_[n_].addr = Z_OP(ZOP_END);
+		prog_[n_].data = 0;
+		sd_ready[half] = 1;
+	}
+	if(ret_ == SD_R_NONE) sd_eof = 1;			// After the last half went ready
+	return SD_R_OK;
+}
+
+uint8_t sd_feed(ZEPTO_VM *vm){			// Timer2 ISR, the running half hit its END. SD_FEED_x
+	uint8_t half_ = (vm->prog == zepto_prog) ? 0 : 1;
 	
-	wr_o_cl = (wr_o_cl) ? 0 : 1;
+	if(sd_ready[half_ ^ 1]){
+		sd_ready[half_] = 0;			// Foreground may refill it now
+		vm->prog = &zepto_prog[(half_ ^ 1) * SD_HALF];
+		vm->pc = 0;
+		return SD_FEED_NEXT;
+	}
+	if(sd_eof) return SD_FEED_END;
+	sd_late += 1;
+	return SD_FEED_WAIT;
+}
+
+uint8_t sd_run(uint16_t repeat){		// sd_file is open
+	uint8_t ret_;
 	
-	// Help -> TERM_W - 18
-	if(wr_o_cl){
-		term_Set_Cursor_Pos(TERM_H - 10, TERM_W - 18);
-		serialWriteStr(zep_help_0);
-		term_Set_Cursor_Pos(TERM_H - 9, TERM_W - 18);
-		serialWriteStr(zep_help_1);
-		term_Set_Cursor_Pos(TERM_H - 8, TERM_W - 18);
-		serialWriteStr(zep_help_2);
-		term_Set_Cursor_Pos(TERM_H - 7, TERM_W - 18);
-		serialWriteStr(zep_help_3);
-	} else {
-		for(uint8_t n = 0; n < 4; n++){
-			term_Set_Cursor_Pos(TERM_H - (10 - n), TERM_W - 18);
-			for(uint8_t m = 0; m < 17; m++){
-				serialWrite(' ');
+	sd_repeat = repeat - 1;
+	sd_line = 0;
+	sd_lines = 0;
+	sd_pass_lines = 0;
+	sd_pend_n = 0;
+	sd_ready[0] = 0;
+	sd_ready[1] = 0;
+	sd_eof = 0;
+	sd_late = 0;
+	
+	ui_quiet = 1;						// parse_entry() keeps off the screen
+	ret_ = sd_fill(0);
+	if(ret_ == SD_R_OK && !sd_eof) ret_ = sd_fill(1);
+	if(ret_ == SD_R_OK && sd_ready[0]){
+		uint8_t sreg_ = SREG;
+		cli();
+		seq_start(zepto_prog);
+		seq_stream = 1;
+		SREG = sreg_;
+		
+		while(seq_state == SEQ_RUN){
+			SIM_IDLE();
+			if(serial_rx_abort()){
+				seq_stop();
+				pwm_ramp_stop();
+				ret_ = SD_R_STOP;
+				break;
+			}
+			for(uint8_t h = 0; h < 2 && !sd_eof; h++){
+				if(!sd_ready[h]) ret_ = sd_fill(h);
+			}
+			if(ret_ != SD_R_OK){
+				seq_stop();
+				break;
 			}
 		}
 	}
+	ui_quiet = 0;
+	return ret_;
+}
+
+uint8_t sd_load(){						// sd_file is open, text lines to zepto_array as they are
+	char line_[MAX_ENTRY_LEN + 1];
+	uint8_t len_;
+	uint8_t row_ = 0;
+	
+	for(uint8_t n = 0; n < Z_LINE_CT; n++){
+		for(uint8_t m = 0; m < Z_LINE_LEN; m++){
+			if(zepto_array[m][n]) z_dirty |= (1UL << n);
+			zepto_array[m][n] = 0x00;
+		}
+	}
+	
+	sd_line = 0;
+	while((len_ = sd_gets(line_)) != 0xFF){
+		sd_line += 1;
+		if(len_ > Z_LINE_LEN || row_ == Z_LINE_CT) return SD_R_ER;
+		for(uint8_t q = 0; q < len_; q++){
+			zepto_array[q][row_] = (line_[q] >= 'A' && line_[q] <= 'Z') ? line_[q] - ('A' - 'a') : line_[q];
+		}
+		z_dirty |= (1UL << row_);
+		row_ += 1;
+	}
+	return SD_R_OK;
+}
+
+void sd_name_print(const char *name){	// 8.3 entry name with the dot back in
+	uint8_t q;
+	for(q = 0; q < 8 && name[q] != ' '; q++){
+		serialWrite(name[q]);
+	}
+	if(name[8] != ' ') serialWrite('.');
+	for(q = 8; q < SD_NAME_LEN && name[q] != ' '; q++){
+		serialWrite(name[q]);
+	}
+}
+
+// Directory walks have their own frames, the entry and the directory aren't
+// on the stack under sd_run()
+uint8_t sd_find(){						// sd_arg into sd_file_*, SD_R_OK or SD_R_NONE
+	SD_ENT ent_;
+	SD_FILE dir_;
+	uint8_t ret_ = SD_R_NONE;
+	
+	fat_open(&dir_, 0, 0);
+	while(fat_dir_next(&dir_, &ent_)){
+		uint8_t q;
+		for(q = 0; q < SD_NAME_LEN && ent_.name[q] == sd_arg[q]; q++);
+		if(q == SD_NAME_LEN){
+			sd_file_cl = ent_.cl;
+			sd_file_len = ent_.len;
+			sd_bin = (ent_.name[8] == 'B' && ent_.name[9] == 'I' && ent_.name[10] == 'N');
+			ret_ = SD_R_OK;
+			break;
+		}
+	}
+	sd_close();
+	return ret_;
+}
+
+void sd_list(){
+	SD_ENT ent_;
+	SD_FILE dir_;
+	
+	fat_open(&dir_, 0, 0);
+	while(fat_dir_next(&dir_, &ent_)){
+		sd_name_print(ent_.name);
+		serialWriteStr_P(PSTR("\t"));
+		term_Send_32_as_Digits(ent_.len, 0);
+		serialWriteStr_P(PSTR("\r\n"));
+	}
+	sd_close();
+}
+
+uint8_t sd_shell(uint8_t action, uint16_t repeat){
+	pwm_pb2_hold(1);
+	uint8_t ret_ = sd_mount();
+	
+	if(ret_ == SD_R_OK && action != SD_A_LS) ret_ = sd_find();
+	if(ret_ == SD_R_OK && action != SD_A_LS){
+		fat_open(&sd_file, sd_file_cl, sd_file_len);
+		if(action == SD_A_RUN){
+			ret_ = sd_run(repeat);
+		} else {
+			ret_ = (sd_bin) ? SD_R_ER : sd_load();
+		}
+		sd_close();
+	}
+	
+	term_Set_Scroll_All();
+	term_Clear_ALL();
+	term_Set_Cursor_Pos(1, 1);
+	serialWriteStr_P(PSTR("SD"));
+	if(action != SD_A_LS){
+		serialWrite(' ');
+		sd_name_print(sd_arg);
+	}
+	switch(ret_){
+		case SD_R_OK:		serialWriteStr_P(PSTR(" OK"));		break;
+		case SD_R_NONE:		serialWriteStr_P(PSTR(" NONE"));	break;
+		case SD_R_NO_CARD:	serialWriteStr_P(PSTR(" NO CARD"));	break;
+		case SD_R_NO_FAT:	serialWriteStr_P(PSTR(" NO FAT"));	break;
+		case SD_R_STOP:		serialWriteStr_P(PSTR(" STOP"));	break;
+		default:
+			serialWriteStr_P(PSTR(" ER line "));
+			term_Send_32_as_Digits(sd_line, 0);
+			if(parse_err){
+				serialWrite(' ');
+				parse_err_send();
+			}
+		break;
+	}
+	if(action == SD_A_RUN && (ret_ == SD_R_OK || ret_ == SD_R_STOP)){
+		serialWriteStr_P(PSTR(" lines "));
+		term_Send_32_as_Digits(sd_lines, 0);
+		serialWriteStr_P(PSTR(" late "));
+		term_Send_32_as_Digits(sd_late, 0);
+	}
+	serialWriteStr_P(PSTR("\r\n"));
 	
+	if(ret_ != SD_R_NO_CARD && ret_ != SD_R_NO_FAT) sd_list();
+	pwm_pb2_hold(0);
+	
+	serialWriteStr_P(PSTR("END, any key\r\n"));
+	serialGet();
+	return 3;							// Shell needs a full redraw
 }
 
+
 #undef Z_LINE_LEN
 #undef Z_LINE_CT
 
@@ -1363,217 +5200,41 @@ void printBarFrame(uint8_t top, uint8_t right, uint8_t internalWidth){
 	term_Set_Cursor_Pos(top, right);
 	
 	serialWrite('+');
-
-	for(uint8_t n = 0; n < internalWidth; n++){
-		serialWrite('-');
-	}
-
-	serialWrite('+');
-
-	term_Set_Cursor_Pos(top + 1, right);
-	serialWrite('|');
-
-	term_Set_Cursor_Pos(top + 1, right + 1 + internalWidth);
-	serialWrite('|');
-
-	term_Set_Cursor_Pos(top + 2, right);
-	serialWrite('+');
-
-	for(uint8_t n = 0; n < internalWidth; n++){
-		serialWrite('-');
-	}
-
-	serialWrite('+');
-	term_Set_Cursor_Pos(TERM_H, TERM_W);
-}
-
-void updateBarValue(uint8_t top, uint8_t right, uint8_t internalWidth, uint8_t oldPos, uint8_t newPos){
-	if(newPos > internalWidth){
-		return;
-	}
-	term_Set_Cursor_Pos(top + 1, right + 1 + newPos);
-	serialWrite('#');
-
-	term_Set_Cursor_Pos(top + 1, right + 1 + oldPos);
-	serialWrite(' ');
-
-	term_Set_Cursor_Pos(TERM_H, TERM_W);
-}
-
-uint8_t ret_WGM_ptr(uint8_t timer_no){			// Return the WGM mode of Timer 1/2
-	uint8_t tmp__;
-	if(timer_no == 1){
-		tmp__ = TCCR1A & ((1 << WGM11) | (1 << WGM10));
-		tmp__ |= (TCCR1B & ((1 << WGM13) | (1 << WGM12))) >> 1;
-		// Should now have a 4 bit value consisting of every WGM bit
-		switch(tmp__){
-			case 0:					// Disconnected
-			return 0;
-			case 11:				// Phase Correct, TOP at OCR1A
-			return 3;
-			case 4:					// CTC, TOP at OCR1A
-			return 1;
-			case 15:				// 16 Bit Fast PWM, TOP at OCR1A
-			return 2;
-			default:				// IF something weird happens or bad input, turn timer off
-			TCCR1A &= ~((1 << WGM11) | (1 << WGM10));
-			TCCR1B &= ~((1 << WGM13) | (1 << WGM12));
-			return 0;
-		}
-	} else
-	if(timer_no == 2){
-		tmp__ = TCCR2A & ((1 << WGM21) | (1 << WGM20));
-		tmp__ |= (TCCR2B & (1 << WGM22)) >> 1;
-		// Should now have 3 bit value of every WGM mode timer 2 supports
-		// Timer 2 Relevant Modes
-		switch(tmp__){
-			case 0:
-			return 0;		// Disconnected
-			case 5:
-			return 3;		// 8 Bit Phase Correct, TOP at OCR2A
-			case 2:
-			return 1;		// CTC, TOP at OCR2A
-			case 7:
-			return 2;		// 8 Bit Fast PWM, TOP at OCR2A
-			default:
-			TCCR2A &= ~((1 << WGM21) | (1 << WGM20));
-			TCCR2B &= ~(1 << WGM22);
-			return 0;
-		}
-		
-		} else {
-		return 0;
-	}
-}
-
-uint8_t ret_CSX_ptr(uint8_t timer_no){			// Return value relating to the current prescalar on Timer 1/2
-	if(timer_no == 1){
-		switch(TCCR1B & 0b00000111){			// Only some prescale are available for timer 1
-			case 0:
-			case 1:
-			case 2:
-			return TCCR1B & 0b00000111;
-			case 3:
-			return 4;
-			case 4:
-			return 6;
-			case 5:
-			return 7;
-			default:
-			return 0;
-		}
-	} else
-	if(timer_no == 2){
-		return TCCR2B & 0b00000111;				// Every prescale is available on timer 2
+
+	for(uint8_t n = 0; n < internalWidth; n++){
+		serialWrite('-');
 	}
-	return 0;
-}
 
+	serialWrite('+');
 
+	term_Set_Cursor_Pos(top + 1, right);
+	serialWrite('|');
 
+	term_Set_Cursor_Pos(top + 1, right + 1 + internalWidth);
+	serialWrite('|');
 
+	term_Set_Cursor_Pos(top + 2, right);
+	serialWrite('+');
 
-void find_T_(uint8_t timer_num, char *arrayZ, uint8_t arrayZ_size){
-	uint8_t ckspd = ret_CSX_ptr(timer_num);
-	uint8_t mode_ = ret_WGM_ptr(timer_num);
-	
-	if(ckspd == 0 || mode_ == 0){
-		for(uint8_t n = 0; n < arrayZ_size - 3; n++){
-			arrayZ[n] = '0';
-		}
-		arrayZ[arrayZ_size - 1] = 's';
-	} else
-	if(timer_num == 1){
-		
-	} else
-	if(timer_num == 2){
-		
+	for(uint8_t n = 0; n < internalWidth; n++){
+		serialWrite('-');
 	}
+
+	serialWrite('+');
+	term_Set_Cursor_Pos(TERM_H, TERM_W);
 }
 
-float find_freq_tim_X_(uint8_t timer_no, uint8_t clk_spd__, uint8_t _mode__){
-	float cks__;
-	switch(clk_spd__){
-		case 1:
-		cks__ = 16000000.0f;
-		break;
-		case 2:
-		cks__ = 2000000.0f;
-		break;
-		case 3:
-		cks__ = 500000.0f;
-		break;
-		case 4:
-		cks__ = 250000.0f;
-		break;
-		case 5:
-		cks__ = 125500.0f;
-		break;
-		case 6:
-		cks__ = 62500.0f;
-		break;
-		case 7:
-		cks__ = 15625.0f;
-		break;
-		default:
-		return 0;
-		break;
-	}
-	// CTC Timer 1:		f_OCnA = 16M / (2 * pre * (1 + OCRnA))		SAME for timer 2
-	// FPWM Timer 1:	f_OCnX = 16M / (pre * (1 + TOP))			SAME for timer 2
-	// PPWM Timer 1:	f_OCnX = 16M / (2 * pre * TOP)				SAME for timer 2
-	//
-	// TOP == OCR1A and OCR2A
-	// Since we divided 16M by pre already we can just do:
-	//
-	//	CTC:		f = cks__ * (1 / 2(1 + OCRnA))
-	//	FPWM:		f = cks__ * (1 / (1 + TOP))
-	//	PPWM:		f = cks__ * (1 / (2 * TOP))
-	if(timer_no == 1){
-		switch(_mode__){
-			case 1:											// CTC
-			return cks__ * (1 / (2.0f * ((float)OCR1A) + 1.0f));
-			case 2:											// Fast PWM
-			return cks__ * (1 / ((float)OCR1A));
-			case 3:											// Phase Correct
-			return cks__ * (1 / (2.0f * ((float)OCR1A + 1.0f)));
-			default:
-			return 0;
-		}
-	} else
-	if(timer_no == 2){
-		switch(_mode__){
-			case 1:											// CTC
-			return cks__ * (1 / (2.0f * (float)(1 + OCR2A)));
-			case 2:											// Fast PWM
-			return cks__ * (1 / (float)(OCR2A));
-			case 3:											// Phase Correct
-			return cks__ * (1 / (2.0f * (float)OCR2A));
-			default:
-			return 0;
-		}
-		} else {
-		return 0;
+void updateBarValue(uint8_t top, uint8_t right, uint8_t internalWidth, uint8_t oldPos, uint8_t newPos){
+	if(newPos > internalWidth){
+		return;
 	}
-}
+	term_Set_Cursor_Pos(top + 1, right + 1 + newPos);
+	serialWrite('#');
 
-// dtostrf(float_value, min_width, num_digits_after_decimal, where_to_store_string)
+	term_Set_Cursor_Pos(top + 1, right + 1 + oldPos);
+	serialWrite(' ');
 
-void prep_F_print(uint8_t timer_no, uint8_t clk_spd__, uint8_t _mode__, char *output_f_, char *output_t_, char *output_t_hi_){
-	float vv__ = find_freq_tim_X_(timer_no, clk_spd__, _mode__);
-	
-	float tmp__;
-	
-	dtostrf(vv__, 12, 3, output_f_);
-	dtostrf((1.0f / vv__), 12, 11, output_t_);
-	if(timer_no == 1){
-		tmp__ = (float)OCR1B / (float)OCR1A;		// Get ratio of ON to OFF time
-		dtostrf(tmp__ * (1.0f / vv__), 12, 11, output_t_hi_);
-	} else
-	if(timer_no == 2){
-		tmp__ = (float)OCR2B / (float)OCR2A;		// Get ratio of ON to OFF time
-		dtostrf(tmp__ * (1.0f / vv__), 12, 11, output_t_hi_);
-	}
+	term_Set_Cursor_Pos(TERM_H, TERM_W);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -1590,8 +5251,8 @@ void init_serial(unsigned int someVal){         // Debug for use with developmen
 	//UBRR0L = 8;		// 115200 BAUD
 
 
-	// Enable Tx and Rx
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	// Enable Tx and Rx, Rx lands in rx_ring via ISR
+	UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
 
 	// Setup 8N2 format // Change to 8N1 later
 	//UCSR0C = (1 << USBS0) | (3 << UCSZ00);
@@ -1601,18 +5262,101 @@ void init_serial(unsigned int someVal){         // Debug for use with developmen
 }
 
 
+// TX ring buffer, drained by the UDRE interrupt.
+// serialWrite() only blocks when the ring is full (backpressure), so
+// register updates are no longer stuck behind a screen redraw.
+// TX_RING_SZ must be a power of 2 <= 256
+#define TX_RING_SZ		128
+#define TX_RING_MASK	(TX_RING_SZ - 1)
+
+volatile uint8_t tx_ring[TX_RING_SZ];
+volatile uint8_t tx_head = 0;					// Next free slot, written by foreground only
+volatile uint8_t tx_tail = 0;					// Next byte to send, written by ISR only
+
+ISR(USART_UDRE_vect){
+	if(tx_head != tx_tail){
+		UDR0 = tx_ring[tx_tail];
+		tx_tail = (tx_tail + 1) & TX_RING_MASK;
+	}
+	if(tx_head == tx_tail){
+		UCSR0B &= ~(1 << UDRIE0);				// Ring empty, stop UDRE interrupts
+	}
+}
+
+uint8_t serialTryWrite(unsigned char data){
+	uint8_t next = (tx_head + 1) & TX_RING_MASK;
+	if(next == tx_tail) return 0;				// Full, caller decides what to do
+	tx_ring[tx_head] = data;
+	tx_head = next;
+	UCSR0B |= (1 << UDRIE0);					// Kick the ISR, harmless if already running
+	return 1;
+}
+
 void serialWrite(unsigned char data){
-	cli();
-	while(!(UCSR0A & (1 << UDRE0)));			// Wait for empty transmit buffer
-	UDR0 = data;
-	sei();
+	term_track(data);							// Keep the cursor position for term_Set_Cursor_Pos()
+	while(!serialTryWrite(data)) SIM_IDLE();	// Wait for the ISR to free a slot
+}
+
+uint8_t serialTxUsed(){
+	return (tx_head - tx_tail) & TX_RING_MASK;
+}
+
+uint8_t serialTxFree(){
+	return (TX_RING_SZ - 1) - serialTxUsed();
+}
+
+void serialFlush(){							// Returns once the last byte is in the UART (<= 1 byte time left)
+	while(tx_head != tx_tail) SIM_IDLE();		// Wait for ring to drain
+	while(!(UCSR0A & (1 << UDRE0))) SIM_IDLE();
+}
+
+// RX ring buffer, filled by the RX complete interrupt so nothing typed
+// during a STALL or Zepto run is lost. RX_RING_SZ must be a power of 2
+#define RX_RING_SZ		64
+#define RX_RING_MASK	(RX_RING_SZ - 1)
+
+volatile uint8_t rx_ring[RX_RING_SZ];
+volatile uint8_t rx_head = 0;					// Next free slot, written by ISR only
+volatile uint8_t rx_tail = 0;					// Next byte to read, written by foreground only
+volatile uint8_t rx_overrun = 0;				// Bytes dropped because the ring was full
+
+ISR(USART_RX_vect){
+	uint8_t data_ = UDR0;
+	rx_stamp = timebase_now();
+	uint8_t next = (rx_head + 1) & RX_RING_MASK;
+	if(next != rx_tail){
+		rx_ring[rx_head] = data_;
+		rx_head = next;
+	} else {
+		rx_overrun += 1;
+	}
+}
+
+uint8_t serialAvailable(){
+	return (rx_head - rx_tail) & RX_RING_MASK;
+}
+
+uint8_t serialTryGet(uint8_t *data){
+	if(rx_head == rx_tail) return 0;
+	*data = rx_ring[rx_tail];
+	rx_tail = (rx_tail + 1) & RX_RING_MASK;
+	return 1;
 }
 
 uint8_t serialGet(){
-	cli();
-	while(!((UCSR0A) & (1 << RXC0)));
-	return UDR0;
-	sei();
+	uint8_t data_;
+	while(!serialTryGet(&data_)) SIM_IDLE();
+	return data_;
+}
+
+uint8_t serial_rx_abort(){						// Drops everything up to and including the CTRL+X
+	for(uint8_t n = rx_tail; n != rx_head; n = (n + 1) & RX_RING_MASK){
+		if(rx_ring[n] == CTRL_X){
+			rx_tail = (n + 1) & RX_RING_MASK;
+			return 1;
+		}
+	}
+	return 0;
 }
 
 void serialWriteStr(const char *inpu){
@@ -1623,6 +5367,14 @@ void serialWriteStr(const char *inpu){
 	}
 }
 
+void serialWriteStr_P(const char *str){
+	char c_;
+	while((c_ = pgm_read_byte(str))){
+		serialWrite(c_);
+		str += 1;
+	}
+}
+
 
 void serialWriteNl(unsigned char data){
 	serialWrite(data);
@@ -1702,85 +5454,131 @@ void printBin8(uint8_t data){
 
 
 
-uint16_t serial_rx_ESC_seq(){           // If upper 8 bits are full esc code was called
-	uint16_t  ret;
-	uint8_t   val;
+// Escape decoder states
+#define ESC_ST_IDLE		0
+#define ESC_ST_ESC		1				// Got ESC
+#define ESC_ST_CSI		2				// Got ESC [
+#define ESC_TIMEOUT		(20 * TB_TICKS_PER_MS)	// Give up on a partial sequence after 20ms
 
-	val = serialGet();
+uint8_t esc_state = ESC_ST_IDLE;
+uint32_t esc_start = 0;
 
-	if(val != 27){                        // Check if ESC
-		ret = val;                          // Check for '['
-		} else {
-		val = serialGet();
-		
-		if(val != '['){
-			ret = val;                       // Return char if not full ESC code
-			} else {
-			val = serialGet();
-
-			if(val > 0x40 && val < 0x45){   // A - D, arrow keys
-				ret = val << 8;               // Store ESC Code char in upper byte
-				} else {
-				ret = val;                    // Return char if unknown ESC code
-			}
+uint16_t serial_rx_ESC_poll(){          // If upper 8 bits are full esc code was called
+	uint8_t val;
+	
+	while(serialTryGet(&val)){
+		switch(esc_state){
+			case ESC_ST_IDLE:
+				if(val != 27){					// Check if ESC
+					return val;
+				}
+				esc_state = ESC_ST_ESC;
+				esc_start = timebase_now();
+			break;
+			
+			case ESC_ST_ESC:
+				if(val != '['){
+					esc_state = ESC_ST_IDLE;
+					return val;					// Return char if not full ESC code
+				}
+				esc_state = ESC_ST_CSI;
+			break;
+			
+			default:
+				esc_state = ESC_ST_IDLE;
+				if(val > 0x40 && val < 0x45){	// A - D, arrow keys
+					return val << 8;			// Store ESC Code char in upper byte
+				}
+				return val;						// Return char if unknown ESC code
 		}
 	}
+	
+	// Nothing else arrived, a lone ESC key or a broken sequence must not hang the decoder
+	if(esc_state != ESC_ST_IDLE && (timebase_now() - esc_start) > ESC_TIMEOUT){
+		val = (esc_state == ESC_ST_ESC) ? 27 : '[';
+		esc_state = ESC_ST_IDLE;
+		return val;
+	}
+	return 0;
+}
+
+uint16_t serial_rx_ESC_seq(){           // Blocking wrapper of serial_rx_ESC_poll()
+	uint16_t ret;
+	while(!(ret = serial_rx_ESC_poll())) SIM_IDLE();
+	if(rx_head == rx_tail){						// Key ended on the newest byte, rx_stamp is its arrival
+		stat_add(STAT_RX, timebase_now() - rx_stamp_get());
+	}
 	return ret;
 }
 
-void term_Send_Val_as_Digits(uint8_t val){
-	uint8_t digit = '0';
+const uint32_t pow10_tbl[10] PROGMEM = {1000000000UL, 100000000UL, 10000000UL, 1000000UL,
+								100000UL, 10000UL, 1000UL, 100UL, 10UL, 1UL};
 
-	while(val >= 100){
-		digit += 1;
-		val -= 100;
+// Decimal digits of val into out, at least min_digits of them, a '.' before
+// the last frac (with a 0 ahead of it). Each digit is taken as a binary
+// number, val compared against 8, 4, 2 and 1 times its pow10_tbl entry, so
+// 4 subtracts at most instead of 9. Leading 0s are skipped in the table
+// first. Returns the length, no terminator, TERM_DEC_MAX at most
+uint8_t term_fmt_dec(char *out, uint32_t val, uint8_t min_digits, uint8_t frac){
+	uint8_t len_ = 0;
+	uint8_t n = 0;
+	
+	if(min_digits <= frac) min_digits = frac + 1;
+	while(n < 10 - min_digits && val < pgm_read_dword(&pow10_tbl[n])){
+		n++;
 	}
-	serialWrite(digit);
+	for(; n < 10; n++){
+		uint32_t step_ = pgm_read_dword(&pow10_tbl[n]) << 2;
+		uint8_t bit_ = 4;
+		if(n){							// 8 * 10^9 doesn't fit, the top digit is 4 at most
+			step_ <<= 1;
+			bit_ = 8;
+		}
+		uint8_t digit = '0';
+		for(; bit_; bit_ >>= 1, step_ >>= 1){
+			if(val >= step_){
+				val -= step_;
+				digit += bit_;
+			}
+		}
+		if(n == 10 - frac) out[len_++] = '.';
+		out[len_++] = digit;
+	}
+	return len_;
+}
 
-	digit = '0';
-	while(val >= 10){
-		digit += 1;
-		val -= 10;
+void term_Send_dec(uint32_t val, uint8_t min_digits, uint8_t frac){
+	char buf_[TERM_DEC_MAX];
+	uint8_t len_ = term_fmt_dec(buf_, val, min_digits, frac);
+	
+	for(uint8_t q = 0; q < len_; q++){
+		serialWrite(buf_[q]);
 	}
-	serialWrite(digit);
+}
 
-	serialWrite('0' + val);
+void term_Send_Val_as_Digits(uint8_t val){
+	term_Send_dec(val, 3, 0);
 }
 
 void term_Send_16_as_Digits(uint16_t val){
-	uint8_t digit = '0';
-	
-	while(val >= 10000){
-		digit += 1;
-		val -= 10000;
-	}
-	serialWrite(digit);
-	
-	digit = '0';
-	
-	while(val >= 1000){
-		digit += 1;
-		val -= 1000;
-	}
-	serialWrite(digit);
-	
-	digit = '0';
-	
-	while(val >= 100){
-		digit += 1;
-		val -= 100;
-	}
-	serialWrite(digit);
-	
-	digit = '0';
-	
-	while(val >= 10){
-		digit += 1;
-		val -= 10;
+	term_Send_dec(val, 5, 0);
+}
+
+void term_Send_32_as_Digits(uint32_t val, uint8_t frac){
+	term_Send_dec(val, 1, frac);
+}
+
+void term_Send_ppm(int32_t ppm){
+	if(ppm < 0){
+		serialWrite('-');
+		ppm = -ppm;
+	} else {
+		serialWrite('+');
 	}
-	serialWrite(digit);
-	
-	serialWrite('0' + val);
+	term_Send_32_as_Digits((uint32_t)ppm, 0);
+	serialWrite('p');
+	serialWrite('p');
+	serialWrite('m');
 }
 
 void term_Clear_ALL(){                    // Clear Screen
@@ -1823,42 +5621,252 @@ void term_Set_Display_Color(uint8_t FG_O_BG, uint8_t color){
 	serialWrite(color);
 	serialWrite('m');
 }
-void term_Set_Cursor_Pos(uint8_t row, uint8_t col){
-	SENDESC
-	term_Send_Val_as_Digits(row);
-	serialWrite(';');
-	term_Send_Val_as_Digits(col);
-	serialWrite('H');
+// Cursor tracking, every byte sent passes term_track() so the position is
+// known and cursor moves can pick the cheapest encoding
+#define TERM_POS_UNKNOWN	0					// row / col when we lost track
+#define TERM_POS_LEGACY		10					// ESC [ rrr ; ccc H, what every move used to cost
+
+// Horizontal move encodings
+#define TERM_MV_NONE		0
+#define TERM_MV_CR			1					// CR, then CUF if col > 1
+#define TERM_MV_BS			2
+#define TERM_MV_FWD			3					// CUF
+#define TERM_MV_BACK		4					// CUB
+
+uint8_t term_row = TERM_POS_UNKNOWN;
+uint8_t term_col = TERM_POS_UNKNOWN;			// TERM_W + 1 is the pending wrap after the last column
+uint8_t term_saved_row = TERM_POS_UNKNOWN;
+uint8_t term_saved_col = TERM_POS_UNKNOWN;
+uint8_t term_scroll_top = 1;
+uint8_t term_scroll_bot = TERM_H;
+uint8_t term_out_esc = 0;						// 1: ESC sent, 2: inside a CSI until the final byte
+uint32_t term_bytes_saved = 0;					// Against TERM_POS_LEGACY per cursor move
+
+void term_line_feed(){
+	if(term_row && term_row != term_scroll_bot && term_row < TERM_H){
+		term_row += 1;							// On the bottom margin LF scrolls, row stays
+	}
 }
-void term_Move_Cursor(uint8_t distance, uint8_t direction){
+
+void term_track(uint8_t data){
+	if(term_out_esc){							// Escapes fix up the position in their own term_ function
+		if(term_out_esc == 1){
+			term_out_esc = (data == '[') ? 2 : 0;
+		} else if(data >= 0x40 && data <= 0x7E){
+			term_out_esc = 0;
+		}
+		return;
+	}
+	
+	if(data >= ' ' && data < DELETE){
+		if(term_col > TERM_W){					// Auto wrap, don't guess where it went
+			term_row = TERM_POS_UNKNOWN;
+			term_col = TERM_POS_UNKNOWN;
+		} else if(term_col){
+			term_col += 1;
+		}
+		return;
+	}
+	
+	switch(data){
+		case 27:
+			term_out_esc = 1;
+		break;
+		case ENTER_KEY:
+			term_col = 1;
+		break;
+		case NEWLINE:
+			term_line_feed();
+		break;
+		case BACKSPACE:
+			if(term_col > TERM_W){
+				term_col = TERM_POS_UNKNOWN;
+			} else if(term_col > 1){
+				term_col -= 1;
+			}
+		break;
+		case '\t':
+			term_col = TERM_POS_UNKNOWN;
+		break;
+		default:
+		break;
+	}
+}
+
+void term_Send_Val_Unpadded(uint8_t val){
+	term_Send_dec(val, 1, 0);
+}
+
+uint8_t term_digits(uint8_t val){
+	return (val < 10) ? 1 : (val < 100) ? 2 : 3;
+}
+
+uint8_t term_csi_len(uint8_t count){			// ESC [ n X, a count of 1 is left out
+	return (count == 1) ? 3 : 3 + term_digits(count);
+}
+
+void term_csi_move(uint8_t count, uint8_t direction){
 	SENDESC
-	term_Send_Val_as_Digits(distance);
+	if(count != 1) term_Send_Val_Unpadded(count);
 	serialWrite(direction);
 }
+
+// Cheapest way from column from to column to on the same row
+uint8_t term_h_cost(uint8_t from, uint8_t to, uint8_t *how){
+	uint8_t cost, tmp_;
+	
+	*how = TERM_MV_CR;
+	cost = 1 + ((to > 1) ? term_csi_len(to - 1) : 0);
+	if(!from || from > TERM_W) return cost;	// Unknown or pending wrap, only CR is safe
+	
+	if(to == from){
+		*how = TERM_MV_NONE;
+		return 0;
+	}
+	if(to > from){
+		tmp_ = term_csi_len(to - from);
+		if(tmp_ < cost){
+			*how = TERM_MV_FWD;
+			cost = tmp_;
+		}
+		return cost;
+	}
+	
+	tmp_ = from - to;
+	if(tmp_ < cost){
+		*how = TERM_MV_BS;
+		cost = tmp_;
+	}
+	if(term_csi_len(from - to) < cost){
+		*how = TERM_MV_BACK;
+		cost = term_csi_len(from - to);
+	}
+	return cost;
+}
+
+void term_h_emit(uint8_t from, uint8_t to, uint8_t how){
+	switch(how){
+		case TERM_MV_CR:
+			serialWrite(ENTER_KEY);
+			if(to > 1) term_csi_move(to - 1, MOVE_RIGHT);
+		break;
+		case TERM_MV_BS:
+			for(; from > to; from--){
+				serialWrite(BACKSPACE);
+			}
+		break;
+		case TERM_MV_FWD:
+			term_csi_move(to - from, MOVE_RIGHT);
+		break;
+		case TERM_MV_BACK:
+			term_csi_move(from - to, MOVE_LEFT);
+		break;
+		default:
+		break;
+	}
+}
+
+uint8_t term_scroll_side(uint8_t row){	// 0 above the scroll region, 1 in it, 2 below
+	return (row >= term_scroll_top) + (row > term_scroll_bot);
+}
+
+void term_Set_Cursor_Pos(uint8_t row, uint8_t col){
+	uint8_t best, how, rel;
+	uint8_t use_rel = 0;
+	
+	// Absolute: ESC [ H, ESC [ r H or ESC [ r ; c H
+	if(col == 1){
+		best = (row == 1) ? 3 : 3 + term_digits(row);
+	} else {
+		best = 4 + term_digits(row) + term_digits(col);
+	}
+	
+	// Relative, CUU stops on the top margin from anywhere below it and CUD on the
+	// bottom one from anywhere above it, so only when no margin is in the way
+	if(term_row && (row == term_row || term_scroll_side(row) == term_scroll_side(term_row))){
+		rel = term_h_cost(term_col, col, &how);
+		if(row != term_row){
+			rel += term_csi_len((row > term_row) ? row - term_row : term_row - row);
+		}
+		if(rel < best){
+			best = rel;
+			use_rel = 1;
+		}
+	}
+	
+	if(use_rel){
+		if(row > term_row){
+			term_csi_move(row - term_row, MOVE_DOWN);
+		} else if(row < term_row){
+			term_csi_move(term_row - row, MOVE_UP);
+		}
+		term_h_emit(term_col, col, how);
+	} else {
+		SENDESC
+		if(row != 1 || col != 1) term_Send_Val_Unpadded(row);
+		if(col != 1){
+			serialWrite(';');
+			term_Send_Val_Unpadded(col);
+		}
+		serialWrite('H');
+	}
+	
+	term_row = row;
+	term_col = col;
+	term_bytes_saved += TERM_POS_LEGACY - best;
+}
+
+void term_Move_Cursor(uint8_t distance, uint8_t direction){
+	uint8_t limit_;
+	uint8_t row_ok = term_row, col_ok = term_col;
+	
+	if(!distance) return;						// ESC [ 0 X would still move one cell
+	if(direction == MOVE_LEFT && distance < term_csi_len(distance) && term_col <= TERM_W){
+		for(uint8_t n = 0; n < distance; n++){
+			serialWrite(BACKSPACE);				// Tracked by term_track()
+		}
+		term_bytes_saved += 6 - distance;
+		return;
+	}
+	term_csi_move(distance, direction);
+	term_bytes_saved += 6 - term_csi_len(distance);
+	
+	if(term_col > TERM_W) term_col = TERM_W;
+	switch(direction){
+		case MOVE_UP:
+			limit_ = (term_row >= term_scroll_top) ? term_scroll_top : 1;
+			term_row = (term_row > limit_ + distance) ? term_row - distance : limit_;
+		break;
+		case MOVE_DOWN:
+			limit_ = (term_row <= term_scroll_bot) ? term_scroll_bot : TERM_H;
+			term_row = (term_row + distance < limit_) ? term_row + distance : limit_;
+		break;
+		case MOVE_RIGHT:
+			term_col = (term_col + distance < TERM_W) ? term_col + distance : TERM_W;
+		break;
+		default:
+			term_col = (term_col > 1 + distance) ? term_col - distance : 1;
+		break;
+	}
+	if(!row_ok) term_row = TERM_POS_UNKNOWN;	// Stay unknown if we were
+	if(!col_ok) term_col = TERM_POS_UNKNOWN;
+}
 void term_Save_Cursor_Pos(){
 	SENDESC
 	serialWrite('s');
+	term_saved_row = term_row;
+	term_saved_col = term_col;
 }
 void term_Recall_Cursor_Pos(){
 	SENDESC
 	serialWrite('u');
+	term_row = term_saved_row;
+	term_col = term_saved_col;
 }
 
 
 void termCurPosB(uint8_t row, uint8_t col){
-	term_Set_Cursor_Pos(1, 1);
-	uint8_t n;
-	
-	for(n = 1; n < col; n++){
-		term_Move_Cursor(1, MOVE_RIGHT);
-	}
-	
-	for(n = 1; n < row; n++){
-		term_Move_Cursor(1, MOVE_DOWN);
-		if(!col){
-			term_Move_Cursor(1, MOVE_LEFT);
-		}
-	}
+	term_Set_Cursor_Pos(row, col ? col : 1);
 }
 
 
@@ -1880,15 +5888,94 @@ void term_Cursor_Visibility(uint8_t en){
 void term_Set_Scroll_All(){
 	SENDESC
 	serialWrite('r');
+	term_scroll_top = 1;
+	term_scroll_bot = TERM_H;
+	term_row = 1;								// DECSTBM homes the cursor
+	term_col = 1;
 }
 void term_Set_Scroll_Mode_Limit(uint8_t start, uint8_t end){    // Set Scroll Limits
 	SENDESC
-	term_Send_Val_as_Digits(start);
+	term_Send_Val_Unpadded(start);
 	serialWrite(';');
-	term_Send_Val_as_Digits(end);
+	term_Send_Val_Unpadded(end);
 	serialWrite('r');
+	term_scroll_top = start;
+	term_scroll_bot = end;
+	term_row = 1;
+	term_col = 1;
 }
 void term_Print_Screen(){
 	SENDESC
 	serialWrite('1');
 }
+
+
+  //////////////////////////////////////////////////////////////////////////
+ //							MEMORY										 //
+//////////////////////////////////////////////////////////////////////////
+
+// MEM, where the 2kB of SRAM went: the big static buffers, all of .data and
+// .bss, and the stack. ram_paint() fills the free RAM at boot, whatever is
+// still painted is the least headroom the stack has had since.
+// Strings and constant tables live in flash (PROGMEM) and cost no SRAM.
+
+#define RAM_PAINT		0xC5
+#define RAM_MARGIN		16			// Left alone below SP while painting, ram_paint()'s own frame
+#define RAM_ITEM_CT		(sizeof(ram_items) / sizeof(ram_items[0]))
+
+typedef struct{
+	char name[12];
+	uint16_t len;
+} RAM_ITEM;
+
+const RAM_ITEM ram_items[] PROGMEM = {
+	{"zepto_array",	sizeof(zepto_array)},
+	{"zepto_prog",	sizeof(zepto_prog)},
+	{"line_entry",	sizeof(line_entry)},
+	{"tx_ring",		sizeof(tx_ring)},
+	{"rx_ring",		sizeof(rx_ring)},
+	{"log_ring",	sizeof(log_ring)},
+	{"cap_ring",	sizeof(cap_ring)},
+	{"mc_frame",	sizeof(mc_frame)},
+	{"stats",		sizeof(stats)},
+};
+
+void ram_paint(){
+	for(uint8_t *p_ = RAM_LOW; p_ < RAM_SP() - RAM_MARGIN; p_++){
+		*p_ = RAM_PAINT;
+	}
+}
+
+void mem_line(const char *name, uint16_t len){	// name in flash
+	serialWriteStr_P(name);
+	while(term_col && term_col < 14) serialWrite(' ');
+	term_Send_32_as_Digits(len, 0);
+	serialWriteStr_P(PSTR("\r\n"));
+}
+
+uint8_t mem_print(){
+	uint16_t listed_ = 0;
+	uint16_t unused_ = 0;
+	uint8_t *sp_ = RAM_SP();
+	
+	for(uint8_t *p_ = RAM_LOW; p_ < sp_ && *p_ == RAM_PAINT; p_++){
+		unused_ += 1;
+	}
+	
+	term_Set_Scroll_All();
+	term_Clear_ALL();
+	term_Set_Cursor_Pos(1, 1);
+	serialWriteStr_P(PSTR("MEM bytes\r\n"));
+	for(uint8_t n = 0; n < RAM_ITEM_CT; n++){
+		mem_line(ram_items[n].name, pgm_read_word(&ram_items[n].len));
+		listed_ += pgm_read_word(&ram_items[n].len);
+	}
+	mem_line(PSTR("listed"), listed_);
+	mem_line(PSTR("static"), RAM_LOW - RAM_START);		// .data + .bss
+	mem_line(PSTR("stack"), RAM_TOP - sp_);
+	mem_line(PSTR("free"), sp_ - RAM_LOW);
+	mem_line(PSTR("free min"), unused_);
+	serialWriteStr_P(PSTR("END, any key\r\n"));
+	serialGet();
+	return 3;							// Shell needs a full redraw
+}